@@ -1,27 +1,314 @@
+#include <stdio.h>
 #include <stdlib.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #include "base.h"
 
-Arena* new_arena(u64 size) {
-    Arena* arena = malloc(sizeof(Arena) + size);
-    arena->memory = arena + 1;
-    arena->size = size;
-    arena->allocated = 0;
+#define ARENA_COMMIT_GRANULARITY (64 * 1024)
+#define ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// The header lives at the start of the reservation, in front of the memory handed out.
+#define ARENA_HEADER_SIZE ((sizeof(Arena) + 63) & ~63ull)
+
+internal u64 round_up(u64 value, u64 granularity) {
+    return (value + granularity - 1) / granularity * granularity;
+}
+
+internal bool commit_pages(u8* memory, u64 size) {
+#if defined(_WIN32)
+    return VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE) != 0;
+#else
+    return mprotect(memory, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+Arena* new_arena(u64 reserve_size, ArenaFlags flags) {
+    u64 granularity = ARENA_COMMIT_GRANULARITY;
+    u64 total = round_up(ARENA_HEADER_SIZE + reserve_size, ARENA_COMMIT_GRANULARITY);
+
+#if defined(_WIN32)
+    // Large pages on Windows need a privilege and can't be committed lazily.
+    (void)flags;
+    u8* base = VirtualAlloc(0, total, MEM_RESERVE, PAGE_NOACCESS);
+    assert(base && "failed to reserve arena");
+#else
+    u64 alignment = 0;
+    if (flags & ARENA_HUGE_PAGES) {
+        granularity = ARENA_HUGE_PAGE_SIZE;
+        total = round_up(total, ARENA_HUGE_PAGE_SIZE);
+        alignment = ARENA_HUGE_PAGE_SIZE;
+    }
+
+    u8* mapping = mmap(0, total + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(mapping != MAP_FAILED && "failed to reserve arena");
+
+    // Trim the mapping so huge pages line up with the start of the reservation.
+    u8* base = mapping;
+    if (alignment) {
+        base = (u8*)round_up((u64)mapping, alignment);
+        if (base != mapping) {
+            munmap(mapping, base - mapping);
+        }
+        munmap(base + total, mapping + alignment - base);
+    }
+
+#if defined(MADV_HUGEPAGE)
+    if (flags & ARENA_HUGE_PAGES) {
+        madvise(base, total, MADV_HUGEPAGE);
+    }
+#endif
+#endif
+
+    bool committed = commit_pages(base, granularity);
+    assert(committed && "failed to commit arena memory");
+
+    Arena* arena = (Arena*)base;
+    *arena = (Arena){
+        .memory = base + ARENA_HEADER_SIZE,
+        .reserved = total - ARENA_HEADER_SIZE,
+        .committed = granularity - ARENA_HEADER_SIZE,
+        .commit_granularity = granularity
+    };
+
     return arena;
 }
 
+void free_arena(Arena* arena) {
+#if defined(_WIN32)
+    VirtualFree(arena, 0, MEM_RELEASE);
+#else
+    munmap(arena, ARENA_HEADER_SIZE + arena->reserved);
+#endif
+}
+
+void print_arena_usage(char* name, Arena* arena) {
+    printf("%s: %.2f MB peak, %.2f MB committed\n", name, (f64)arena->peak_allocated / (1024.0 * 1024.0), (f64)(ARENA_HEADER_SIZE + arena->committed) / (1024.0 * 1024.0));
+}
+
+internal void grow_arena(Arena* arena, u64 required) {
+    assert(required <= arena->reserved && "arena reservation exhausted");
+
+    u64 committed = round_up(ARENA_HEADER_SIZE + required, arena->commit_granularity) - ARENA_HEADER_SIZE;
+    if (committed > arena->reserved) {
+        committed = arena->reserved;
+    }
+
+    bool success = commit_pages((u8*)arena->memory + arena->committed, committed - arena->committed);
+    assert(success && "failed to commit arena memory");
+
+    arena->committed = committed;
+}
+
 void* arena_push(Arena* arena, u64 size) {
     size = (size + 7) & ~7;
-    assert(arena->size-arena->allocated >= size && "arena out of memory");
 
     u64 offset = arena->allocated;
-    arena->allocated += size;
+    u64 end = offset + size;
+
+    if (end > arena->committed) {
+        grow_arena(arena, end);
+    }
+
+    arena->allocated = end;
+    if (end > arena->peak_allocated) {
+        arena->peak_allocated = end;
+    }
 
     return size ? (u8*)arena->memory + offset : 0;
 }
 
 void* arena_push_zero(Arena* arena, u64 size) {
     void* memory = arena_push(arena, size);
-    memset(memory, 0, size);
+    if (memory) {
+        memset(memory, 0, size);
+    }
     return memory;
 }
+
+// Grows the most recent allocation in place, otherwise moves it to the top of the arena.
+void* arena_resize(Arena* arena, void* memory, u64 old_size, u64 new_size) {
+    u64 old_rounded = (old_size + 7) & ~7;
+
+    if (memory && (u8*)memory + old_rounded == (u8*)arena->memory + arena->allocated) {
+        arena->allocated -= old_rounded;
+        void* grown = arena_push(arena, new_size);
+        assert(grown == memory);
+        return grown;
+    }
+
+    void* grown = arena_push(arena, new_size);
+    if (old_size) {
+        memcpy(grown, memory, old_size);
+    }
+    return grown;
+}
+
+f64 get_time() {
+#if defined(_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (f64)counter.QuadPart / (f64)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (f64)now.tv_sec + (f64)now.tv_nsec * 1e-9;
+#endif
+}
+
+bool map_file(char* path, MappedFile* file) {
+    *file = (MappedFile){0};
+
+#if defined(_WIN32)
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size)) {
+        CloseHandle(handle);
+        return false;
+    }
+
+    if (size.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(handle, 0, PAGE_READONLY, 0, 0, 0);
+        if (mapping) {
+            file->memory = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+
+    CloseHandle(handle);
+    file->size = (u64)size.QuadPart;
+#else
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor == -1) {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(descriptor, &status) == -1) {
+        close(descriptor);
+        return false;
+    }
+
+    if (status.st_size > 0) {
+        void* memory = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        file->memory = memory == MAP_FAILED ? 0 : memory;
+    }
+
+    close(descriptor);
+    file->size = (u64)status.st_size;
+#endif
+
+    // Empty files can't be mapped; hand out an empty range instead.
+    if (file->size == 0) {
+        file->memory = "";
+        return true;
+    }
+
+    return file->memory != 0;
+}
+
+void unmap_file(MappedFile* file) {
+    if (file->size) {
+#if defined(_WIN32)
+        UnmapViewOfFile(file->memory);
+#else
+        munmap(file->memory, file->size);
+#endif
+    }
+
+    *file = (MappedFile){0};
+}
+
+internal per_thread Arena* scratch_arenas[SCRATCH_ARENA_COUNT];
+
+Scratch get_scratch(Arena* conflict)
+{
+    for (int i = 0; i < SCRATCH_ARENA_COUNT; ++i)
+    {
+        if (!scratch_arenas[i]) {
+            scratch_arenas[i] = new_arena(DEFAULT_ARENA_RESERVE, ARENA_DEFAULT);
+        }
+
+        Arena* arena = scratch_arenas[i];
+        if (conflict != arena)
+        {
+            return (Scratch) {
+                .arena = arena,
+                .allocated = arena->allocated
+            };
+        }
+    }
+
+    assert(false);
+    return (Scratch){0};
+}
+
+void release_scratch(Scratch* scratch) {
+    assert(scratch->allocated <= scratch->arena->allocated);
+    scratch->arena->allocated = scratch->allocated;
+}
+
+void print_scratch_usage(void) {
+    for (int i = 0; i < SCRATCH_ARENA_COUNT; ++i) {
+        if (scratch_arenas[i]) {
+            char name[32];
+            snprintf(name, sizeof(name), "scratch %d", i);
+            print_arena_usage(name, scratch_arenas[i]);
+        }
+    }
+}
+
+ScratchWatermark begin_scratch_watermark(void) {
+    ScratchWatermark watermark = {0};
+
+    for (int i = 0; i < SCRATCH_ARENA_COUNT; ++i) {
+        Arena* arena = scratch_arenas[i];
+        if (arena) {
+            watermark.allocated[i] = arena->allocated;
+            watermark.peak_allocated[i] = arena->peak_allocated;
+            arena->peak_allocated = arena->allocated;
+        }
+    }
+
+    return watermark;
+}
+
+u64 end_scratch_watermark(ScratchWatermark* watermark) {
+    u64 rise = 0;
+
+    for (int i = 0; i < SCRATCH_ARENA_COUNT; ++i) {
+        Arena* arena = scratch_arenas[i];
+        if (arena) {
+            rise += arena->peak_allocated - watermark->allocated[i];
+            if (watermark->peak_allocated[i] > arena->peak_allocated) {
+                arena->peak_allocated = watermark->peak_allocated[i];
+            }
+        }
+    }
+
+    return rise;
+}
+
+// Threads other than the main one should call this before they exit.
+void free_scratch_arenas(void) {
+    for (int i = 0; i < SCRATCH_ARENA_COUNT; ++i) {
+        if (scratch_arenas[i]) {
+            free_arena(scratch_arenas[i]);
+            scratch_arenas[i] = 0;
+        }
+    }
+}
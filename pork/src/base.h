@@ -5,6 +5,10 @@
 #include <assert.h>
 #include <memory.h>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 typedef uint8_t  u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
@@ -20,26 +24,112 @@ typedef double f64;
 
 #define internal static
 
+#if defined(_MSC_VER)
+#define per_thread __declspec(thread)
+#else
+#define per_thread __thread
+#endif
+
 #define LENGTH(x) (sizeof(x)/sizeof(x[0]))
 
+#if defined(_MSC_VER)
+static inline u32 count_trailing_zeros32(u32 x) {
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return index;
+}
+
+static inline u32 count_set_bits32(u32 x) {
+    return __popcnt(x);
+}
+
+static inline u32 count_trailing_zeros64(u64 x) {
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return index;
+}
+
+static inline u32 count_set_bits64(u64 x) {
+    return (u32)__popcnt64(x);
+}
+#else
+static inline u32 count_trailing_zeros32(u32 x) {
+    return __builtin_ctz(x);
+}
+
+static inline u32 count_set_bits32(u32 x) {
+    return __builtin_popcount(x);
+}
+
+static inline u32 count_trailing_zeros64(u64 x) {
+    return __builtin_ctzll(x);
+}
+
+static inline u32 count_set_bits64(u64 x) {
+    return __builtin_popcountll(x);
+}
+#endif
+
+f64 get_time();
+
 typedef struct {
     void* memory;
     u64 size;
+} MappedFile;
+
+bool map_file(char* path, MappedFile* file);
+void unmap_file(MappedFile* file);
+
+typedef enum {
+    ARENA_DEFAULT = 0,
+    ARENA_HUGE_PAGES = 1 << 0, // Ask for transparent huge pages. Ignored where the OS has none.
+} ArenaFlags;
+
+// Arenas reserve a range of address space up front and commit pages as allocations
+// reach them, so they only run out when the reservation does.
+typedef struct {
+    void* memory;
     u64 allocated;
+
+    u64 reserved;
+    u64 committed; // Pages are never decommitted, so this is also the high-water mark.
+    u64 peak_allocated;
+    u64 commit_granularity;
 } Arena;
 
-Arena* new_arena(u64 size);
+#define DEFAULT_ARENA_RESERVE (sizeof(void*) == 8 ? 64ull << 30 : 256ull << 20)
+
+Arena* new_arena(u64 reserve_size, ArenaFlags flags);
+void free_arena(Arena* arena);
+void print_arena_usage(char* name, Arena* arena);
 
 void* arena_push(Arena* arena, u64 size);
 void* arena_push_zero(Arena* arena, u64 size);
+void* arena_resize(Arena* arena, void* memory, u64 old_size, u64 new_size);
 
-#define arena_push_array(arena, type, count) (type*)arena_push_zero(arena, sizeof(type) * count)
+#define arena_push_array(arena, type, count) (type*)arena_push_zero(arena, sizeof(type) * (count))
 #define arena_push_type(arena, type) arena_push_array(arena, type, 1)
+#define arena_grow_array(arena, array, count, capacity) arena_resize(arena, array, sizeof(*(array)) * (count), sizeof(*(array)) * (capacity))
 
 typedef struct {
     Arena* arena;
     u64 allocated;
 } Scratch;
 
+#define SCRATCH_ARENA_COUNT 2
+
+// Every thread has its own scratch arenas, created on first use.
 Scratch get_scratch(Arena* conflict);
 void release_scratch(Scratch* scratch);
+void print_scratch_usage(void);
+void free_scratch_arenas(void);
+
+// Measures how high the scratch arenas rise over a stretch of work, without losing the
+// overall peaks that print_scratch_usage reports.
+typedef struct {
+    u64 allocated[SCRATCH_ARENA_COUNT];
+    u64 peak_allocated[SCRATCH_ARENA_COUNT];
+} ScratchWatermark;
+
+ScratchWatermark begin_scratch_watermark(void);
+u64 end_scratch_watermark(ScratchWatermark* watermark);
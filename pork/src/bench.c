@@ -0,0 +1,1612 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "bench.h"
+#include "bytecode.h"
+#include "compile.h"
+#include "fold.h"
+#include "gvn.h"
+#include "lexer.h"
+#include "loop.h"
+#include "parse.h"
+#include "semantics.h"
+#include "set.h"
+#include "ssa.h"
+#include "vm.h"
+
+typedef struct {
+    char* memory;
+    u64 length;
+    u64 capacity;
+} SourceBuilder;
+
+internal SourceBuilder new_source_builder(Arena* arena, u64 capacity) {
+    return (SourceBuilder) {
+        .memory = arena_push(arena, capacity),
+        .capacity = capacity
+    };
+}
+
+internal void append(SourceBuilder* builder, char* format, ...) {
+    va_list argument_list;
+    va_start(argument_list, format);
+    int length = vsnprintf(builder->memory + builder->length, builder->capacity - builder->length, format, argument_list);
+    va_end(argument_list);
+
+    assert(length >= 0 && builder->length + length < builder->capacity && "source builder out of memory");
+    builder->length += length;
+}
+
+internal Source finish_source(SourceBuilder* builder) {
+    return (Source) {
+        .memory = builder->memory,
+        .length = builder->length
+    };
+}
+
+internal u64 lex_all(Source* source, LexerMode mode) {
+    Lexer lexer = init_lexer(source->memory, source->memory + source->length, mode);
+
+    u64 count = 0;
+    while (get_token(&lexer).kind != TOKEN_EOF) {
+        ++count;
+    }
+
+    return count;
+}
+
+internal bool bench_lexer(Arena* arena) {
+    SourceBuilder builder = new_source_builder(arena, 16 * 1024 * 1024);
+
+    append(&builder, "{\n");
+    for (int i = 0; builder.length < builder.capacity - 256; ++i) {
+        append(&builder, "    i32 generated_value_%d = generated_value_%d * %d + 1024;\n", i, i - 1, i % 97);
+        if (i % 16 == 0) {
+            append(&builder, "\n    while generated_value_%d <= %d {\n        u8 x = x / 2;\n    }\n\n", i, i * 3);
+        }
+    }
+    append(&builder, "    return 0;\n}\n");
+
+    Source source = finish_source(&builder);
+
+    Lexer reference = init_lexer(source.memory, source.memory + source.length, LEXER_REFERENCE);
+    Lexer fast = init_lexer(source.memory, source.memory + source.length, LEXER_FAST);
+
+    for (;;) {
+        Token a = get_token(&reference);
+        Token b = get_token(&fast);
+
+        if (a.kind != b.kind || a.memory != b.memory || a.length != b.length || a.line != b.line) {
+            printf("lexer: token mismatch on line %d\n", a.line);
+            return false;
+        }
+
+        if (a.kind == TOKEN_EOF) {
+            break;
+        }
+    }
+
+    f64 best[3] = { 1e9, 1e9, 1e9 };
+    u64 token_count = 0;
+
+    for (int repeat = 0; repeat < 5; ++repeat) {
+        for (int mode = 0; mode < 2; ++mode) {
+            f64 start = get_time();
+            token_count = lex_all(&source, mode == 0 ? LEXER_REFERENCE : LEXER_FAST);
+            f64 elapsed = get_time() - start;
+            best[mode] = elapsed < best[mode] ? elapsed : best[mode];
+        }
+
+        u64 allocated = arena->allocated;
+        f64 start = get_time();
+        SymbolTable symbols = {0};
+        tokenize(arena, &source, &symbols);
+        f64 elapsed = get_time() - start;
+        best[2] = elapsed < best[2] ? elapsed : best[2];
+        arena->allocated = allocated;
+    }
+
+    f64 megabytes = (f64)builder.length / (1024.0 * 1024.0);
+    printf("lexer: %.1f MB, %llu tokens\n", megabytes, (unsigned long long)token_count);
+    printf("  reference: %8.1f MB/s\n", megabytes / best[0]);
+    printf("  fast:      %8.1f MB/s (%.2fx)\n", megabytes / best[1], best[0] / best[1]);
+    printf("  tokenize:  %8.1f MB/s (%.2fx)\n", megabytes / best[2], best[0] / best[2]);
+
+    return true;
+}
+
+internal bool bench_identifiers(Arena* arena) {
+    SourceBuilder builder = new_source_builder(arena, 16 * 1024 * 1024);
+
+    int variable_count = 5000;
+    int statement_count = 50000;
+
+    append(&builder, "{\n");
+    for (int i = 0; i < variable_count; ++i) {
+        append(&builder, "    i32 generated_identifier_with_a_common_prefix_%d = %d;\n", i, i);
+    }
+    for (int i = 0; i < statement_count; ++i) {
+        int a = (int)(((u64)i * 7919) % variable_count);
+        int b = (int)(((u64)i * 104729) % variable_count);
+        int c = (int)(((u64)i * 1299709) % variable_count);
+        append(&builder, "    generated_identifier_with_a_common_prefix_%d = generated_identifier_with_a_common_prefix_%d + generated_identifier_with_a_common_prefix_%d;\n", a, b, c);
+    }
+    append(&builder, "    return generated_identifier_with_a_common_prefix_0;\n}\n");
+
+    Source source = finish_source(&builder);
+
+    Program program = {0};
+    init_program(arena, &program);
+
+    f64 start = get_time();
+    ASTFunction* ast_function = parse(arena, &source, &program);
+    f64 parse_time = get_time() - start;
+
+    if (!ast_function) {
+        return false;
+    }
+
+    start = get_time();
+    bool success = analyze_semantics(arena, &source, &program, ast_function);
+    f64 semantics_time = get_time() - start;
+
+    int lookup_count = variable_count + statement_count * 3 + 1;
+
+    printf("identifiers: %d variables, %u distinct symbols, %d resolutions\n", variable_count, program.symbols.count, lookup_count);
+    printf("  parse:     %8.2f ms\n", parse_time * 1000.0);
+    printf("  semantics: %8.2f ms (%.1f ns per resolution)\n", semantics_time * 1000.0, semantics_time * 1e9 / lookup_count);
+
+    return success;
+}
+
+internal bool bench_scopes(Arena* arena) {
+    SourceBuilder builder = new_source_builder(arena, 16 * 1024 * 1024);
+
+    int depth = 100;
+    int locals_per_scope = 200;
+    int uses_per_scope = 1000;
+
+    u32 seed = 1;
+    int lookup_count = 1;
+
+    for (int level = 0; level < depth; ++level) {
+        append(&builder, "{\n");
+
+        for (int i = 0; i < locals_per_scope; ++i) {
+            append(&builder, "i32 local_%d_%d = %d;\n", level, i, i);
+        }
+
+        // Uses reach into every enclosing scope, not just the innermost one.
+        for (int i = 0; i < uses_per_scope; ++i) {
+            seed = seed * 1664525 + 1013904223;
+            int a_level = (seed >> 8) % (level + 1);
+            int a_index = (seed >> 20) % locals_per_scope;
+            seed = seed * 1664525 + 1013904223;
+            int b_level = (seed >> 8) % (level + 1);
+            int b_index = (seed >> 20) % locals_per_scope;
+
+            append(&builder, "local_%d_%d = local_%d_%d;\n", a_level, a_index, b_level, b_index);
+        }
+
+        lookup_count += locals_per_scope + uses_per_scope * 2;
+    }
+
+    append(&builder, "return local_0_0;\n");
+    for (int level = 0; level < depth; ++level) {
+        append(&builder, "}\n");
+    }
+
+    Source source = finish_source(&builder);
+
+    Program program = {0};
+    init_program(arena, &program);
+
+    ASTFunction* ast_function = parse(arena, &source, &program);
+    if (!ast_function) {
+        return false;
+    }
+
+    f64 start = get_time();
+    bool success = analyze_semantics(arena, &source, &program, ast_function);
+    f64 semantics_time = get_time() - start;
+
+    printf("scopes: %d nested blocks, %d locals each, %d resolutions\n", depth, locals_per_scope, lookup_count);
+    printf("  semantics: %8.2f ms (%.1f ns per resolution)\n", semantics_time * 1000.0, semantics_time * 1e9 / lookup_count);
+
+    return success;
+}
+
+// Layout of the former pointer-based ASTNode, kept to report the footprint saved by the node pools.
+typedef struct PointerASTNode PointerASTNode;
+struct PointerASTNode {
+    ASTKind kind;
+    PointerASTNode* next;
+    Token token;
+    Type* type;
+    union {
+        u64 int_literal;
+        PointerASTNode* children[3];
+    };
+};
+
+internal bool bench_ast(Arena* arena) {
+    SourceBuilder builder = new_source_builder(arena, 4 * 1024 * 1024);
+
+    int variable_count = 64;
+
+    append(&builder, "{\n");
+    for (int i = 0; i < variable_count; ++i) {
+        append(&builder, "    i32 v%d = %d;\n", i, i);
+    }
+    for (int i = 0; builder.length < builder.capacity - 512; ++i) {
+        int a = i % variable_count;
+        int b = (i * 7) % variable_count;
+        int c = (i * 13) % variable_count;
+        append(&builder, "    while v%d < %d {\n        v%d = v%d * 3 + v%d / 2 - 1;\n        if v%d == 5 { v%d = v%d + 1; }\n    }\n", a, i, a, b, c, b, c, a);
+    }
+    append(&builder, "    return v0;\n}\n");
+
+    Source source = finish_source(&builder);
+
+    Program program = {0};
+    init_program(arena, &program);
+
+    f64 start = get_time();
+    ASTFunction* ast_function = parse(arena, &source, &program);
+    f64 parse_time = get_time() - start;
+
+    if (!ast_function) {
+        return false;
+    }
+
+    start = get_time();
+    bool success = analyze_semantics(arena, &source, &program, ast_function);
+    f64 semantics_time = get_time() - start;
+
+    AST* ast = &ast_function->ast;
+
+    u64 node_bytes = sizeof(u8) + sizeof(u32) + sizeof(Type*) + sizeof(u32) * 4;
+    u64 pool_bytes = ast->count * node_bytes + ast->literal_count * sizeof(u64);
+    u64 pointer_bytes = ast->count * sizeof(PointerASTNode);
+
+    printf("ast: %.1f MB source, %u nodes, %u literals\n", (f64)source.length / (1024.0 * 1024.0), ast->count, ast->literal_count);
+    printf("  node pools:    %8.2f MB (%llu bytes per node)\n", (f64)pool_bytes / (1024.0 * 1024.0), (unsigned long long)node_bytes);
+    printf("  pointer nodes: %8.2f MB (%llu bytes per node), %.2fx larger\n", (f64)pointer_bytes / (1024.0 * 1024.0), (unsigned long long)sizeof(PointerASTNode), (f64)pointer_bytes / (f64)pool_bytes);
+    printf("  parse:         %8.2f ms\n", parse_time * 1000.0);
+    printf("  semantics:     %8.2f ms\n", semantics_time * 1000.0);
+
+    return success;
+}
+
+internal bool bench_nesting_case(Arena* arena, char* name, Source source, int depth) {
+    Program program = {0};
+    init_program(arena, &program);
+
+    f64 start = get_time();
+    ASTFunction* ast_function = parse(arena, &source, &program);
+    f64 parse_time = get_time() - start;
+
+    if (!ast_function) {
+        return false;
+    }
+
+    start = get_time();
+    bool success = analyze_semantics(arena, &source, &program, ast_function);
+    f64 semantics_time = get_time() - start;
+
+    printf("  %-12s parse %8.2f ms, semantics %8.2f ms (%.1f ns per level)\n", name, parse_time * 1000.0, semantics_time * 1000.0, (parse_time + semantics_time) * 1e9 / depth);
+
+    return success;
+}
+
+internal bool bench_nesting(Arena* arena) {
+    int depth = 100000;
+    bool success = true;
+
+    printf("nesting: %d levels deep\n", depth);
+
+    // Left-deep operator chain.
+    SourceBuilder builder = new_source_builder(arena, 16 * 1024 * 1024);
+    append(&builder, "{\n    i32 x = 1;\n    return x");
+    for (int i = 0; i < depth; ++i) {
+        append(&builder, i % 2 ? " + x" : " - x");
+    }
+    append(&builder, ";\n}\n");
+    success &= bench_nesting_case(arena, "operators", finish_source(&builder), depth);
+
+    // Right-deep assignment chain.
+    builder = new_source_builder(arena, 16 * 1024 * 1024);
+    append(&builder, "{\n    i32 x = 1;\n    i32 y = 2;\n    ");
+    for (int i = 0; i < depth; ++i) {
+        append(&builder, i % 2 ? "x = " : "y = ");
+    }
+    append(&builder, "1;\n    return x;\n}\n");
+    success &= bench_nesting_case(arena, "assignments", finish_source(&builder), depth);
+
+    // Nested ifs and whiles.
+    builder = new_source_builder(arena, 16 * 1024 * 1024);
+    append(&builder, "{\n    i32 x = 1;\n");
+    for (int i = 0; i < depth; ++i) {
+        append(&builder, i % 2 ? "while x < %d {\n" : "if x == %d {\n", i);
+    }
+    append(&builder, "x = x + 1;\n");
+    for (int i = 0; i < depth; ++i) {
+        append(&builder, (depth - 1 - i) % 2 ? "}\n" : "} else { x = 0; }\n");
+    }
+    append(&builder, "    return x;\n}\n");
+    success &= bench_nesting_case(arena, "statements", finish_source(&builder), depth);
+
+    return success;
+}
+
+internal f64 time_compile(Arena* arena, Source* source, OptimizationLevel level, RegisterAllocator allocator, int repetitions, Bytecode** bytecode) {
+    u64 allocated = arena->allocated;
+
+    f64 start = get_time();
+    for (int i = 0; i < repetitions; ++i) {
+        arena->allocated = allocated;
+        *bytecode = compile(arena, source, level, allocator, 0);
+    }
+
+    return (get_time() - start) / repetitions;
+}
+
+internal bool bench_compile(Arena* arena) {
+    // A small function compiled many times, the scaling benchmark covers large ones.
+    SourceBuilder builder = new_source_builder(arena, 64 * 1024);
+
+    append(&builder, "{\n    i32 a = 1;\n    i32 b = 2;\n    i32 c = 3;\n");
+    for (int i = 0; i < 20; ++i) {
+        append(&builder, "    a = a + b * %d;\n    c = c - a / %d;\n", i % 13 + 1, i % 7 + 1);
+        if (i % 4 == 0) {
+            append(&builder, "    while b < %d {\n        b = b + 1;\n    }\n", i);
+        }
+    }
+    append(&builder, "    return a + b + c;\n}\n");
+
+    Source source = finish_source(&builder);
+    f64 kilobytes = (f64)source.length / 1024.0;
+    int repetitions = 2000;
+
+    Bytecode* bytecode = 0;
+
+    f64 unoptimized_time = time_compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, repetitions, &bytecode);
+    if (!bytecode) return false;
+    i64 unoptimized_result = vm_execute(bytecode);
+    int unoptimized_length = bytecode->length;
+    u32 unoptimized_registers = (u32)bytecode->register_count;
+
+    f64 optimized_time = time_compile(arena, &source, OPTIMIZE_FULL, ALLOCATE_GRAPH_COLORING, repetitions, &bytecode);
+    if (!bytecode) return false;
+    i64 optimized_result = vm_execute(bytecode);
+
+    printf("compile: %.1f KB source\n", kilobytes);
+    printf("  -O0: %8.3f ms (%7.1f us per KB), %d instructions, %u VM registers\n", unoptimized_time * 1000.0, unoptimized_time * 1e6 / kilobytes, unoptimized_length, unoptimized_registers);
+    printf("  -O1: %8.3f ms (%7.1f us per KB), %d instructions, %u VM registers, %.1fx slower\n", optimized_time * 1000.0, optimized_time * 1e6 / kilobytes, bytecode->length, (u32)bytecode->register_count, optimized_time / unoptimized_time);
+
+    if (unoptimized_result != optimized_result) {
+        printf("  results differ: %lld at -O0, %lld at -O1\n", unoptimized_result, optimized_result);
+        return false;
+    }
+
+    return true;
+}
+
+// Arithmetic with a short loop every fourth statement pair. Only a few values are live
+// at once, so eight registers suffice at any size and only the length of the function
+// changes. Each iteration is about ten instructions.
+internal Source generate_scaling_source(Arena* arena, int iteration_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)iteration_count * 128 + 1024);
+
+    append(&builder, "{\n    i32 a = 1;\n    i32 b = 2;\n    i32 c = 3;\n");
+    for (int i = 0; i < iteration_count; ++i) {
+        append(&builder, "    a = a + b * %d;\n    c = c - a / %d;\n", i % 13 + 1, i % 7 + 1);
+        if (i % 4 == 0) {
+            append(&builder, "    while b < %d {\n        b = b + 1;\n    }\n", i % 1000);
+        }
+    }
+    append(&builder, "    return a + b + c;\n}\n");
+
+    return finish_source(&builder);
+}
+
+internal void print_scaling_row(char* level, int length, CompileStats* stats, bool memory) {
+    printf("  %s %8d", level, length);
+
+    f64 total = 0;
+    for (int i = 0; i < NUM_COMPILE_PHASES; ++i) {
+        f64 value = memory ? (f64)(stats->arena_bytes[i] + stats->scratch_bytes[i]) / (1024.0 * 1024.0) : stats->seconds[i] * 1000.0;
+        printf(" %12.2f", value);
+        total += value;
+    }
+
+    if (memory) {
+        printf(" %12.2f %10.1f\n", total, total * 1024.0 * 1024.0 / length);
+    }
+    else {
+        printf(" %12.2f %10.1f\n", total, total * 1e6 / length);
+    }
+}
+
+internal void print_scaling_header(char* title, char* unit, char* per_instruction_unit) {
+    printf("  %s (%s)\n  %-3s %8s", title, unit, "", "instrs");
+    for (int i = 0; i < NUM_COMPILE_PHASES; ++i) {
+        printf(" %12s", compile_phase_name(i));
+    }
+    printf(" %12s %10s\n", "total", per_instruction_unit);
+}
+
+internal bool bench_scaling(Arena* arena) {
+    int sizes[] = { 1000, 4000, 16000, 64000, 256000, 1000000 };
+    OptimizationLevel levels[] = { OPTIMIZE_NONE, OPTIMIZE_FULL, OPTIMIZE_SSA };
+    char* level_names[] = { "-O0", "-O1", "-O2" };
+
+    CompileStats stats[LENGTH(sizes)][LENGTH(levels)] = {0};
+    int lengths[LENGTH(sizes)][LENGTH(levels)] = {0};
+    bool success = true;
+
+    u64 allocated = arena->allocated;
+
+    for (int size = 0; size < LENGTH(sizes); ++size) {
+        i64 results[LENGTH(levels)] = {0};
+
+        for (int level = 0; level < LENGTH(levels); ++level) {
+            arena->allocated = allocated;
+            Source source = generate_scaling_source(arena, sizes[size] / 10);
+
+            Bytecode* bytecode = compile(arena, &source, levels[level], ALLOCATE_GRAPH_COLORING, &stats[size][level]);
+            if (!bytecode) return false;
+
+            lengths[size][level] = bytecode->length;
+            results[level] = vm_execute(bytecode);
+
+            if (results[level] != results[0]) {
+                printf("scaling: results differ at %d instructions: %lld at -O0, %lld at %s\n", lengths[size][0], results[0], results[level],
+                       level_names[level]);
+                success = false;
+            }
+        }
+    }
+
+    arena->allocated = allocated;
+
+    printf("scaling: synthetic functions from %d to %d instructions\n", sizes[0], sizes[LENGTH(sizes) - 1]);
+
+    print_scaling_header("time", "ms", "ns/instr");
+    for (int size = 0; size < LENGTH(sizes); ++size) {
+        for (int level = 0; level < LENGTH(levels); ++level) {
+            print_scaling_row(level_names[level], lengths[size][level], &stats[size][level], false);
+        }
+    }
+
+    print_scaling_header("memory, arena and peak scratch", "MB", "B/instr");
+    for (int size = 0; size < LENGTH(sizes); ++size) {
+        for (int level = 0; level < LENGTH(levels); ++level) {
+            print_scaling_row(level_names[level], lengths[size][level], &stats[size][level], true);
+        }
+    }
+
+    return success;
+}
+
+// Liveness as it was computed with hash sets over all registers, kept to compare
+// against the bitsets over global names.
+internal void liveness_with_sets(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Set* live_out) {
+    u32 block_count = cfg->block_count;
+
+    Set* ue_var = arena_push_array(arena, Set, block_count);
+    Set* var_kill = arena_push_array(arena, Set, block_count);
+
+    for (u32 block_index = 0; block_index < block_count; ++block_index) {
+        BasicBlock* b = cfg->blocks + block_index;
+        Set* kill = var_kill + block_index;
+        Set* ue = ue_var + block_index;
+
+        *ue = new_set(arena);
+        *kill = new_set(arena);
+        live_out[block_index] = new_set(arena);
+
+        for (int i = b->start; i < b->end; ++i) {
+            Instruction* ins = bytecode->instructions + i;
+
+            #define DEFINES(ai) set_insert(kill, ins->ai)
+            #define USES(ai) if (!set_has(kill, ins->ai)) set_insert(ue, ins->ai)
+
+            switch (ins->op) {
+                default:
+                    break;
+
+                case OP_IMM:
+                    DEFINES(a1);
+                    break;
+
+                case OP_COPY:
+                case OP_CAST:
+                    USES(a2);
+                    DEFINES(a1);
+                    break;
+
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_LESS:
+                case OP_LEQUAL:
+                case OP_EQUAL:
+                case OP_NEQUAL:
+                    USES(a2);
+                    USES(a3);
+                    DEFINES(a1);
+                    break;
+
+                case OP_RET:
+                case OP_CJMP:
+                    USES(a1);
+                    break;
+            }
+
+            #undef USES
+            #undef DEFINES
+        }
+    }
+
+    for (;;) {
+        bool changed = false;
+
+        for (u32 n = block_count; n-- > 0;) {
+            Set* out = live_out + n;
+            int initial_size = out->count;
+
+            for (u32 e = cfg->successor_offsets[n]; e < cfg->successor_offsets[n + 1]; ++e) {
+                u32 m = cfg->successors[e];
+
+                foreach_set(ue_var + m, x) {
+                    set_insert(out, x.value);
+                }
+
+                foreach_set(live_out + m, x) {
+                    if (!set_has(var_kill + m, x.value))
+                        set_insert(out, x.value);
+                }
+            }
+
+            changed |= out->count != initial_size;
+        }
+
+        if (!changed)
+            break;
+    }
+}
+
+// Hundreds of variables stay live to the end of a function full of loops, so every
+// block has a large live-out set.
+internal bool bench_liveness(Arena* arena) {
+    int variable_count = 512;
+    int loop_count = 4000;
+
+    SourceBuilder builder = new_source_builder(arena, 1024 * 1024);
+
+    append(&builder, "{\n");
+    for (int i = 0; i < variable_count; ++i) {
+        append(&builder, "    i32 v%d = %d;\n", i, i);
+    }
+    for (int i = 0; i < loop_count; ++i) {
+        int a = i % variable_count;
+        int b = (i * 7 + 1) % variable_count;
+        int c = (i * 13 + 2) % variable_count;
+        append(&builder, "    while v%d < %d {\n        v%d = v%d + v%d;\n    }\n", a, i, a, b, c);
+    }
+    append(&builder, "    return v0");
+    for (int i = 1; i < variable_count; ++i) {
+        append(&builder, " + v%d", i);
+    }
+    append(&builder, ";\n}\n");
+
+    Source source = finish_source(&builder);
+
+    Program program = {0};
+    init_program(arena, &program);
+
+    ASTFunction* ast_function = parse(arena, &source, &program);
+    if (!ast_function || !analyze_semantics(arena, &source, &program, ast_function)) {
+        return false;
+    }
+
+    Bytecode* bytecode = generate_bytecode(arena, ast_function);
+    ControlFlowGraph* cfg = analyze_control_flow(arena, &source, bytecode);
+    if (!cfg) {
+        return false;
+    }
+
+    int repetitions = 5;
+    u64 allocated = arena->allocated;
+
+    Set* live_out = 0;
+    f64 start = get_time();
+    for (int i = 0; i < repetitions; ++i) {
+        arena->allocated = allocated;
+        live_out = arena_push_array(arena, Set, cfg->block_count);
+        liveness_with_sets(arena, cfg, bytecode, live_out);
+    }
+    f64 set_time = (get_time() - start) / repetitions;
+
+    u64 sets_allocated = arena->allocated;
+
+    Liveness* liveness = 0;
+    start = get_time();
+    for (int i = 0; i < repetitions; ++i) {
+        arena->allocated = sets_allocated;
+        liveness = analyze_liveness(arena, cfg, bytecode);
+    }
+    f64 bitset_time = (get_time() - start) / repetitions;
+
+    u64 live_count = 0;
+    bool success = true;
+
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        Bitset* bits = liveness->live_out + block_index;
+        u64 count = bitset_count(bits);
+        live_count += count;
+
+        success &= count == (u64)live_out[block_index].count;
+        foreach_bit(bits, name) {
+            success &= set_has(live_out + block_index, liveness->global_registers[name.value]);
+        }
+    }
+
+    printf("liveness: %d instructions, %u blocks, %u global names, %.1f live out per block\n", bytecode->length, cfg->block_count, liveness->global_count, (f64)live_count / cfg->block_count);
+    printf("  hash sets: %8.2f ms\n", set_time * 1000.0);
+    printf("  bitsets:   %8.2f ms, %.1fx faster, %.2f visits per block\n", bitset_time * 1000.0, set_time / bitset_time, (f64)liveness->visit_count / cfg->block_count);
+
+    if (!success) {
+        printf("  live-out sets differ\n");
+    }
+
+    return success;
+}
+
+// Layout of the former Instruction, with immediates inline and the label and line
+// next to the operands, kept to compare dispatch against the compact encoding.
+typedef struct {
+    Op op;
+    OpType type;
+    i64 a1;
+    i64 a2;
+    i64 a3;
+    int label;
+    int line;
+} WideInstruction;
+
+// vm_execute as it was, over wide instructions.
+internal i64 execute_wide(WideInstruction* instructions, int length, int* label_locations, i64* regs, u64* dispatch_count) {
+    u64 count = 0;
+
+    for (int i = 0; i < length;) {
+        WideInstruction* ins = instructions + i;
+        ++count;
+
+        switch (ins->op) {
+            default:
+                assert(false);
+                break;
+
+            case OP_NOOP:
+                break;
+
+            case OP_IMM:
+                regs[ins->a1] = ins->a2;
+                break;
+            case OP_COPY:
+                regs[ins->a1] = regs[ins->a2];
+                break;
+            case OP_CAST:
+                regs[ins->a1] = wrap_to_type(ins->type, regs[ins->a2]);
+                break;
+
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_LESS:
+            case OP_LEQUAL:
+            case OP_EQUAL:
+            case OP_NEQUAL:
+                regs[ins->a1] = evaluate_binary(ins->op, ins->type, regs[ins->a2], regs[ins->a3]);
+                break;
+
+            case OP_RET:
+                *dispatch_count = count;
+                return regs[ins->a1];
+
+            case OP_JMP:
+                i = label_locations[ins->a1];
+                continue;
+
+            case OP_CJMP:
+                i = label_locations[regs[ins->a1] ? ins->a2 : ins->a3];
+                continue;
+        }
+
+        ++i;
+    }
+
+    *dispatch_count = count;
+    return 0;
+}
+
+internal bool bench_dispatch(Arena* arena) {
+    SourceBuilder builder = new_source_builder(arena, 256 * 1024);
+
+    append(&builder, "{\n    i32 i = 0;\n    i32 s = 0;\n    i32 t = 1;\n    while i < 2000 {\n");
+    for (int j = 0; j < 600; ++j) {
+        append(&builder, "        s = s + i * %d - t / %d;\n        t = t + s;\n", j % 11 + 1, j % 5 + 1);
+    }
+    append(&builder, "        i = i + 1;\n    }\n    return s;\n}\n");
+
+    Source source = finish_source(&builder);
+
+    // -O0 keeps the body long, with every copy left in.
+    Bytecode* bytecode = compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, 0);
+    if (!bytecode) return false;
+
+    WideInstruction* wide = arena_push_array(arena, WideInstruction, bytecode->length);
+    for (int i = 0; i < bytecode->length; ++i) {
+        Instruction* ins = bytecode->instructions + i;
+        wide[i] = (WideInstruction){
+            .op = ins->op,
+            .type = ins->type,
+            .a1 = ins->a1,
+            .a2 = ins->op == OP_IMM ? bytecode->constants[ins->a2] : ins->a2,
+            .a3 = ins->a3,
+            .label = bytecode->labels[i],
+            .line = bytecode->lines[i]
+        };
+    }
+
+    f64 start = get_time();
+    i64 compact_result = vm_execute(bytecode);
+    f64 compact_time = get_time() - start;
+
+    u64 dispatch_count = 0;
+    i64* regs = arena_push_array(arena, i64, bytecode->register_count);
+
+    start = get_time();
+    i64 wide_result = execute_wide(wide, bytecode->length, bytecode->label_locations, regs, &dispatch_count);
+    f64 wide_time = get_time() - start;
+
+    printf("dispatch: %d instructions, %llu executed\n", bytecode->length, (unsigned long long)dispatch_count);
+    printf("  compact: %8.2f ms (%.2f ns per instruction), %6.1f KB of code\n", compact_time * 1000.0, compact_time * 1e9 / dispatch_count, (f64)(bytecode->length * sizeof(Instruction)) / 1024.0);
+    printf("  wide:    %8.2f ms (%.2f ns per instruction), %6.1f KB of code\n", wide_time * 1000.0, wide_time * 1e9 / dispatch_count, (f64)(bytecode->length * sizeof(WideInstruction)) / 1024.0);
+
+    if (compact_result != wide_result) {
+        printf("  results differ: %lld compact, %lld wide\n", compact_result, wide_result);
+        return false;
+    }
+
+    return true;
+}
+
+// vm_execute, counting every instruction executed and the loads and stores among them.
+internal i64 execute_counting(Bytecode* bytecode, i64* regs, i64* slots, u64* executed, u64* spill_traffic) {
+    for (int i = 0; i < bytecode->length;) {
+        Instruction* ins = bytecode->instructions + i;
+        ++*executed;
+
+        switch (ins->op) {
+            default:
+                assert(false);
+                break;
+
+            case OP_NOOP:
+                break;
+
+            case OP_IMM:
+                regs[ins->a1] = bytecode->constants[ins->a2];
+                break;
+            case OP_COPY:
+                regs[ins->a1] = regs[ins->a2];
+                break;
+            case OP_CAST:
+                regs[ins->a1] = wrap_to_type(ins->type, regs[ins->a2]);
+                break;
+
+            case OP_SPILL:
+                slots[ins->a1] = regs[ins->a2];
+                ++*spill_traffic;
+                break;
+            case OP_RELOAD:
+                regs[ins->a1] = slots[ins->a2];
+                ++*spill_traffic;
+                break;
+
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_LESS:
+            case OP_LEQUAL:
+            case OP_EQUAL:
+            case OP_NEQUAL:
+                regs[ins->a1] = evaluate_binary(ins->op, ins->type, regs[ins->a2], regs[ins->a3]);
+                break;
+
+            case OP_RET:
+                return regs[ins->a1];
+
+            case OP_JMP:
+                i = bytecode->label_locations[ins->a1];
+                continue;
+
+            case OP_CJMP:
+                i = bytecode->label_locations[regs[ins->a1] ? ins->a2 : ins->a3];
+                continue;
+        }
+
+        ++i;
+    }
+
+    return 0;
+}
+
+// Every variable is live across a nested loop that only touches the first few, while the
+// rest are referenced more often in straight-line code before it. Counting references
+// alone spills the variables of the loop, weighting them by loop depth keeps them.
+internal Source generate_pressure_source(Arena* arena, int variable_count, int hot_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)variable_count * 512 + 1024);
+
+    append(&builder, "{\n");
+    for (int i = 0; i < variable_count; ++i) {
+        append(&builder, "    i32 v%d = %d;\n", i, i * 3 + 1);
+    }
+    for (int pass = 0; pass < 3; ++pass) {
+        for (int i = hot_count; i < variable_count; ++i) {
+            append(&builder, "    v%d = v%d + v%d - %d;\n", i, i, (i + pass + 1) % variable_count, pass);
+        }
+    }
+    append(&builder, "    i32 k = 0;\n    while k < 20 {\n        i32 j = 0;\n        while j < 50 {\n");
+    for (int i = 0; i < hot_count; ++i) {
+        append(&builder, "            v%d = v%d + v%d * 2 - v%d;\n", i, i, (i + 1) % hot_count, (i + 2) % hot_count);
+    }
+    append(&builder, "            j = j + 1;\n        }\n        k = k + 1;\n    }\n    return v0");
+    for (int i = 1; i < variable_count; ++i) {
+        append(&builder, " + v%d", i);
+    }
+    append(&builder, ";\n}\n");
+
+    return finish_source(&builder);
+}
+
+// Variables that are never assigned after their initializer, all read in a loop. Their
+// ranges hold a single constant, so under pressure they are rematerialized rather than
+// reloaded.
+internal Source generate_constants_source(Arena* arena, int constant_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)constant_count * 128 + 1024);
+
+    append(&builder, "{\n");
+    for (int i = 0; i < constant_count; ++i) {
+        append(&builder, "    i32 c%d = %d;\n", i, i * 3 + 2);
+    }
+    append(&builder, "    i32 s = 0;\n    i32 k = 0;\n    while k < 1000 {\n");
+    for (int i = 0; i < constant_count; ++i) {
+        append(&builder, "        s = s + c%d * k - c%d / 3;\n", i, (i + 5) % constant_count);
+    }
+    append(&builder, "        k = k + 1;\n    }\n    return s;\n}\n");
+
+    return finish_source(&builder);
+}
+
+// A numeric kernel in phases: each loop in turn works on its own few variables while
+// the variables of every other phase stay live across it.
+internal Source generate_phases_source(Arena* arena, int phase_count, int variable_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)phase_count * variable_count * 256 + 1024);
+
+    append(&builder, "{\n");
+    for (int p = 0; p < phase_count; ++p) {
+        for (int i = 0; i < variable_count; ++i) {
+            append(&builder, "    i32 p%dv%d = %d;\n", p, i, p * 7 + i * 3 + 1);
+        }
+    }
+    append(&builder, "    i32 k = 0;\n");
+    for (int p = 0; p < phase_count; ++p) {
+        append(&builder, "    k = 0;\n    while k < 1000 {\n");
+        for (int i = 0; i < variable_count; ++i) {
+            append(&builder, "        p%dv%d = p%dv%d + p%dv%d * k - p%dv%d / 3;\n", p, i, p, i,
+                   p, (i + 1) % variable_count, p, (i + 2) % variable_count);
+        }
+        append(&builder, "        k = k + 1;\n    }\n");
+    }
+    append(&builder, "    return k");
+    for (int p = 0; p < phase_count; ++p) {
+        for (int i = 0; i < variable_count; ++i) {
+            append(&builder, " + p%dv%d", p, i);
+        }
+    }
+    append(&builder, ";\n}\n");
+
+    return finish_source(&builder);
+}
+
+// Conditions comparing a long sum against a short difference with >, which parses into
+// the difference compared against the sum. Evaluating the sum first leaves one
+// temporary live across the difference instead of the other way around.
+internal Source generate_comparisons_source(Arena* arena, int variable_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)variable_count * 512 + 1024);
+
+    append(&builder, "{\n");
+    for (int i = 0; i < variable_count; ++i) {
+        append(&builder, "    i32 v%d = %d;\n", i, i * 3 + 1);
+    }
+    append(&builder, "    i32 s = 0;\n    i32 k = 0;\n    while k < 1000 {\n");
+    for (int i = 0; i < variable_count; ++i) {
+        int a = (i + 1) % variable_count;
+        int b = (i + 2) % variable_count;
+        int c = (i + 3) % variable_count;
+        append(&builder, "        if v%d * k + v%d * 3 - v%d * k + v%d / 7 > v%d * 2 - k {\n            s = s + v%d - k;\n        }\n", i, a, b, c, b, i);
+        append(&builder, "        v%d = v%d + v%d * k - v%d * 3 > k * 4 + v%d + s;\n", i, i, a, b, c);
+    }
+    append(&builder, "        k = k + 1;\n    }\n    return s;\n}\n");
+
+    return finish_source(&builder);
+}
+
+internal bool bench_spills(Arena* arena) {
+    int variable_counts[] = { 12, 24, 48, 96 };
+    char* heuristic_names[] = { "density", "degree", "references" };
+    static_assert(LENGTH(heuristic_names) == NUM_SPILL_HEURISTICS, "not all spill heuristics named");
+
+    int repetitions = 20;
+    bool success = true;
+
+    printf("spills: %d registers, 5 variables used in a nested loop\n", VM_REGISTER_COUNT);
+    printf("  %9s %-10s %10s %8s %8s %6s %10s %14s\n", "variables", "heuristic", "alloc ms", "spills", "reloads", "slots", "executed", "spill traffic");
+
+    for (int v = 0; v < LENGTH(variable_counts); ++v) {
+        u64 allocated = arena->allocated;
+
+        Source source = generate_pressure_source(arena, variable_counts[v], 5);
+
+        Bytecode* unoptimized = compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, 0);
+        if (!unoptimized) return false;
+        i64 expected = vm_execute(unoptimized);
+
+        Program program = {0};
+        init_program(arena, &program);
+
+        ASTFunction* ast_function = parse(arena, &source, &program);
+        if (!ast_function || !analyze_semantics(arena, &source, &program, ast_function)) {
+            return false;
+        }
+        fold_constants(arena, ast_function);
+
+        for (int h = 0; h < NUM_SPILL_HEURISTICS; ++h) {
+            u64 heuristic_allocated = arena->allocated;
+
+            Bytecode* bytecode = 0;
+            f64 time = 0;
+
+            for (int r = 0; r < repetitions; ++r) {
+                arena->allocated = heuristic_allocated;
+
+                bytecode = generate_bytecode(arena, ast_function);
+                ControlFlowGraph* cfg = analyze_control_flow(arena, &source, bytecode);
+                if (!cfg) return false;
+
+                f64 start = get_time();
+                Liveness* liveness = analyze_liveness(arena, cfg, bytecode);
+                allocate_registers(arena, cfg, bytecode, liveness, VM_REGISTER_COUNT, h, 0);
+                time += get_time() - start;
+            }
+
+            int spill_count = 0;
+            int reload_count = 0;
+            for (int i = 0; i < bytecode->length; ++i) {
+                spill_count += bytecode->instructions[i].op == OP_SPILL;
+                reload_count += bytecode->instructions[i].op == OP_RELOAD;
+            }
+
+            i64* regs = arena_push_array(arena, i64, bytecode->register_count);
+            i64* slots = arena_push_array(arena, i64, bytecode->slot_count);
+            u64 executed = 0;
+            u64 spill_traffic = 0;
+            i64 result = execute_counting(bytecode, regs, slots, &executed, &spill_traffic);
+
+            printf("  %9d %-10s %10.3f %8d %8d %6lld %10llu %14llu\n", variable_counts[v], heuristic_names[h], time * 1000.0 / repetitions,
+                   spill_count, reload_count, bytecode->slot_count, (unsigned long long)executed, (unsigned long long)spill_traffic);
+
+            if (result != expected) {
+                printf("  results differ: %lld at -O0, %lld with %s spilling\n", expected, result, heuristic_names[h]);
+                success = false;
+            }
+        }
+
+        arena->allocated = allocated;
+    }
+
+    return success;
+}
+
+// Functions with thousands of live ranges, either hundreds live at once or long sequences
+// of short ones. Time per element of the graph, ranges plus edges, should stay flat.
+internal bool bench_coloring(Arena* arena) {
+    int variable_counts[] = { 125, 250, 500, 1000 };
+    int iteration_counts[] = { 2500, 10000, 40000 };
+    bool success = true;
+
+    printf("coloring: graph allocator on wide and long functions, %d registers\n", VM_REGISTER_COUNT);
+    printf("  %-5s %6s %8s %6s %10s %12s %10s %6s %12s %8s %7s\n", "shape", "size", "instrs", "rounds", "ranges", "edges", "coalesced", "split", "registers ms", "ns/elem", "slots");
+
+    for (int shape = 0; shape < 2; ++shape) {
+        int count = shape == 0 ? LENGTH(variable_counts) : LENGTH(iteration_counts);
+
+        for (int c = 0; c < count; ++c) {
+            u64 allocated = arena->allocated;
+
+            int size = shape == 0 ? variable_counts[c] : iteration_counts[c];
+            Source source = shape == 0 ? generate_pressure_source(arena, size, 5) : generate_scaling_source(arena, size);
+
+            Bytecode* unoptimized = compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, 0);
+            if (!unoptimized) return false;
+            i64 expected = vm_execute(unoptimized);
+
+            Program program = {0};
+            init_program(arena, &program);
+
+            ASTFunction* ast_function = parse(arena, &source, &program);
+            if (!ast_function || !analyze_semantics(arena, &source, &program, ast_function)) {
+                return false;
+            }
+            fold_constants(arena, ast_function);
+
+            Bytecode* bytecode = generate_bytecode(arena, ast_function);
+            ControlFlowGraph* cfg = analyze_control_flow(arena, &source, bytecode);
+            if (!cfg) return false;
+
+            GraphColoringStats stats = {0};
+
+            f64 start = get_time();
+            Liveness* liveness = analyze_liveness(arena, cfg, bytecode);
+            allocate_registers(arena, cfg, bytecode, liveness, VM_REGISTER_COUNT, SPILL_BY_DENSITY, &stats);
+            f64 time = get_time() - start;
+
+            printf("  %-5s %6d %8d %6u %10llu %12llu %10llu %6llu %12.2f %8.1f %7lld\n", shape == 0 ? "wide" : "long", size, bytecode->length, stats.rounds,
+                   (unsigned long long)stats.live_ranges, (unsigned long long)stats.interferences, (unsigned long long)stats.coalesced,
+                   (unsigned long long)stats.split, time * 1000.0, time * 1e9 / (f64)(stats.live_ranges + stats.interferences), bytecode->slot_count);
+
+            i64 result = vm_execute(bytecode);
+            if (result != expected) {
+                printf("  results differ: %lld at -O0, %lld at -O1\n", expected, result);
+                success = false;
+            }
+
+            arena->allocated = allocated;
+        }
+    }
+
+    return success;
+}
+
+internal bool bench_allocators(Arena* arena) {
+    char* allocator_names[] = { "graph", "linear" };
+
+    char* names[] = { "scaling 1k", "scaling 64k", "pressure 12", "pressure 48", "constants 16", "constants 48", "phases 3x5", "phases 6x6",
+                      "compares 4", "compares 6" };
+    int repetitions[] = { 200, 5, 200, 20, 200, 50, 200, 50, 200, 200 };
+    bool success = true;
+
+    printf("allocators: optimized compile time against the code each allocator leaves\n");
+    printf("  %-12s %-7s %10s %12s %8s %8s %8s %10s\n", "program", "", "compile ms", "registers ms", "instrs", "copies", "spill", "executed");
+
+    for (int p = 0; p < LENGTH(names); ++p) {
+        u64 allocated = arena->allocated;
+
+        Source source = p == 0 ? generate_scaling_source(arena, 100) :
+                        p == 1 ? generate_scaling_source(arena, 6400) :
+                        p == 2 ? generate_pressure_source(arena, 12, 5) :
+                        p == 3 ? generate_pressure_source(arena, 48, 5) :
+                        p == 4 ? generate_constants_source(arena, 16) :
+                        p == 5 ? generate_constants_source(arena, 48) :
+                        p == 6 ? generate_phases_source(arena, 3, 5) :
+                        p == 7 ? generate_phases_source(arena, 6, 6) :
+                        p == 8 ? generate_comparisons_source(arena, 4) :
+                        generate_comparisons_source(arena, 6);
+
+        Bytecode* unoptimized = compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, 0);
+        if (!unoptimized) return false;
+        i64 expected = vm_execute(unoptimized);
+
+        u64 source_allocated = arena->allocated;
+
+        for (int a = 0; a < LENGTH(allocator_names); ++a) {
+            CompileStats stats = {0};
+            Bytecode* bytecode = 0;
+
+            f64 start = get_time();
+            for (int r = 0; r < repetitions[p]; ++r) {
+                arena->allocated = source_allocated;
+                bytecode = compile(arena, &source, OPTIMIZE_FULL, a, &stats);
+                if (!bytecode) return false;
+            }
+            f64 time = (get_time() - start) / repetitions[p];
+
+            int instruction_count = 0;
+            int copy_count = 0;
+            int spill_code_count = 0;
+            for (int i = 0; i < bytecode->length; ++i) {
+                u8 op = bytecode->instructions[i].op;
+                instruction_count += op != OP_NOOP;
+                copy_count += op == OP_COPY;
+                spill_code_count += op == OP_SPILL || op == OP_RELOAD;
+            }
+
+            i64* regs = arena_push_array(arena, i64, bytecode->register_count);
+            i64* slots = arena_push_array(arena, i64, bytecode->slot_count);
+            u64 executed = 0;
+            u64 spill_traffic = 0;
+            i64 result = execute_counting(bytecode, regs, slots, &executed, &spill_traffic);
+
+            printf("  %-12s %-7s %10.3f %12.3f %8d %8d %8d %10llu\n", a == 0 ? names[p] : "", allocator_names[a], time * 1000.0,
+                   stats.seconds[PHASE_REGISTERS] * 1000.0 / repetitions[p], instruction_count, copy_count, spill_code_count, (unsigned long long)executed);
+
+            if (result != expected) {
+                printf("  results differ: %lld at -O0, %lld with the %s allocator\n", expected, result, allocator_names[a]);
+                success = false;
+            }
+        }
+
+        arena->allocated = allocated;
+    }
+
+    return success;
+}
+
+// A loop around a chain of if-elses, each side assigning different variables, so every
+// join merges a few of them and the loop header merges all.
+internal Source generate_diamonds_source(Arena* arena, int diamond_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)diamond_count * 128 + 1024);
+
+    append(&builder, "{\n");
+    for (int i = 0; i < 8; ++i) {
+        append(&builder, "    i32 v%d = %d;\n", i, i * 5 + 1);
+    }
+    append(&builder, "    i32 k = 0;\n    while k < 10 {\n");
+    for (int i = 0; i < diamond_count; ++i) {
+        int a = i % 8;
+        int b = (i + 3) % 8;
+        int c = (i + 5) % 8;
+        append(&builder, "        if v%d < v%d * %d {\n            v%d = v%d + k;\n        }\n        else {\n            v%d = v%d - %d;\n        }\n",
+               a, b, i % 7 + 1, a, c, b, a, i % 5 + 1);
+    }
+    append(&builder, "        k = k + 1;\n    }\n    return v0 + v1 + v2 + v3 + v4 + v5 + v6 + v7;\n}\n");
+
+    return finish_source(&builder);
+}
+
+// SSA construction, dominators included, and destruction on functions with many blocks.
+// Time per block should stay flat, and the round trip should leave no more copies than
+// allocating registers without it.
+internal bool bench_ssa(Arena* arena) {
+    int diamond_counts[] = { 250, 500, 1000, 2000 };
+    int iteration_counts[] = { 2500, 10000, 40000 };
+    bool success = true;
+
+    printf("ssa: construction and destruction on large graphs\n");
+    printf("  %-8s %7s %8s %8s %8s %13s %12s %11s %9s %8s %8s\n", "shape", "size", "blocks", "instrs", "phis", "dominators ms", "construct ms", "destruct ms", "ns/block", "copies", "-O1");
+
+    for (int shape = 0; shape < 2; ++shape) {
+        int count = shape == 0 ? LENGTH(diamond_counts) : LENGTH(iteration_counts);
+
+        for (int c = 0; c < count; ++c) {
+            u64 allocated = arena->allocated;
+
+            int size = shape == 0 ? diamond_counts[c] : iteration_counts[c];
+            Source source = shape == 0 ? generate_diamonds_source(arena, size) : generate_scaling_source(arena, size);
+
+            Bytecode* unoptimized = compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, 0);
+            if (!unoptimized) return false;
+            i64 expected = vm_execute(unoptimized);
+
+            Bytecode* optimized = compile(arena, &source, OPTIMIZE_FULL, ALLOCATE_GRAPH_COLORING, 0);
+            if (!optimized) return false;
+
+            Program program = {0};
+            init_program(arena, &program);
+
+            ASTFunction* ast_function = parse(arena, &source, &program);
+            if (!ast_function || !analyze_semantics(arena, &source, &program, ast_function)) {
+                return false;
+            }
+            fold_constants(arena, ast_function);
+
+            Bytecode* bytecode = generate_bytecode(arena, ast_function);
+            ControlFlowGraph* cfg = analyze_control_flow(arena, &source, bytecode);
+            if (!cfg) return false;
+
+            u32 block_count = cfg->block_count;
+            int length = bytecode->length;
+            Liveness* liveness = analyze_liveness(arena, cfg, bytecode);
+
+            f64 start = get_time();
+            analyze_dominators(arena, cfg);
+            f64 dominators_time = get_time() - start;
+
+            start = get_time();
+            SSAForm* ssa = construct_ssa(arena, cfg, bytecode, liveness);
+            f64 construct_time = get_time() - start;
+
+            start = get_time();
+            destruct_ssa(arena, cfg, bytecode, ssa);
+            f64 destruct_time = get_time() - start;
+
+            liveness = analyze_liveness(arena, cfg, bytecode);
+            allocate_registers(arena, cfg, bytecode, liveness, VM_REGISTER_COUNT, SPILL_BY_DENSITY, 0);
+
+            int copy_counts[2] = {0};
+            Bytecode* results[] = { bytecode, optimized };
+            for (int r = 0; r < 2; ++r) {
+                for (int i = 0; i < results[r]->length; ++i) {
+                    copy_counts[r] += results[r]->instructions[i].op == OP_COPY;
+                }
+            }
+
+            printf("  %-8s %7d %8u %8d %8u %13.2f %12.2f %11.2f %9.1f %8d %8d\n", shape == 0 ? "diamonds" : "scaling", size, block_count, length,
+                   ssa->phi_offsets[block_count], dominators_time * 1000.0, construct_time * 1000.0, destruct_time * 1000.0,
+                   (construct_time + destruct_time) * 1e9 / block_count, copy_counts[0], copy_counts[1]);
+
+            i64 result = vm_execute(bytecode);
+            if (result != expected) {
+                printf("  results differ: %lld at -O0, %lld through SSA\n", expected, result);
+                success = false;
+            }
+
+            arena->allocated = allocated;
+        }
+    }
+
+    return success;
+}
+
+// Nested loops whose inner statements start with a part computed from values set before
+// both loops and from the outer counter, and only then add what the inner loop changes.
+internal Source generate_invariants_source(Arena* arena, int term_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)term_count * 64 + 1024);
+
+    append(&builder, "{\n    i32 a = 3;\n    i32 b = 5;\n    i32 s = 0;\n    i32 i = 0;\n    while i < 20 {\n        i32 j = 0;\n        while j < 50 {\n");
+    for (int t = 0; t < term_count; ++t) {
+        append(&builder, "            s = a * %d + b * i - %d + s - j;\n", t + 2, t % 5 + 1);
+    }
+    append(&builder, "            j = j + 1;\n        }\n        i = i + 1;\n    }\n    return s;\n}\n");
+
+    return finish_source(&builder);
+}
+
+// Instructions executed with and without taking the function through SSA form, where
+// loop invariants are moved into preheaders. Moving them lengthens their ranges, so
+// spill traffic is counted too.
+internal bool bench_licm(Arena* arena) {
+    char* names[] = { "invariants 1", "invariants 4", "invariants 12", "constants 16", "constants 48", "pressure 12", "phases 3x5" };
+    bool success = true;
+
+    printf("licm: executed instructions, -O1 against -O2\n");
+    printf("  %-13s %8s %8s %12s %12s %8s %10s %10s\n", "program", "-O1 ins", "-O2 ins", "-O1 executed", "-O2 executed", "saved", "-O1 spills", "-O2 spills");
+
+    for (int p = 0; p < LENGTH(names); ++p) {
+        u64 allocated = arena->allocated;
+
+        Source source = p == 0 ? generate_invariants_source(arena, 1) :
+                        p == 1 ? generate_invariants_source(arena, 4) :
+                        p == 2 ? generate_invariants_source(arena, 12) :
+                        p == 3 ? generate_constants_source(arena, 16) :
+                        p == 4 ? generate_constants_source(arena, 48) :
+                        p == 5 ? generate_pressure_source(arena, 12, 5) :
+                        generate_phases_source(arena, 3, 5);
+
+        Bytecode* unoptimized = compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, 0);
+        if (!unoptimized) return false;
+        i64 expected = vm_execute(unoptimized);
+
+        OptimizationLevel levels[] = { OPTIMIZE_FULL, OPTIMIZE_SSA };
+        int lengths[LENGTH(levels)];
+        u64 executed[LENGTH(levels)] = {0};
+        u64 spill_traffic[LENGTH(levels)] = {0};
+
+        for (int l = 0; l < LENGTH(levels); ++l) {
+            Bytecode* bytecode = compile(arena, &source, levels[l], ALLOCATE_GRAPH_COLORING, 0);
+            if (!bytecode) return false;
+
+            i64* regs = arena_push_array(arena, i64, bytecode->register_count);
+            i64* slots = arena_push_array(arena, i64, bytecode->slot_count);
+            i64 result = execute_counting(bytecode, regs, slots, &executed[l], &spill_traffic[l]);
+            lengths[l] = bytecode->length;
+
+            if (result != expected) {
+                printf("  results differ: %lld at -O0, %lld at -O%d\n", expected, result, l + 1);
+                success = false;
+            }
+        }
+
+        printf("  %-13s %8d %8d %12llu %12llu %7.1f%% %10llu %10llu\n", names[p], lengths[0], lengths[1], (unsigned long long)executed[0],
+               (unsigned long long)executed[1], 100.0 - 100.0 * (f64)executed[1] / (f64)executed[0], (unsigned long long)spill_traffic[0],
+               (unsigned long long)spill_traffic[1]);
+
+        arena->allocated = allocated;
+    }
+
+    return success;
+}
+
+// Statements in a loop that each multiply the counter by two of a few variables, so every
+// product is computed again by the statement after, and the counter's bound is a literal
+// repeated in every condition.
+internal Source generate_expressions_source(Arena* arena, int statement_count, int variable_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)statement_count * 64 + (u64)variable_count * 32 + 1024);
+
+    append(&builder, "{\n");
+    for (int i = 0; i < variable_count; ++i) {
+        append(&builder, "    i32 v%d = %d;\n", i, i * 3 + 2);
+    }
+    append(&builder, "    i32 s = 0;\n    i32 k = 0;\n    while k < 500 {\n");
+    for (int t = 0; t < statement_count; ++t) {
+        int a = t % variable_count;
+        int b = (t + 1) % variable_count;
+        append(&builder, "        s = k * v%d + k * v%d - s;\n", a, b);
+        if (t % 4 == 3) {
+            append(&builder, "        if s < 500 {\n            s = s + k * v%d;\n        }\n", b);
+        }
+    }
+    append(&builder, "        k = k + 1;\n    }\n    return s;\n}\n");
+
+    return finish_source(&builder);
+}
+
+// compile at -O2, with value numbering left out unless asked for.
+internal Bytecode* compile_with_numbering(Arena* arena, Source* source, bool numbering, u32* replaced) {
+    Program program = {0};
+    init_program(arena, &program);
+
+    ASTFunction* ast_function = parse(arena, source, &program);
+    if (!ast_function || !analyze_semantics(arena, source, &program, ast_function)) {
+        return 0;
+    }
+    fold_constants(arena, ast_function);
+
+    Bytecode* bytecode = generate_bytecode(arena, ast_function);
+    ControlFlowGraph* cfg = analyze_control_flow(arena, source, bytecode);
+    if (!cfg) return 0;
+
+    insert_preheaders(arena, cfg, bytecode);
+    Liveness* liveness = analyze_liveness(arena, cfg, bytecode);
+
+    SSAForm* ssa = construct_ssa(arena, cfg, bytecode, liveness);
+    hoist_loop_invariants(arena, cfg, bytecode, ssa);
+    *replaced = numbering ? number_values(arena, cfg, bytecode, ssa) : 0;
+    destruct_ssa(arena, cfg, bytecode, ssa);
+
+    liveness = analyze_liveness(arena, cfg, bytecode);
+    eliminate_dead_code(arena, cfg, bytecode, liveness);
+    allocate_registers(arena, cfg, bytecode, liveness, VM_REGISTER_COUNT, SPILL_BY_DENSITY, 0);
+    remove_noops(arena, cfg, bytecode);
+
+    return bytecode;
+}
+
+// The -O2 pipeline with and without value numbering. Replaced instructions become copies
+// that coalescing should remove, so what is left to execute shrinks by about as many.
+internal bool bench_gvn(Arena* arena) {
+    char* names[] = { "expressions 8", "expressions 32", "invariants 12", "constants 16", "phases 3x5", "compares 6" };
+    bool success = true;
+
+    printf("gvn: -O2 without and with value numbering\n");
+    printf("  %-14s %8s %8s %8s %12s %12s %8s %8s %8s\n", "program", "replaced", "ins", "ins gvn", "executed", "executed gvn", "saved", "spills", "spills gvn");
+
+    for (int p = 0; p < LENGTH(names); ++p) {
+        u64 allocated = arena->allocated;
+
+        Source source = p == 0 ? generate_expressions_source(arena, 8, 4) :
+                        p == 1 ? generate_expressions_source(arena, 32, 6) :
+                        p == 2 ? generate_invariants_source(arena, 12) :
+                        p == 3 ? generate_constants_source(arena, 16) :
+                        p == 4 ? generate_phases_source(arena, 3, 5) :
+                        generate_comparisons_source(arena, 6);
+
+        Bytecode* unoptimized = compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, 0);
+        if (!unoptimized) return false;
+        i64 expected = vm_execute(unoptimized);
+
+        u32 replaced = 0;
+        int lengths[2];
+        u64 executed[2] = {0};
+        u64 spill_traffic[2] = {0};
+
+        for (int numbering = 0; numbering < 2; ++numbering) {
+            Bytecode* bytecode = compile_with_numbering(arena, &source, numbering, &replaced);
+            if (!bytecode) return false;
+
+            i64* regs = arena_push_array(arena, i64, bytecode->register_count);
+            i64* slots = arena_push_array(arena, i64, bytecode->slot_count);
+            i64 result = execute_counting(bytecode, regs, slots, &executed[numbering], &spill_traffic[numbering]);
+            lengths[numbering] = bytecode->length;
+
+            if (result != expected) {
+                printf("  results differ: %lld at -O0, %lld %s value numbering\n", expected, result, numbering ? "with" : "without");
+                success = false;
+            }
+        }
+
+        printf("  %-14s %8u %8d %8d %12llu %12llu %7.1f%% %8llu %8llu\n", names[p], replaced, lengths[0], lengths[1], (unsigned long long)executed[0],
+               (unsigned long long)executed[1], 100.0 - 100.0 * (f64)executed[1] / (f64)executed[0], (unsigned long long)spill_traffic[0],
+               (unsigned long long)spill_traffic[1]);
+
+        arena->allocated = allocated;
+    }
+
+    return success;
+}
+
+// A loop whose body keeps overwriting scratch variables before reading them, computes
+// expressions only to throw them away, and declares variables it never reads. Only one
+// statement in each group feeds the result.
+internal Source generate_dead_stores_source(Arena* arena, int group_count) {
+    SourceBuilder builder = new_source_builder(arena, (u64)group_count * 256 + 1024);
+
+    append(&builder, "{\n    i32 s = 0;\n    i32 k = 0;\n    while k < 500 {\n");
+    for (int g = 0; g < group_count; ++g) {
+        append(&builder, "        i32 t%d = k * %d;\n", g, g + 2);
+        append(&builder, "        t%d = s - k * %d;\n", g, g + 3);
+        append(&builder, "        k * s + %d;\n", g);
+        append(&builder, "        i32 unused%d = s / %d;\n", g, g + 2);
+        append(&builder, "        t%d = k + %d;\n", g, g);
+        append(&builder, "        s = s + t%d;\n", g);
+    }
+    append(&builder, "        k = k + 1;\n    }\n    return s;\n}\n");
+
+    return finish_source(&builder);
+}
+
+typedef enum {
+    ELIMINATE_NOTHING,
+    ELIMINATE_NOOPS,
+    ELIMINATE_DEAD_CODE, // And NOOPs.
+
+    NUM_ELIMINATIONS
+} Elimination;
+
+// compile at -O1, with dead code and the NOOPs left by it and by coalescing removed only
+// as asked.
+internal Bytecode* compile_with_elimination(Arena* arena, Source* source, Elimination elimination, u32* removed) {
+    Program program = {0};
+    init_program(arena, &program);
+
+    ASTFunction* ast_function = parse(arena, source, &program);
+    if (!ast_function || !analyze_semantics(arena, source, &program, ast_function)) {
+        return 0;
+    }
+    fold_constants(arena, ast_function);
+
+    Bytecode* bytecode = generate_bytecode(arena, ast_function);
+    ControlFlowGraph* cfg = analyze_control_flow(arena, source, bytecode);
+    if (!cfg) return 0;
+
+    Liveness* liveness = analyze_liveness(arena, cfg, bytecode);
+    *removed = elimination == ELIMINATE_DEAD_CODE ? eliminate_dead_code(arena, cfg, bytecode, liveness) : 0;
+    allocate_registers(arena, cfg, bytecode, liveness, VM_REGISTER_COUNT, SPILL_BY_DENSITY, 0);
+
+    if (elimination != ELIMINATE_NOTHING) {
+        remove_noops(arena, cfg, bytecode);
+    }
+
+    return bytecode;
+}
+
+// The -O1 pipeline leaving everything in, compacting NOOPs away, and also dropping dead
+// code first. Executed counts include NOOPs, as the VM dispatches them like the rest.
+internal bool bench_dce(Arena* arena) {
+    char* names[] = { "dead stores 4", "dead stores 16", "pressure 12", "constants 16", "phases 3x5", "expressions 8" };
+    char* variants[] = { "as is", "compacted", "dce" };
+    static_assert(LENGTH(variants) == NUM_ELIMINATIONS, "not all variants named");
+    bool success = true;
+
+    printf("dce: -O1 as is, with NOOPs compacted, and with dead code dropped too\n");
+    printf("  %-14s %8s %8s %8s %8s %12s %12s %12s %8s\n", "program", "removed", "ins", "ins cmp", "ins dce", "executed", "executed cmp",
+           "executed dce", "saved");
+
+    for (int p = 0; p < LENGTH(names); ++p) {
+        u64 allocated = arena->allocated;
+
+        Source source = p == 0 ? generate_dead_stores_source(arena, 4) :
+                        p == 1 ? generate_dead_stores_source(arena, 16) :
+                        p == 2 ? generate_pressure_source(arena, 12, 5) :
+                        p == 3 ? generate_constants_source(arena, 16) :
+                        p == 4 ? generate_phases_source(arena, 3, 5) :
+                        generate_expressions_source(arena, 8, 4);
+
+        Bytecode* unoptimized = compile(arena, &source, OPTIMIZE_NONE, ALLOCATE_GRAPH_COLORING, 0);
+        if (!unoptimized) return false;
+        i64 expected = vm_execute(unoptimized);
+
+        u32 removed = 0;
+        int lengths[NUM_ELIMINATIONS];
+        u64 executed[NUM_ELIMINATIONS] = {0};
+
+        for (int e = 0; e < NUM_ELIMINATIONS; ++e) {
+            Bytecode* bytecode = compile_with_elimination(arena, &source, e, &removed);
+            if (!bytecode) return false;
+
+            i64* regs = arena_push_array(arena, i64, bytecode->register_count);
+            i64* slots = arena_push_array(arena, i64, bytecode->slot_count);
+            u64 spill_traffic = 0;
+            i64 result = execute_counting(bytecode, regs, slots, &executed[e], &spill_traffic);
+            lengths[e] = bytecode->length;
+
+            if (result != expected) {
+                printf("  results differ: %lld at -O0, %lld %s\n", expected, result, variants[e]);
+                success = false;
+            }
+        }
+
+        printf("  %-14s %8u %8d %8d %8d %12llu %12llu %12llu %7.1f%%\n", names[p], removed, lengths[0], lengths[1], lengths[2],
+               (unsigned long long)executed[0], (unsigned long long)executed[1], (unsigned long long)executed[2],
+               100.0 - 100.0 * (f64)executed[2] / (f64)executed[0]);
+
+        arena->allocated = allocated;
+    }
+
+    return success;
+}
+
+typedef struct {
+    char* name;
+    bool (*run)(Arena* arena);
+} Benchmark;
+
+internal Benchmark benchmarks[] = {
+    { "lexer", bench_lexer },
+    { "identifiers", bench_identifiers },
+    { "scopes", bench_scopes },
+    { "ast", bench_ast },
+    { "nesting", bench_nesting },
+    { "compile", bench_compile },
+    { "scaling", bench_scaling },
+    { "liveness", bench_liveness },
+    { "dispatch", bench_dispatch },
+    { "spills", bench_spills },
+    { "allocators", bench_allocators },
+    { "coloring", bench_coloring },
+    { "ssa", bench_ssa },
+    { "licm", bench_licm },
+    { "gvn", bench_gvn },
+    { "dce", bench_dce },
+};
+
+int run_benchmarks(int argument_count, char** arguments) {
+    bool success = true;
+    int run_count = 0;
+
+    for (int i = 0; i < LENGTH(benchmarks); ++i) {
+        bool selected = argument_count == 0;
+        for (int j = 0; j < argument_count; ++j) {
+            selected |= strcmp(arguments[j], benchmarks[i].name) == 0;
+        }
+
+        if (selected) {
+            Arena* arena = new_arena(DEFAULT_ARENA_RESERVE, ARENA_HUGE_PAGES);
+            success &= benchmarks[i].run(arena);
+            print_arena_usage("  arena", arena);
+            free_arena(arena);
+            ++run_count;
+        }
+    }
+
+    if (run_count == 0) {
+        printf("Unknown benchmark. Available:");
+        for (int i = 0; i < LENGTH(benchmarks); ++i) {
+            printf(" %s", benchmarks[i].name);
+        }
+        printf("\n");
+        return 1;
+    }
+
+    print_scratch_usage();
+
+    return success ? 0 : 1;
+}
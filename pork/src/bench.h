@@ -0,0 +1,5 @@
+#pragma once
+
+#include "base.h"
+
+int run_benchmarks(int argument_count, char** arguments);
@@ -0,0 +1,219 @@
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BITSET_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BITSET_SSE2
+#endif
+
+#include "bitset.h"
+
+#define VECTOR_WORDS 4 // Enough for the widest vector, so every set is a whole number of them.
+
+Bitset new_bitset(Arena* arena, i64 bit_count) {
+    u32 word_count = (u32)((bit_count + 64 * VECTOR_WORDS - 1) / (64 * VECTOR_WORDS) * VECTOR_WORDS);
+    return (Bitset){
+        .words = arena_push_array(arena, u64, word_count),
+        .word_count = word_count
+    };
+}
+
+void bitset_clear(Bitset* set) {
+    if (set->word_count) {
+        memset(set->words, 0, set->word_count * sizeof(u64));
+    }
+}
+
+// Sets the first bit_count bits and leaves the rest of the last vector clear.
+void bitset_fill(Bitset* set, i64 bit_count) {
+    assert((u64)bit_count <= (u64)set->word_count * 64);
+    if (!set->word_count) {
+        return;
+    }
+
+    u32 full_words = (u32)(bit_count / 64);
+    memset(set->words, 0xFF, full_words * sizeof(u64));
+    memset(set->words + full_words, 0, (set->word_count - full_words) * sizeof(u64));
+
+    if (bit_count % 64) {
+        set->words[full_words] = (1ull << (bit_count % 64)) - 1;
+    }
+}
+
+void bitset_copy(Bitset* set, Bitset* source) {
+    assert(set->word_count == source->word_count);
+    if (set->word_count) {
+        memcpy(set->words, source->words, set->word_count * sizeof(u64));
+    }
+}
+
+u64 bitset_count(Bitset* set) {
+    u64 count = 0;
+    for (u32 i = 0; i < set->word_count; ++i) {
+        count += count_set_bits64(set->words[i]);
+    }
+    return count;
+}
+
+#if defined(BITSET_AVX2)
+
+bool bitset_union(Bitset* set, Bitset* other) {
+    assert(set->word_count == other->word_count);
+
+    __m256i changed = _mm256_setzero_si256();
+    for (u32 i = 0; i < set->word_count; i += 4) {
+        __m256i old = _mm256_loadu_si256((__m256i*)(set->words + i));
+        __m256i result = _mm256_or_si256(old, _mm256_loadu_si256((__m256i*)(other->words + i)));
+        changed = _mm256_or_si256(changed, _mm256_xor_si256(result, old));
+        _mm256_storeu_si256((__m256i*)(set->words + i), result);
+    }
+
+    return !_mm256_testz_si256(changed, changed);
+}
+
+bool bitset_intersect(Bitset* set, Bitset* other) {
+    assert(set->word_count == other->word_count);
+
+    __m256i changed = _mm256_setzero_si256();
+    for (u32 i = 0; i < set->word_count; i += 4) {
+        __m256i old = _mm256_loadu_si256((__m256i*)(set->words + i));
+        __m256i result = _mm256_and_si256(old, _mm256_loadu_si256((__m256i*)(other->words + i)));
+        changed = _mm256_or_si256(changed, _mm256_xor_si256(result, old));
+        _mm256_storeu_si256((__m256i*)(set->words + i), result);
+    }
+
+    return !_mm256_testz_si256(changed, changed);
+}
+
+bool bitset_union_difference(Bitset* set, Bitset* other, Bitset* excluded) {
+    assert(set->word_count == other->word_count && set->word_count == excluded->word_count);
+
+    __m256i changed = _mm256_setzero_si256();
+    for (u32 i = 0; i < set->word_count; i += 4) {
+        __m256i old = _mm256_loadu_si256((__m256i*)(set->words + i));
+        __m256i added = _mm256_andnot_si256(_mm256_loadu_si256((__m256i*)(excluded->words + i)), _mm256_loadu_si256((__m256i*)(other->words + i)));
+        __m256i result = _mm256_or_si256(old, added);
+        changed = _mm256_or_si256(changed, _mm256_xor_si256(result, old));
+        _mm256_storeu_si256((__m256i*)(set->words + i), result);
+    }
+
+    return !_mm256_testz_si256(changed, changed);
+}
+
+#elif defined(BITSET_SSE2)
+
+internal bool any_bits(__m128i vector) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(vector, _mm_setzero_si128())) != 0xFFFF;
+}
+
+bool bitset_union(Bitset* set, Bitset* other) {
+    assert(set->word_count == other->word_count);
+
+    __m128i changed = _mm_setzero_si128();
+    for (u32 i = 0; i < set->word_count; i += 2) {
+        __m128i old = _mm_loadu_si128((__m128i*)(set->words + i));
+        __m128i result = _mm_or_si128(old, _mm_loadu_si128((__m128i*)(other->words + i)));
+        changed = _mm_or_si128(changed, _mm_xor_si128(result, old));
+        _mm_storeu_si128((__m128i*)(set->words + i), result);
+    }
+
+    return any_bits(changed);
+}
+
+bool bitset_intersect(Bitset* set, Bitset* other) {
+    assert(set->word_count == other->word_count);
+
+    __m128i changed = _mm_setzero_si128();
+    for (u32 i = 0; i < set->word_count; i += 2) {
+        __m128i old = _mm_loadu_si128((__m128i*)(set->words + i));
+        __m128i result = _mm_and_si128(old, _mm_loadu_si128((__m128i*)(other->words + i)));
+        changed = _mm_or_si128(changed, _mm_xor_si128(result, old));
+        _mm_storeu_si128((__m128i*)(set->words + i), result);
+    }
+
+    return any_bits(changed);
+}
+
+bool bitset_union_difference(Bitset* set, Bitset* other, Bitset* excluded) {
+    assert(set->word_count == other->word_count && set->word_count == excluded->word_count);
+
+    __m128i changed = _mm_setzero_si128();
+    for (u32 i = 0; i < set->word_count; i += 2) {
+        __m128i old = _mm_loadu_si128((__m128i*)(set->words + i));
+        __m128i added = _mm_andnot_si128(_mm_loadu_si128((__m128i*)(excluded->words + i)), _mm_loadu_si128((__m128i*)(other->words + i)));
+        __m128i result = _mm_or_si128(old, added);
+        changed = _mm_or_si128(changed, _mm_xor_si128(result, old));
+        _mm_storeu_si128((__m128i*)(set->words + i), result);
+    }
+
+    return any_bits(changed);
+}
+
+#else
+
+bool bitset_union(Bitset* set, Bitset* other) {
+    assert(set->word_count == other->word_count);
+
+    u64 changed = 0;
+    for (u32 i = 0; i < set->word_count; ++i) {
+        u64 result = set->words[i] | other->words[i];
+        changed |= result ^ set->words[i];
+        set->words[i] = result;
+    }
+
+    return changed != 0;
+}
+
+bool bitset_intersect(Bitset* set, Bitset* other) {
+    assert(set->word_count == other->word_count);
+
+    u64 changed = 0;
+    for (u32 i = 0; i < set->word_count; ++i) {
+        u64 result = set->words[i] & other->words[i];
+        changed |= result ^ set->words[i];
+        set->words[i] = result;
+    }
+
+    return changed != 0;
+}
+
+bool bitset_union_difference(Bitset* set, Bitset* other, Bitset* excluded) {
+    assert(set->word_count == other->word_count && set->word_count == excluded->word_count);
+
+    u64 changed = 0;
+    for (u32 i = 0; i < set->word_count; ++i) {
+        u64 result = set->words[i] | (other->words[i] & ~excluded->words[i]);
+        changed |= result ^ set->words[i];
+        set->words[i] = result;
+    }
+
+    return changed != 0;
+}
+
+#endif
+
+BitsetIterator bitset_begin(Bitset* set) {
+    return (BitsetIterator){
+        .set = set,
+        .word_index = 0,
+        .word = set->word_count ? set->words[0] : 0,
+        .value = 0
+    };
+}
+
+// Skips empty words, then takes the lowest remaining bit of the current one.
+bool bitset_continue(BitsetIterator* it) {
+    while (!it->word) {
+        if (++it->word_index >= it->set->word_count) {
+            return false;
+        }
+        it->word = it->set->words[it->word_index];
+    }
+
+    it->value = (i64)it->word_index * 64 + count_trailing_zeros64(it->word);
+    return true;
+}
+
+void bitset_next(BitsetIterator* it) {
+    it->word &= it->word - 1;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "base.h"
+
+// Fixed-size set of small non-negative integers, one bit each. Sets that are combined
+// must have the same size. The word count is rounded up to a whole vector so the
+// vector loops need no scalar tail.
+typedef struct {
+    u64* words;
+    u32 word_count;
+} Bitset;
+
+typedef struct {
+    Bitset* set;
+    u32 word_index;
+    u64 word;
+    i64 value;
+} BitsetIterator;
+
+Bitset new_bitset(Arena* arena, i64 bit_count);
+
+static inline bool bitset_has(Bitset* set, i64 bit) {
+    return (set->words[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bitset_insert(Bitset* set, i64 bit) {
+    set->words[bit / 64] |= 1ull << (bit % 64);
+}
+
+static inline void bitset_remove(Bitset* set, i64 bit) {
+    set->words[bit / 64] &= ~(1ull << (bit % 64));
+}
+
+void bitset_clear(Bitset* set);
+void bitset_fill(Bitset* set, i64 bit_count);
+void bitset_copy(Bitset* set, Bitset* source);
+u64 bitset_count(Bitset* set);
+
+// These return whether the set changed.
+bool bitset_union(Bitset* set, Bitset* other);
+bool bitset_intersect(Bitset* set, Bitset* other);
+bool bitset_union_difference(Bitset* set, Bitset* other, Bitset* excluded); // set |= other & ~excluded
+
+BitsetIterator bitset_begin(Bitset* set);
+bool bitset_continue(BitsetIterator* it);
+void bitset_next(BitsetIterator* it);
+
+#define foreach_bit(set, it)  for (BitsetIterator it = bitset_begin(set); bitset_continue(&it); bitset_next(&it))
@@ -1,31 +1,93 @@
 #include <stdio.h>
 
 #include "bytecode.h"
+#include "dataflow.h"
 #include "error.h"
+#include "lexer.h"
+#include "set.h"
+#include "vm.h"
 
-#define MAX_LABELS 1024
+typedef enum {
+    TRANSLATE_VISIT,
+    TRANSLATE_STATEMENT, // Translate the node as a statement, then the statements following it.
+    TRANSLATE_STATEMENT_DONE,
+    TRANSLATE_FINISH,
+
+    TRANSLATE_CONDITION, // Stages of ifs and whiles.
+    TRANSLATE_BODY,
+    TRANSLATE_ELSE,
+} TranslateStage;
+
+typedef struct {
+    u32 node;
+    TranslateStage stage;
+    int label;
+} TranslateWork;
 
 typedef struct {
+    AST* ast;
+    TokenBuffer* tokens;
     Bytecode* bytecode;
-    int label_count;
-    int label_locations[MAX_LABELS];
     Program* program;
+    Arena* arena;
+
+    int label_count;
+    int label_capacity;
+    int* label_locations;
+
+    Arena* scratch;
+
+    TranslateWork* work;
+    u32 work_count;
+    u32 work_capacity;
+
+    i64* values;
+    u32 value_count;
+    u32 value_capacity;
+
+    // Indexed by node, see label_register_needs.
+    u32* register_needs;
+    bool* assigns;
 } Translator;
 
 internal void emit(Translator* translator, Op op, Type* type, i64 a1, i64 a2, i64 a3, int line) {
-    assert(translator->bytecode->length < MAX_INSTRUCTION_COUNT);
+    Bytecode* bytecode = translator->bytecode;
     assert(op);
+    assert(a1 >= 0 && a1 <= UINT32_MAX && a2 >= 0 && a2 <= UINT32_MAX && a3 >= 0 && a3 <= UINT32_MAX);
 
     OpType op_type = type ? type->op_type : OP_TYPE_NONE;
 
-    Instruction* ins = translator->bytecode->instructions + (translator->bytecode->length++);
-    ins->op = op;
-    ins->type = op_type;
-    ins->a1 = a1;
-    ins->a2 = a2;
-    ins->a3 = a3;
-    ins->label = -1;
-    ins->line = line;
+    if (bytecode->length == bytecode->capacity) {
+        int capacity = bytecode->capacity ? bytecode->capacity * 2 : 256;
+        bytecode->instructions = arena_grow_array(translator->arena, bytecode->instructions, bytecode->length, capacity);
+        bytecode->labels = arena_grow_array(translator->arena, bytecode->labels, bytecode->length, capacity);
+        bytecode->lines = arena_grow_array(translator->arena, bytecode->lines, bytecode->length, capacity);
+        bytecode->capacity = capacity;
+    }
+
+    int index = bytecode->length++;
+    Instruction* ins = bytecode->instructions + index;
+    ins->op = (u8)op;
+    ins->type = (u8)op_type;
+    ins->a1 = (u32)a1;
+    ins->a2 = (u32)a2;
+    ins->a3 = (u32)a3;
+
+    bytecode->labels[index] = -1;
+    bytecode->lines[index] = line;
+}
+
+internal u32 add_constant(Translator* translator, i64 value) {
+    Bytecode* bytecode = translator->bytecode;
+
+    if (bytecode->constant_count == bytecode->constant_capacity) {
+        u32 capacity = bytecode->constant_capacity ? bytecode->constant_capacity * 2 : 64;
+        bytecode->constants = arena_grow_array(translator->arena, bytecode->constants, bytecode->constant_count, capacity);
+        bytecode->constant_capacity = capacity;
+    }
+
+    bytecode->constants[bytecode->constant_count] = value;
+    return bytecode->constant_count++;
 }
 
 internal i64 get_reg(Translator* translator) {
@@ -33,7 +95,12 @@ internal i64 get_reg(Translator* translator) {
 }
 
 internal int get_label(Translator* translator) {
-    assert(translator->label_count < MAX_LABELS);
+    if (translator->label_count == translator->label_capacity) {
+        int capacity = translator->label_capacity ? translator->label_capacity * 2 : 64;
+        translator->label_locations = arena_grow_array(translator->scratch, translator->label_locations, translator->label_count, capacity);
+        translator->label_capacity = capacity;
+    }
+
     return translator->label_count++;
 }
 
@@ -42,160 +109,482 @@ internal void place_label(Translator* translator, int label) {
     translator->label_locations[label] = translator->bytecode->length;
 }
 
-internal i64 translate(Translator* translator, ASTNode* node) {
-    static_assert(NUM_AST_KINDS == 18, "not all ast kinds handled");
-    switch (node->kind)
-    {
-        default:
-            assert(false);
-            return 0;
+internal int node_line(Translator* translator, u32 node) {
+    return token_line(translator->tokens, translator->ast->tokens[node]);
+}
 
-        case AST_INT_LITERAL: {
-            i64 result = get_reg(translator);
-            emit(translator, OP_IMM, node->type, result, node->int_literal, 0, node->token.line);
-            return result;
-        }
+internal void push_work(Translator* translator, u32 node, TranslateStage stage, int label) {
+    if (translator->work_count == translator->work_capacity) {
+        u32 capacity = translator->work_capacity ? translator->work_capacity * 2 : 256;
+        translator->work = arena_grow_array(translator->scratch, translator->work, translator->work_count, capacity);
+        translator->work_capacity = capacity;
+    }
 
-        case AST_VARIABLE: {
-            return node->variable->reg;
-        }
+    translator->work[translator->work_count++] = (TranslateWork){ .node = node, .stage = stage, .label = label };
+}
 
-        case AST_CAST: {
-            i64 input = translate(translator, node->expression);
-            i64 result = get_reg(translator);
-            emit(translator, OP_CAST, node->type, result, input, node->expression->type->op_type, node->token.line);
-            return result;
-        }
+internal void push_value(Translator* translator, i64 value) {
+    if (translator->value_count == translator->value_capacity) {
+        u32 capacity = translator->value_capacity ? translator->value_capacity * 2 : 256;
+        translator->values = arena_grow_array(translator->scratch, translator->values, translator->value_count, capacity);
+        translator->value_capacity = capacity;
+    }
+
+    translator->values[translator->value_count++] = value;
+}
+
+internal i64 pop_value(Translator* translator) {
+    assert(translator->value_count);
+    return translator->values[--translator->value_count];
+}
 
+Op ast_binary_op(ASTKind kind) {
+    switch (kind) {
+        default:
+            assert(false);
+            return 0;
         case AST_ADD:
+            return OP_ADD;
         case AST_SUB:
+            return OP_SUB;
         case AST_MUL:
+            return OP_MUL;
         case AST_DIV:
+            return OP_DIV;
         case AST_LESS:
+            return OP_LESS;
         case AST_LEQUAL:
+            return OP_LEQUAL;
         case AST_EQUAL:
+            return OP_EQUAL;
         case AST_NEQUAL:
-        {
-            i64 left = translate(translator, node->left);
-            i64 right = translate(translator, node->right);
-            i64 result = get_reg(translator);
+            return OP_NEQUAL;
+    }
+}
+
+// Sethi-Ullman labels: how many registers an expression needs besides those of the
+// variables it reads, when of two operands the one needing more is evaluated first.
+// Also marks the expressions containing an assignment, whose operands keep their order.
+internal void label_register_needs(Translator* translator, u32 root) {
+    AST* ast = translator->ast;
 
-            Op op = 0;
+    translator->register_needs = arena_push_array(translator->scratch, u32, ast->count);
+    translator->assigns = arena_push_array(translator->scratch, bool, ast->count);
 
-            switch (node->kind) {
+    u32* needs = translator->register_needs;
+    bool* assigns = translator->assigns;
+
+    // Nodes are pushed twice, once to visit and once to finish, and never again.
+    u32* stack = arena_push_array(translator->scratch, u32, (u64)ast->count * 2);
+    u32 stack_count = 0;
+
+    stack[stack_count++] = root * 2;
+
+    while (stack_count) {
+        u32 node = stack[--stack_count] / 2;
+        bool finish = stack[stack_count] & 1;
+        u32 a1 = ast->a1[node];
+        u32 a2 = ast->a2[node];
+
+        if (!finish) {
+            stack[stack_count++] = node * 2 + 1;
+
+            switch (ast->kinds[node]) {
                 default:
-                    assert(false);
                     break;
-                case AST_ADD:
-                    op = OP_ADD;
+
+                case AST_CAST:
+                case AST_RETURN:
+                    stack[stack_count++] = a1 * 2;
                     break;
+
+                case AST_ADD:
                 case AST_SUB:
-                    op = OP_SUB;
-                    break;
                 case AST_MUL:
-                    op = OP_MUL;
-                    break;
                 case AST_DIV:
-                    op = OP_DIV;
-                    break;
                 case AST_LESS:
-                    op = OP_LESS;
-                    break;
                 case AST_LEQUAL:
-                    op = OP_LEQUAL;
-                    break;
                 case AST_EQUAL:
-                    op = OP_EQUAL;
-                    break;
                 case AST_NEQUAL:
-                    op = OP_NEQUAL;
+                    stack[stack_count++] = a1 * 2;
+                    stack[stack_count++] = a2 * 2;
+                    break;
+
+                case AST_ASSIGN:
+                    stack[stack_count++] = a2 * 2;
+                    break;
+
+                case AST_BLOCK:
+                    for (u32 statement = a1; statement; statement = ast->nexts[statement]) {
+                        stack[stack_count++] = statement * 2;
+                    }
+                    break;
+
+                case AST_IF:
+                case AST_WHILE:
+                    stack[stack_count++] = a1 * 2;
+                    stack[stack_count++] = a2 * 2;
+                    if (ast->a3[node]) {
+                        stack[stack_count++] = ast->a3[node] * 2;
+                    }
                     break;
             }
+            continue;
+        }
+
+        switch (ast->kinds[node]) {
+            default:
+                break;
+
+            case AST_INT_LITERAL:
+                needs[node] = 1;
+                break;
+
+            case AST_CAST:
+                needs[node] = needs[a1] ? needs[a1] : 1;
+                assigns[node] = assigns[a1];
+                break;
+
+            case AST_ADD:
+            case AST_SUB:
+            case AST_MUL:
+            case AST_DIV:
+            case AST_LESS:
+            case AST_LEQUAL:
+            case AST_EQUAL:
+            case AST_NEQUAL:
+            {
+                // The operand evaluated second needs one more, for the result of the first.
+                assigns[node] = assigns[a1] || assigns[a2];
+                u32 first = needs[a1];
+                u32 second = needs[a2] + 1;
+                if (!assigns[node] && needs[a2] > needs[a1]) {
+                    first = needs[a2];
+                    second = needs[a1] + 1;
+                }
+                needs[node] = first > second ? first : second;
+                break;
+            }
 
-            emit(translator, op, node->type, result, left, right, node->token.line);
-            return result;
+            // The value of an assignment is the register of its right side.
+            case AST_ASSIGN:
+                needs[node] = needs[a2];
+                assigns[node] = true;
+                break;
         }
+    }
+}
 
-        case AST_ASSIGN: {
-            i64 result = translate(translator, node->right);
-            emit(translator, OP_COPY, node->type, node->left->variable->reg, result, 0, node->token.line);
-            return result;
+// Evaluating the heavier operand first lowers the peak register pressure of the whole
+// expression. Only expressions without assignments are reordered, since variables are
+// read where the operator is emitted and an assignment moved ahead could change what an
+// operand reads. The operands keep their places in the instruction either way, so
+// comparisons parsed from > and >= with swapped operands still compare the same way.
+internal bool evaluates_right_first(Translator* translator, u32 node) {
+    u32 left = translator->ast->a1[node];
+    u32 right = translator->ast->a2[node];
+    return !translator->assigns[node] && translator->register_needs[right] > translator->register_needs[left];
+}
+
+// Every node leaves exactly one value on the value stack once it is fully translated:
+// the register holding its result for expressions, -1 for statements.
+internal void translate_visit(Translator* translator, u32 node) {
+    AST* ast = translator->ast;
+
+    static_assert(NUM_AST_KINDS == 18, "not all ast kinds handled");
+    switch (ast->kinds[node])
+    {
+        default:
+            assert(false);
+            break;
+
+        case AST_INT_LITERAL: {
+            i64 result = get_reg(translator);
+            i64 value = wrap_to_type(ast->types[node]->op_type, ast->literals[ast->a1[node]]);
+            emit(translator, OP_IMM, ast->types[node], result, add_constant(translator, value), 0, node_line(translator, node));
+            push_value(translator, result);
+            break;
         }
 
+        case AST_VARIABLE:
+            push_value(translator, ast->variables[ast->a1[node]].reg);
+            break;
+
+        case AST_CAST:
+        case AST_RETURN:
+            push_work(translator, node, TRANSLATE_FINISH, 0);
+            push_work(translator, ast->a1[node], TRANSLATE_VISIT, 0);
+            break;
+
+        case AST_ADD:
+        case AST_SUB:
+        case AST_MUL:
+        case AST_DIV:
+        case AST_LESS:
+        case AST_LEQUAL:
+        case AST_EQUAL:
+        case AST_NEQUAL:
+            push_work(translator, node, TRANSLATE_FINISH, 0);
+            if (evaluates_right_first(translator, node)) {
+                push_work(translator, ast->a1[node], TRANSLATE_VISIT, 0);
+                push_work(translator, ast->a2[node], TRANSLATE_VISIT, 0);
+            }
+            else {
+                push_work(translator, ast->a2[node], TRANSLATE_VISIT, 0);
+                push_work(translator, ast->a1[node], TRANSLATE_VISIT, 0);
+            }
+            break;
+
+        case AST_ASSIGN:
+            push_work(translator, node, TRANSLATE_FINISH, 0);
+            push_work(translator, ast->a2[node], TRANSLATE_VISIT, 0);
+            break;
+
         case AST_BLOCK:
-            for (ASTNode* statement = node->first; statement; statement = statement->next) {
-                translate(translator, statement);
+            if (ast->a1[node]) {
+                push_work(translator, node, TRANSLATE_FINISH, 0);
+                push_work(translator, ast->a1[node], TRANSLATE_STATEMENT, 0);
             }
-            return -1;
-            
-        case AST_RETURN: {
-            i64 result = translate(translator, node->expression);
-            emit(translator, OP_RET, node->type, result, 0, 0, node->token.line);
-            return -1;
+            else {
+                push_value(translator, -1);
+            }
+            break;
+
+        case AST_VARIABLE_DECL:
+            ast->variables[ast->a1[node]].reg = get_reg(translator);
+            push_value(translator, -1);
+            break;
+
+        case AST_IF:
+        case AST_WHILE:
+        {
+            // Then/else/end for ifs, start/body/end for whiles.
+            int label = get_label(translator);
+            get_label(translator);
+            get_label(translator);
+
+            if (ast->kinds[node] == AST_WHILE) {
+                place_label(translator, label);
+            }
+
+            push_work(translator, node, TRANSLATE_CONDITION, label);
+            push_work(translator, ast->a1[node], TRANSLATE_VISIT, 0);
+            break;
+        }
+    }
+}
+
+internal void translate_finish(Translator* translator, u32 node) {
+    AST* ast = translator->ast;
+
+    switch (ast->kinds[node])
+    {
+        default:
+            assert(false);
+            break;
+
+        case AST_CAST: {
+            u32 expression = ast->a1[node];
+            i64 input = pop_value(translator);
+            i64 result = get_reg(translator);
+            emit(translator, OP_CAST, ast->types[node], result, input, ast->types[expression]->op_type, node_line(translator, node));
+            push_value(translator, result);
+            break;
+        }
+
+        case AST_ADD:
+        case AST_SUB:
+        case AST_MUL:
+        case AST_DIV:
+        case AST_LESS:
+        case AST_LEQUAL:
+        case AST_EQUAL:
+        case AST_NEQUAL:
+        {
+            i64 second = pop_value(translator);
+            i64 first = pop_value(translator);
+            bool right_first = evaluates_right_first(translator, node);
+            i64 left = right_first ? second : first;
+            i64 right = right_first ? first : second;
+            i64 result = get_reg(translator);
+
+            emit(translator, ast_binary_op(ast->kinds[node]), ast->types[node], result, left, right, node_line(translator, node));
+            push_value(translator, result);
+            break;
+        }
+
+        case AST_ASSIGN: {
+            i64 result = pop_value(translator);
+            Variable* variable = ast->variables + ast->a1[ast->a1[node]];
+            emit(translator, OP_COPY, ast->types[node], variable->reg, result, 0, node_line(translator, node));
+            push_value(translator, result);
+            break;
         }
 
-        case AST_VARIABLE_DECL: {
-            node->variable->reg = get_reg(translator);
-            return -1;
+        case AST_BLOCK:
+            push_value(translator, -1);
+            break;
+
+        case AST_RETURN: {
+            i64 result = pop_value(translator);
+            emit(translator, OP_RET, ast->types[node], result, 0, 0, node_line(translator, node));
+            push_value(translator, -1);
+            break;
         }
+    }
+}
 
-        case AST_IF: {
-            bool has_else = node->conditional.block_else != 0;
+internal void translate_if(Translator* translator, TranslateWork work) {
+    AST* ast = translator->ast;
+    u32 node = work.node;
 
-            int label_then = get_label(translator);
-            int label_else = get_label(translator);
-            int label_end = 0;
+    int label_then = work.label;
+    int label_else = work.label + 1;
+    int label_end = work.label + 2;
+    bool has_else = ast->a3[node] != 0;
 
-            i64 condition = translate(translator, node->conditional.condition);
+    switch (work.stage) {
+        default:
+            assert(false);
+            break;
+
+        case TRANSLATE_CONDITION: {
+            i64 condition = pop_value(translator);
             emit(translator, OP_CJMP, 0, condition, label_then, label_else, INT32_MAX);
 
             place_label(translator, label_then);
-            translate(translator, node->conditional.block_then);
+            push_work(translator, node, TRANSLATE_BODY, work.label);
+            push_work(translator, ast->a2[node], TRANSLATE_VISIT, 0);
+            break;
+        }
+
+        case TRANSLATE_BODY:
+            pop_value(translator);
 
             if (has_else) {
-                label_end = get_label(translator);
                 emit(translator, OP_JMP, 0, label_end, 0, 0, INT32_MAX);
             }
 
             place_label(translator, label_else);
 
             if (has_else) {
-                translate(translator, node->conditional.block_else);
+                push_work(translator, node, TRANSLATE_ELSE, work.label);
+                push_work(translator, ast->a3[node], TRANSLATE_VISIT, 0);
+            }
+            else {
+                // Every label gets a location, scratch memory is not cleared between uses.
                 place_label(translator, label_end);
+                push_value(translator, -1);
             }
+            break;
 
-            return -1;
-        }
+        case TRANSLATE_ELSE:
+            pop_value(translator);
+            place_label(translator, label_end);
+            push_value(translator, -1);
+            break;
+    }
+}
+
+internal void translate_while(Translator* translator, TranslateWork work) {
+    AST* ast = translator->ast;
+    u32 node = work.node;
 
-        case AST_WHILE: {
-            int label_start = get_label(translator);
-            int label_body = get_label(translator);
-            int label_end = get_label(translator);
+    int label_start = work.label;
+    int label_body = work.label + 1;
+    int label_end = work.label + 2;
 
-            place_label(translator, label_start);
-            i64 condition = translate(translator, node->conditional.condition);
+    switch (work.stage) {
+        default:
+            assert(false);
+            break;
+
+        case TRANSLATE_CONDITION: {
+            i64 condition = pop_value(translator);
             emit(translator, OP_CJMP, 0, condition, label_body, label_end, INT32_MAX);
 
             place_label(translator, label_body);
-            translate(translator, node->conditional.block_then);
+            push_work(translator, node, TRANSLATE_BODY, work.label);
+            push_work(translator, ast->a2[node], TRANSLATE_VISIT, 0);
+            break;
+        }
+
+        case TRANSLATE_BODY:
+            pop_value(translator);
             emit(translator, OP_JMP, 0, label_start, 0, 0, INT32_MAX);
 
             place_label(translator, label_end);
+            push_value(translator, -1);
+            break;
+    }
+}
+
+internal void translate(Translator* translator, u32 root) {
+    AST* ast = translator->ast;
+
+    push_work(translator, root, TRANSLATE_VISIT, 0);
+
+    while (translator->work_count) {
+        TranslateWork work = translator->work[--translator->work_count];
+        u32 node = work.node;
+
+        switch (work.stage) {
+            case TRANSLATE_VISIT:
+                translate_visit(translator, node);
+                break;
+
+            case TRANSLATE_STATEMENT:
+                push_work(translator, node, TRANSLATE_STATEMENT_DONE, 0);
+                push_work(translator, node, TRANSLATE_VISIT, 0);
+                break;
+
+            case TRANSLATE_STATEMENT_DONE:
+                pop_value(translator);
+                if (ast->nexts[node]) {
+                    push_work(translator, ast->nexts[node], TRANSLATE_STATEMENT, 0);
+                }
+                break;
 
-            return -1;
+            case TRANSLATE_FINISH:
+                translate_finish(translator, node);
+                break;
+
+            case TRANSLATE_CONDITION:
+            case TRANSLATE_BODY:
+            case TRANSLATE_ELSE:
+                if (ast->kinds[node] == AST_IF) {
+                    translate_if(translator, work);
+                }
+                else {
+                    translate_while(translator, work);
+                }
+                break;
         }
     }
+
+    pop_value(translator);
+    assert(translator->value_count == 0);
 }
 
 Bytecode* generate_bytecode(Arena* arena, ASTFunction* ast_function) {
     Bytecode* bytecode = arena_push_type(arena, Bytecode);
 
     Translator translator = {
-        .bytecode = bytecode
+        .ast = &ast_function->ast,
+        .tokens = ast_function->tokens,
+        .bytecode = bytecode,
+        .arena = arena
     };
 
+    Scratch scratch = get_scratch(arena);
+    translator.scratch = scratch.arena;
+
+    label_register_needs(&translator, ast_function->body);
     translate(&translator, ast_function->body);
 
+    // Every translator label maps to at most one bytecode label, plus the end label.
+    bytecode->label_locations = arena_push_array(arena, int, translator.label_count + 1);
+
     // Remap labels to remove duplicates
 
     // Go through all labelled instructions and assign a new label
@@ -204,17 +593,14 @@ Bytecode* generate_bytecode(Arena* arena, ASTFunction* ast_function) {
         int ins_index = translator.label_locations[i];
         if (ins_index < bytecode->length)
         {
-            Instruction* ins = bytecode->instructions + ins_index;
-            if (ins->label == -1) {
-                assert(bytecode->label_count < MAX_LABEL_COUNT);
-                ins->label = bytecode->label_count++;
-                bytecode->label_locations[ins->label] = ins_index;
+            if (bytecode->labels[ins_index] == -1) {
+                bytecode->labels[ins_index] = bytecode->label_count++;
+                bytecode->label_locations[bytecode->labels[ins_index]] = ins_index;
             }
         }
     }
 
     // End label
-    assert(bytecode->label_count < MAX_LABEL_COUNT);
     bytecode->label_locations[bytecode->label_count++] = bytecode->length;
 
     // Set translator label locations to the new label index
@@ -223,8 +609,7 @@ Bytecode* generate_bytecode(Arena* arena, ASTFunction* ast_function) {
         int ins_index = translator.label_locations[i];
         if (ins_index < bytecode->length)
         {
-            Instruction* ins = bytecode->instructions + ins_index;
-            translator.label_locations[i] = ins->label;
+            translator.label_locations[i] = bytecode->labels[ins_index];
         }
         else {
             translator.label_locations[i] = bytecode->label_count-1;
@@ -246,56 +631,67 @@ Bytecode* generate_bytecode(Arena* arena, ASTFunction* ast_function) {
         }
     }
 
+    release_scratch(&scratch);
+
     return bytecode;
 }
 
-internal BasicBlock* new_basic_block(Arena* arena, int start) {
-    BasicBlock* block = arena_push_type(arena, BasicBlock);
-    block->start = start;
-    block->end = start;
-    block->first_line = INT32_MAX;
-    return block;
-}
+// Blocks in layout order while the graph is built. Successors are layout indices, where
+// block_count stands for falling off the end of the function.
+typedef struct {
+    int start;
+    int end;
+    int first_line;
+    bool has_user_code;
+    bool reachable;
 
-internal void mark_reachable(BasicBlock* block) {
-    if (!block->reachable)
-    {
-        block->reachable = true;
-        for (int i = 0; i < block->successor_count; ++i) {
-            mark_reachable(block->successors[i]);
-        }
-    }
-}
+    int successor_count;
+    u32 successors[2];
+} LayoutBlock;
 
-BasicBlock* analyze_control_flow(Arena* arena, char* source, Bytecode* bytecode) {
-    BasicBlock* root = new_basic_block(arena, 0);
-    BasicBlock* current = root;
+typedef struct {
+    u32 block;
+    int next_successor;
+} DepthFirstFrame;
 
-    bool start_new_block = false;
+ControlFlowGraph* analyze_control_flow(Arena* arena, Source* source, Bytecode* bytecode) {
+    Scratch scratch = get_scratch(arena);
+
+    u32 block_count = 0;
+    u32 block_capacity = 256;
+    LayoutBlock* blocks = arena_push_array(scratch.arena, LayoutBlock, block_capacity);
+    blocks[block_count++] = (LayoutBlock){ .first_line = INT32_MAX };
+
+    u32* labelled_blocks = arena_push_array(scratch.arena, u32, bytecode->label_count);
 
-    BasicBlock end_block = {0};
-    BasicBlock* labelled_blocks[MAX_LABELS] = {0};
-    labelled_blocks[bytecode->label_count-1] = &end_block;
+    bool start_new_block = false;
 
-    int index_counter = 1;
     for (int i = 0; i < bytecode->length; ++i) {
         Instruction* ins = bytecode->instructions + i;
 
-        if (ins->label != -1 || start_new_block) {
+        int label = bytecode->labels[i];
+
+        if (label != -1 || start_new_block) {
             start_new_block = false;
-            current = current->next = new_basic_block(arena, i);
-            current->index = index_counter++;
 
-            if (ins->label != -1) {
-                labelled_blocks[ins->label] = current;
+            if (block_count == block_capacity) {
+                block_capacity *= 2;
+                blocks = arena_grow_array(scratch.arena, blocks, block_count, block_capacity);
+            }
+            blocks[block_count++] = (LayoutBlock){ .start = i, .end = i, .first_line = INT32_MAX };
+
+            if (label != -1) {
+                labelled_blocks[label] = block_count - 1;
             }
         }
 
+        LayoutBlock* current = blocks + block_count - 1;
         ++current->end;
 
         if (ins->op != OP_CJMP && ins->op != OP_JMP) {
             current->has_user_code = true;
-            current->first_line = ins->line < current->first_line ? ins->line : current->first_line;
+            int line = bytecode->lines[i];
+            current->first_line = line < current->first_line ? line : current->first_line;
         }
 
         switch (ins->op) {
@@ -307,521 +703,2114 @@ BasicBlock* analyze_control_flow(Arena* arena, char* source, Bytecode* bytecode)
         }
     }
 
-    for (BasicBlock* block = root; block; block = block->next) {
+    u32 end_block = block_count;
+    labelled_blocks[bytecode->label_count-1] = end_block;
+
+    for (u32 b = 0; b < block_count; ++b) {
+        LayoutBlock* block = blocks + b;
+
         if (block->end == block->start) {
-            block->successors[0] = block->next ? block->next : &end_block;
-            ++block->successor_count;
+            block->successors[block->successor_count++] = b + 1;
             continue;
         }
 
         Instruction* ins = bytecode->instructions + (block->end-1);
         switch (ins->op) {
             default:
-                block->successors[0] = block->next ? block->next : &end_block;
-                ++block->successor_count;
+                block->successors[block->successor_count++] = b + 1;
                 break;
 
             case OP_RET:
                 break;
 
             case OP_JMP:
-                block->successors[0] = labelled_blocks[ins->a1];
-                ++block->successor_count;
+                block->successors[block->successor_count++] = labelled_blocks[ins->a1];
                 break;
 
             case OP_CJMP:
-                block->successors[0] = labelled_blocks[ins->a2];
-                ++block->successor_count;
+                block->successors[block->successor_count++] = labelled_blocks[ins->a2];
                 if (labelled_blocks[ins->a3] != block->successors[0]) {
-                    block->successors[1] = labelled_blocks[ins->a3];
-                    ++block->successor_count;
+                    block->successors[block->successor_count++] = labelled_blocks[ins->a3];
                 }
                 break;
         }
     }
 
-    mark_reachable(root);
+    // Depth-first from the entry with an explicit stack, since a straight line of blocks
+    // can be arbitrarily long. Successors are taken last to first, which puts the taken
+    // side of a branch before the other in reverse postorder, as in the layout.
+    bool end_reachable = false;
+
+    u32 postorder_count = 0;
+    u32* postorder = arena_push_array(scratch.arena, u32, block_count);
+
+    u32 stack_count = 0;
+    DepthFirstFrame* stack = arena_push_array(scratch.arena, DepthFirstFrame, block_count);
+
+    blocks[0].reachable = true;
+    stack[stack_count++] = (DepthFirstFrame){ .block = 0, .next_successor = blocks[0].successor_count - 1 };
+
+    while (stack_count) {
+        DepthFirstFrame* frame = stack + stack_count - 1;
+
+        if (frame->next_successor < 0) {
+            postorder[postorder_count++] = frame->block;
+            --stack_count;
+            continue;
+        }
+
+        u32 successor = blocks[frame->block].successors[frame->next_successor--];
+
+        if (successor == end_block) {
+            end_reachable = true;
+        }
+        else if (!blocks[successor].reachable) {
+            blocks[successor].reachable = true;
+            stack[stack_count++] = (DepthFirstFrame){ .block = successor, .next_successor = blocks[successor].successor_count - 1 };
+        }
+    }
 
     bool success = true;
 
-    if (end_block.reachable) {
+    if (end_reachable) {
         printf("Not all control paths return.\n");
         success = false;
     }
 
-    for (BasicBlock* block = root; block; block = block->next) {
-        if (block->has_user_code && !block->reachable) {
-            error_on_line(source, block->first_line, "Unreachable code");
+    for (u32 b = 0; b < block_count; ++b) {
+        if (blocks[b].has_user_code && !blocks[b].reachable) {
+            error_on_line(source, blocks[b].first_line, "Unreachable code");
             success = false;
         }
-
-        for (int i = block->successor_count - 1; i >= 0; --i) {
-            if (block->successors[i] == &end_block) {
-                block->successors[i] = block->successors[--block->successor_count];
-            }
-            else {
-                ++block->successors[i]->predecessor_count;
-            }
-        }
     }
 
     if (!success) {
+        release_scratch(&scratch);
         return 0;
     }
 
-    for (BasicBlock* block = root; block; block = block->next) {
-        block->predecessors = arena_push_array(arena, BasicBlock*, block->predecessor_count);
-        block->predecessor_count = 0;
+    ControlFlowGraph* cfg = arena_push_type(arena, ControlFlowGraph);
+    cfg->block_count = postorder_count;
+    cfg->blocks = arena_push_array(arena, BasicBlock, postorder_count);
+    cfg->successor_offsets = arena_push_array(arena, u32, postorder_count + 1);
+    cfg->predecessor_offsets = arena_push_array(arena, u32, postorder_count + 1);
+
+    u32* numbers = arena_push_array(scratch.arena, u32, block_count);
+    for (u32 i = 0; i < postorder_count; ++i) {
+        numbers[postorder[i]] = postorder_count - 1 - i;
     }
 
-    for (BasicBlock* block = root; block; block = block->next) {
-        for (int i = 0; i < block->successor_count; ++i) {
-            BasicBlock* successor = block->successors[i];
-            successor->predecessors[successor->predecessor_count++] = block;
+    // Count the edges within the graph, then turn the counts into offsets.
+    u32 edge_count = 0;
+    for (u32 i = 0; i < postorder_count; ++i) {
+        LayoutBlock* block = blocks + postorder[i];
+        u32 b = numbers[postorder[i]];
+
+        cfg->blocks[b] = (BasicBlock){ .start = block->start, .end = block->end };
+
+        for (int s = 0; s < block->successor_count; ++s) {
+            if (block->successors[s] != end_block) {
+                ++cfg->successor_offsets[b + 1];
+                ++cfg->predecessor_offsets[numbers[block->successors[s]] + 1];
+                ++edge_count;
+            }
         }
     }
 
-    return root;
-}
+    for (u32 b = 0; b < postorder_count; ++b) {
+        cfg->successor_offsets[b + 1] += cfg->successor_offsets[b];
+        cfg->predecessor_offsets[b + 1] += cfg->predecessor_offsets[b];
+    }
 
-void analyze_data_flow(BasicBlock* graph, Bytecode* bytecode) {
-    for (BasicBlock* b = graph; b; b = b->next)
-    {
-        for (int i = b->start; i < b->end; ++i)
-        {
-            Instruction* ins = bytecode->instructions + i;
+    cfg->successors = arena_push_array(arena, u32, edge_count);
+    cfg->predecessors = arena_push_array(arena, u32, edge_count);
 
-            #define DEFINES(ai) \
-                    set_insert(&b->var_kill, ins->ai)
+    u32* predecessor_counts = arena_push_array(scratch.arena, u32, postorder_count);
 
-            #define USES(ai) \
-                    if (!set_has(&b->var_kill, ins->ai)) \
-                        set_insert(&b->ue_var, ins->ai);
+    for (u32 b = 0; b < postorder_count; ++b) {
+        LayoutBlock* block = blocks + postorder[postorder_count - 1 - b];
+        u32 successor_count = 0;
 
-            static_assert(NUM_OPS == 16, "not all ops handled");
-            switch (ins->op)
-            {
-                default:
-                    assert(false);
-                    break;
+        for (int s = 0; s < block->successor_count; ++s) {
+            if (block->successors[s] != end_block) {
+                u32 successor = numbers[block->successors[s]];
+                cfg->successors[cfg->successor_offsets[b] + successor_count++] = successor;
+                cfg->predecessors[cfg->predecessor_offsets[successor] + predecessor_counts[successor]++] = b;
+            }
+        }
+    }
 
-                case OP_NOOP:
-                case OP_JMP:
-                    break;
+    release_scratch(&scratch);
 
-                case OP_IMM: // Define a1
-                    DEFINES(a1);
-                    break;
+    return cfg;
+}
 
-                case OP_COPY: // Define a1, use a2
-                case OP_CAST:
-                    USES(a2);
-                    DEFINES(a1);
-                    break;
+int get_operands(Instruction* ins, u32** uses, u32** defined) {
+    *defined = 0;
 
-                case OP_ADD:
-                case OP_SUB:
-                case OP_MUL:
-                case OP_DIV:
-                case OP_LESS:
-                case OP_LEQUAL:
-                case OP_EQUAL:
-                case OP_NEQUAL: // Define a1, use a2 and a3
-                    USES(a2);
-                    USES(a3);
-                    DEFINES(a1);
-                    break;
+    static_assert(NUM_OPS == 18, "not all ops handled");
+    switch (ins->op)
+    {
+        default:
+            assert(false);
+            return 0;
 
-                case OP_RET:
-                case OP_CJMP: // Use a1
-                    USES(a1);
-                    break;
-            }
+        case OP_NOOP:
+        case OP_JMP:
+            return 0;
 
-            #undef USES
-            #undef DEFINES
-        }
+        case OP_IMM: // Define a1
+        case OP_RELOAD:
+            *defined = &ins->a1;
+            return 0;
+
+        case OP_COPY: // Define a1, use a2
+        case OP_CAST:
+            *defined = &ins->a1;
+            uses[0] = &ins->a2;
+            return 1;
+
+        case OP_SPILL: // Use a2
+            uses[0] = &ins->a2;
+            return 1;
+
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_LESS:
+        case OP_LEQUAL:
+        case OP_EQUAL:
+        case OP_NEQUAL: // Define a1, use a2 and a3
+            *defined = &ins->a1;
+            uses[0] = &ins->a2;
+            uses[1] = &ins->a3;
+            return 2;
+
+        case OP_RET:
+        case OP_CJMP: // Use a1
+            uses[0] = &ins->a1;
+            return 1;
     }
+}
 
-    for (;;) {
-        bool changed = false;
+typedef struct {
+    Bitset* ue_var;
+    Bitset* var_kill;
+} LivenessSets;
+
+// live_in |= ue_var | (live_out & ~var_kill)
+internal bool liveness_transfer(void* context, u32 block, Bitset* live_out, Bitset* live_in) {
+    LivenessSets* sets = context;
+    bool changed = bitset_union(live_in, sets->ue_var + block);
+    changed |= bitset_union_difference(live_in, live_out, sets->var_kill + block);
+    return changed;
+}
 
-        for (BasicBlock* n = graph; n; n = n->next) {
-            int initial_size = n->live_out.count;
+Liveness* analyze_liveness(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode) {
+    Scratch scratch = get_scratch(arena);
 
-            for (int i = 0; i < n->successor_count; ++i) {
-                BasicBlock* m = n->successors[i];
-                
-                foreach_set(&m->ue_var, x) {
-                    set_insert(&n->live_out, x.value);
-                }
+    // defined_in holds a stamp of the last block that defined each register, so nothing
+    // has to be cleared between blocks. The second pass uses stamps above block_count.
+    u32* defined_in = arena_push_array(scratch.arena, u32, bytecode->register_count);
+    i64* names = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        names[i] = -1;
+    }
+
+    Liveness* liveness = arena_push_type(arena, Liveness);
+
+    for (u32 b = 0; b < cfg->block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+        u32 stamp = b + 1;
+
+        for (int i = block->start; i < block->end; ++i) {
+            u32* uses[2];
+            u32* defined;
+            int use_count = get_operands(bytecode->instructions + i, uses, &defined);
 
-                foreach_set(&m->live_out, x) {
-                    if (!set_has(&m->var_kill, x.value))
-                        set_insert(&n->live_out, x.value);
+            for (int u = 0; u < use_count; ++u) {
+                u32 use = *uses[u];
+                if (defined_in[use] != stamp && names[use] == -1) {
+                    names[use] = liveness->global_count++;
                 }
             }
 
-            if (n->live_out.count != initial_size)
-                changed = true;
+            if (defined) {
+                defined_in[*defined] = stamp;
+            }
         }
+    }
 
-        if (!changed)
-            break;
+    liveness->global_registers = arena_push_array(arena, u32, liveness->global_count);
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        if (names[i] != -1) {
+            liveness->global_registers[names[i]] = (u32)i;
+        }
     }
 
-    /*
-    Set uinitialized_variables = {0};
+    LivenessSets sets = {
+        .ue_var = arena_push_array(scratch.arena, Bitset, cfg->block_count),
+        .var_kill = arena_push_array(scratch.arena, Bitset, cfg->block_count)
+    };
 
-    foreach_set(&graph->ue_var, x) {
-        set_insert(&uinitialized_variables, x.value);
-    }
+    for (u32 b = 0; b < cfg->block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+        u32 stamp = cfg->block_count + b + 1;
 
-    foreach_set(&graph->live_out, x) {
-        if (!set_has(&graph->var_kill, x.value))
-            set_insert(&uinitialized_variables, x.value);
+        Bitset* ue_var = sets.ue_var + b;
+        Bitset* var_kill = sets.var_kill + b;
+        *ue_var = new_bitset(scratch.arena, liveness->global_count);
+        *var_kill = new_bitset(scratch.arena, liveness->global_count);
+
+        for (int i = block->start; i < block->end; ++i) {
+            u32* uses[2];
+            u32* defined;
+            int use_count = get_operands(bytecode->instructions + i, uses, &defined);
+
+            for (int u = 0; u < use_count; ++u) {
+                u32 use = *uses[u];
+                if (defined_in[use] != stamp) {
+                    bitset_insert(ue_var, names[use]);
+                }
+            }
+
+            if (defined) {
+                defined_in[*defined] = stamp;
+                if (names[*defined] != -1) {
+                    bitset_insert(var_kill, names[*defined]);
+                }
+            }
+        }
     }
-    */
+
+    DataFlowProblem problem = {
+        .direction = DATA_FLOW_BACKWARD,
+        .bit_count = liveness->global_count,
+        .meet = bitset_union,
+        .transfer = liveness_transfer,
+        .context = &sets
+    };
+
+    DataFlowSolution solution = solve_data_flow(arena, cfg, &problem);
+    liveness->live_out = solution.inputs;
+    liveness->live_in = solution.outputs;
+    liveness->visit_count = solution.visit_count;
+
+    release_scratch(&scratch);
+
+    // Registers live into the entry block, live_in[0], are read before being initialized.
+
+    return liveness;
 }
 
-typedef struct AdjacencyNode AdjacencyNode;
-struct AdjacencyNode {
-    bool active;
-    i64 var;
-    AdjacencyNode* next;
-};
+// Each edge is in the lists of both of its live ranges. reverse holds the position of
+// the other half, so an edge can be taken out of both lists in constant time.
+typedef struct {
+    u32 count;
+    u32 capacity;
+    u32* neighbors;
+    u32* reverse;
+} AdjacencyList;
+
+// Interfering pairs are kept in a bit matrix while it is small. Only the lower triangle
+// is stored, but it still grows with the square of the register count, so large
+// functions use a hashed set of edges instead.
+#define MAX_INTERFERENCE_MATRIX_SIZE (64 << 20)
+
+// Adjacency lists are exact: the degree of a live range is the count of its list.
+typedef struct {
+    Arena* arena;
+    i64 register_count;
+    u8* matrix;
+    Set edges;
+    AdjacencyList* adjacency;
+} InterferenceGraph;
+
+internal u64 calculate_bit_matrix_size(i64 register_count) {
+    u64 bit_count = (u64)register_count * (u64)(register_count - 1) / 2;
+    return bit_count / 8 + (bit_count % 8 != 0);
+}
+
+internal InterferenceGraph new_interference_graph(Arena* arena, i64 register_count) {
+    InterferenceGraph graph = {
+        .arena = arena,
+        .register_count = register_count,
+        .edges = new_set(arena),
+        .adjacency = arena_push_array(arena, AdjacencyList, register_count)
+    };
+
+    u64 matrix_size = calculate_bit_matrix_size(register_count);
+    if (matrix_size <= MAX_INTERFERENCE_MATRIX_SIZE) {
+        graph.matrix = arena_push_zero(arena, matrix_size);
+    }
+
+    return graph;
+}
 
-internal bool check_interference(i64 register_count, u8* matrix, i64 a, i64 b) {
+// Row r of the triangle holds the r columns below the diagonal.
+internal i64 interference_bit_index(i64 a, i64 b) {
     i64 row = b > a ? b : a;
     i64 column = b > a ? a : b;
-    i64 bit_index = row * register_count + column;
-    u8 value = (matrix[bit_index/8] >> (bit_index % 8)) & 1;
-    return value;
+    return row * (row - 1) / 2 + column;
 }
 
-internal AdjacencyNode* get_adjacency_node(Arena* arena, AdjacencyNode** free_list) {
-    if (!*free_list) {
-        return arena_push_type(arena, AdjacencyNode);
+internal bool check_interference(InterferenceGraph* graph, i64 a, i64 b) {
+    if (a == b) {
+        return false;
     }
-    else {
-        AdjacencyNode* front = *free_list;
-        *free_list = (*free_list)->next;
-        memset(front, 0, sizeof(*front));
-        return front;
+
+    i64 bit_index = interference_bit_index(a, b);
+    if (!graph->matrix) {
+        return set_has(&graph->edges, bit_index);
     }
+
+    u8 value = (graph->matrix[bit_index/8] >> (bit_index % 8)) & 1;
+    return value;
 }
 
-internal void add_interference(Arena* arena, AdjacencyNode** free_list, i64 register_count, u8* matrix, AdjacencyNode** adjacency_lists, i64 a, i64 b) {
-    if (check_interference(register_count, matrix, a, b)) {
-        return;
+internal u32 add_neighbor(InterferenceGraph* graph, i64 lr, i64 neighbor) {
+    AdjacencyList* list = graph->adjacency + lr;
+
+    if (list->count == list->capacity) {
+        u32 capacity = list->capacity ? list->capacity * 2 : 8;
+        list->neighbors = arena_grow_array(graph->arena, list->neighbors, list->count, capacity);
+        list->reverse = arena_grow_array(graph->arena, list->reverse, list->count, capacity);
+        list->capacity = capacity;
     }
 
-    i64 row = b > a ? b : a;
-    i64 column = b > a ? a : b;
-    i64 bit_index = row * register_count + column;
-    u8* byte = matrix + (bit_index/8);
-    *byte |= 1 << (bit_index % 8);
+    list->neighbors[list->count] = (u32)neighbor;
+    return list->count++;
+}
 
-    AdjacencyNode* node_a = get_adjacency_node(arena, free_list);
-    node_a->active = true;
-    node_a->var = b;
-    node_a->next = adjacency_lists[a];
-    adjacency_lists[a] = node_a;
+// Takes the entry at index out of the list of lr, but not the other half of the edge.
+internal void remove_neighbor(InterferenceGraph* graph, i64 lr, u32 index) {
+    AdjacencyList* list = graph->adjacency + lr;
 
-    AdjacencyNode* node_b = get_adjacency_node(arena, free_list);
-    node_b->active = true;
-    node_b->var = a;
-    node_b->next = adjacency_lists[b];
-    adjacency_lists[b] = node_b;
+    u32 last = --list->count;
+    if (index != last) {
+        u32 moved = list->neighbors[last];
+        list->neighbors[index] = moved;
+        list->reverse[index] = list->reverse[last];
+        graph->adjacency[moved].reverse[list->reverse[index]] = index;
+    }
 }
 
-internal u64 calculate_bit_matrix_size(i64 register_count) {
-    return register_count * register_count / 8 + (register_count % 8 != 0);
+internal void add_interference(InterferenceGraph* graph, i64 a, i64 b) {
+    // The live set can hold the register being defined.
+    if (a == b || check_interference(graph, a, b)) {
+        return;
+    }
+
+    i64 bit_index = interference_bit_index(a, b);
+    if (graph->matrix) {
+        u8* byte = graph->matrix + (bit_index/8);
+        *byte |= 1 << (bit_index % 8);
+    }
+    else {
+        set_insert(&graph->edges, bit_index);
+    }
+
+    u32 index_a = add_neighbor(graph, a, b);
+    u32 index_b = add_neighbor(graph, b, a);
+    graph->adjacency[a].reverse[index_a] = index_b;
+    graph->adjacency[b].reverse[index_b] = index_a;
 }
 
-internal void clear_interference(i64 register_count, u8* matrix, AdjacencyNode** adjacency_lists, AdjacencyNode** free_list)
-{
-    memset(matrix, 0, calculate_bit_matrix_size(register_count));
+// Moves the edges of merged over to kept. Bits of merged are left in the matrix, as it is
+// only ever looked up by its live range from then on.
+internal void merge_live_ranges(InterferenceGraph* graph, i64 kept, i64 merged) {
+    AdjacencyList* list = graph->adjacency + merged;
 
-    for (i64 i = 0; i < register_count; ++i) {
-        if (adjacency_lists[i]) {
-            AdjacencyNode* last = adjacency_lists[i];
-            while (last->next) {
-                last = last->next;
-            }
-            last->next = *free_list;
-            *free_list = adjacency_lists[i];
-            adjacency_lists[i] = 0;
-        }
+    for (u32 i = 0; i < list->count; ++i) {
+        i64 neighbor = list->neighbors[i];
+        remove_neighbor(graph, neighbor, list->reverse[i]);
+        add_interference(graph, kept, neighbor);
     }
+
+    list->count = 0;
 }
 
-internal AdjacencyNode* find_edge(AdjacencyNode* list, i64 var) {
-    while(list) {
-        if (list->var == var) {
-            return list;
-        }
+// Conservative coalescing never turns a colorable graph uncolorable. George: every
+// neighbor of b already interferes with a or has insignificant degree, below k. Briggs:
+// the merged range has fewer than k neighbors of significant degree. George is tried
+// first from the range with fewer neighbors, as it needs no pass over the other's list.
+// marks and mark are scratch for telling the neighbors of b apart.
+internal bool can_coalesce(InterferenceGraph* graph, i64 a, i64 b, u32 k, u32* marks, u32 mark) {
+    if (graph->adjacency[b].count > graph->adjacency[a].count) {
+        i64 swap = a;
+        a = b;
+        b = swap;
+    }
 
-        list = list->next;
+    AdjacencyList* list_a = graph->adjacency + a;
+    AdjacencyList* list_b = graph->adjacency + b;
+
+    bool george = true;
+    for (u32 i = 0; george && i < list_b->count; ++i) {
+        u32 neighbor = list_b->neighbors[i];
+        george = graph->adjacency[neighbor].count < k || check_interference(graph, a, neighbor);
     }
 
-    assert(false);
-    return 0;
-}
+    if (george) {
+        return true;
+    }
 
-internal u32 count_active_interferences(AdjacencyNode* list) {
-    u32 count = 0;
-    while (list) {
-        if (list->active) {
-            ++count;
+    u32 significant = 0;
+    for (u32 i = 0; i < list_b->count; ++i) {
+        u32 neighbor = list_b->neighbors[i];
+        marks[neighbor] = mark;
+        significant += graph->adjacency[neighbor].count >= k;
+    }
+
+    // A neighbor of both loses one edge in the merge.
+    for (u32 i = 0; significant < k && i < list_a->count; ++i) {
+        u32 neighbor = list_a->neighbors[i];
+        u32 degree = graph->adjacency[neighbor].count;
+
+        if (marks[neighbor] != mark) {
+            significant += degree >= k;
+        }
+        else if (degree == k) {
+            --significant;
         }
-        list = list->next;
     }
-    return count;
+
+    return significant < k;
 }
 
+// Coalescing can chain live ranges arbitrarily deep, so the path is compressed in a
+// second loop rather than by recursion.
 internal i64 get_lr(i64* mapping, i64 reg) {
-    if (mapping[reg] == reg) {
-        return reg;
+    i64 actual = reg;
+    while (mapping[actual] != actual) {
+        actual = mapping[actual];
     }
 
-    i64 actual = get_lr(mapping, mapping[reg]);
-    mapping[reg] = actual;
+    while (mapping[reg] != actual) {
+        i64 next = mapping[reg];
+        mapping[reg] = actual;
+        reg = next;
+    }
 
     return actual;
 }
 
-void allocate_registers(BasicBlock* graph, Bytecode* bytecode, u32 register_count) {
-    Scratch scratch = get_scratch(0);
+internal void remap_registers(Bytecode* bytecode, i64* mapping) {
+    for (int i = 0; i < bytecode->length; ++i) {
+        u32* uses[2];
+        u32* defined;
+        int use_count = get_operands(bytecode->instructions + i, uses, &defined);
 
-    u8* adjacency_matrix = arena_push_zero(scratch.arena, calculate_bit_matrix_size(bytecode->register_count));
+        for (int u = 0; u < use_count; ++u) {
+            *uses[u] = (u32)mapping[*uses[u]];
+        }
 
-    AdjacencyNode** adjacency_lists = arena_push_array(scratch.arena, AdjacencyNode*, bytecode->register_count);
-    AdjacencyNode* adjacency_node_free_list = 0;
+        if (defined) {
+            *defined = (u32)mapping[*defined];
+        }
+    }
+}
 
-    int copy_instruction_count = 0;
-    Instruction** copy_instructions = arena_push_array(scratch.arena, Instruction*, bytecode->length);
+// The -O0 allocator: every virtual register keeps a VM register of its own, numbered
+// by first use so that registers of variables that are never touched are dropped.
+void assign_registers_directly(Bytecode* bytecode) {
+    Scratch scratch = get_scratch(0);
 
-    i64* lrs = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    i64* mapping = arena_push_array(scratch.arena, i64, bytecode->register_count);
     for (i64 i = 0; i < bytecode->register_count; ++i) {
-        lrs[i] = i;
+        mapping[i] = -1;
     }
 
-    for (;;) {
-        bool any_coalesced = false;
+    i64 register_count = 0;
 
-        clear_interference(bytecode->register_count, adjacency_matrix, adjacency_lists, &adjacency_node_free_list);
-        copy_instruction_count = 0;
-
-        for (BasicBlock* b = graph; b; b = b->next) {
-            Set live_now = b->live_out;
-
-            #define DEFINES(ai, is_copy) \
-                        if (set_has(&live_now, get_lr(lrs, ins->ai))) \
-                            set_remove(&live_now, get_lr(lrs, ins->ai)); \
-                        foreach_set(&live_now, other) { \
-                            if (!(is_copy) || get_lr(lrs, other.value) != get_lr(lrs, ins->a2)) { \
-                                add_interference(scratch.arena, &adjacency_node_free_list, bytecode->register_count, adjacency_matrix, adjacency_lists, get_lr(lrs, other.value), get_lr(lrs, ins->ai)); \
-                            } \
-                        }
-
-            #define USES(ai) set_insert(&live_now, ins->ai)
-
-            for (int i = b->end-1; i >= b->start; --i) {
-                Instruction* ins = bytecode->instructions + i;
-
-                static_assert(NUM_OPS == 16, "not all ops handled");
-                switch (ins->op)
-                {
-                    default:
-                        assert(false);
-                        break;
-
-                    case OP_NOOP:
-                    case OP_JMP:
-                        break;
-
-                    case OP_IMM: // Define a1
-                        DEFINES(a1, false);
-                        break;
-
-                    case OP_COPY: // Copies require special treatement as they can be coalesced.
-                        DEFINES(a1, true);
-                        USES(a2);
-                        copy_instructions[copy_instruction_count++] = ins;
-                        break;
-                       
-                    case OP_CAST:
-                        DEFINES(a1, false);
-                        USES(a2);
-                        break;
-
-                    case OP_ADD:
-                    case OP_SUB:
-                    case OP_MUL:
-                    case OP_DIV:
-                    case OP_LESS:
-                    case OP_LEQUAL:
-                    case OP_EQUAL:
-                    case OP_NEQUAL: // Define a1, use a2 and a3
-                        DEFINES(a1, false);
-                        USES(a2);
-                        USES(a3);
-                        break;
-
-                    case OP_RET:
-                    case OP_CJMP: // Use a1
-                        USES(a1);
-                        break;
-                }
-            }
+    #define ASSIGN(var) if (mapping[var] == -1) mapping[var] = register_count++
+
+    for (int i = 0; i < bytecode->length; ++i) {
+        Instruction* ins = bytecode->instructions + i;
+
+        switch (ins->op) {
+            default:
+                break;
+
+            case OP_IMM:
+            case OP_CJMP:
+            case OP_RET:
+                ASSIGN(ins->a1);
+                break;
 
-            #undef USES
-            #undef DEFINES
+            case OP_COPY:
+            case OP_CAST:
+                ASSIGN(ins->a1);
+                ASSIGN(ins->a2);
+                break;
+
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_LESS:
+            case OP_LEQUAL:
+            case OP_EQUAL:
+            case OP_NEQUAL:
+                ASSIGN(ins->a1);
+                ASSIGN(ins->a2);
+                ASSIGN(ins->a3);
+                break;
         }
+    }
 
-        for (int i = copy_instruction_count-1; i >= 0; --i)
-        {
-            Instruction* copy = copy_instructions[i];
-            assert(copy->op == OP_COPY);
+    #undef ASSIGN
 
-            i64 lr1 = get_lr(lrs, copy->a1);
-            i64 lr2 = get_lr(lrs, copy->a2);
+    remap_registers(bytecode, mapping);
 
-            if (lr1 == lr2) {
-                copy->op = OP_NOOP;
-                copy_instructions[i] = copy_instructions[--copy_instruction_count];
-            }
-            else if (!check_interference(bytecode->register_count, adjacency_matrix, lr1, lr2))
-            {
-                //printf("Coalesced %lld and %lld\n", lr1, lr2);
-                lrs[lr2] = lr1;
-                any_coalesced = true;
+    bytecode->register_count = register_count;
+    release_scratch(&scratch);
+}
+
+
+u32 find_loop_body(ControlFlowGraph* cfg, u32 header, u32* marks, u32 mark, u32* body) {
+    u32 count = 0;
+
+    for (u32 e = cfg->predecessor_offsets[header]; e < cfg->predecessor_offsets[header + 1]; ++e) {
+        u32 tail = cfg->predecessors[e];
+        if (tail < header) {
+            continue;
+        }
+
+        if (marks[header] != mark) {
+            marks[header] = mark;
+            body[count++] = header;
+        }
+
+        if (marks[tail] != mark) {
+            marks[tail] = mark;
+            body[count++] = tail;
+        }
+    }
+
+    // The header's own predecessors are outside the loop.
+    for (u32 i = 1; i < count; ++i) {
+        u32 block = body[i];
+
+        for (u32 e = cfg->predecessor_offsets[block]; e < cfg->predecessor_offsets[block + 1]; ++e) {
+            u32 predecessor = cfg->predecessors[e];
+            if (marks[predecessor] != mark) {
+                marks[predecessor] = mark;
+                body[count++] = predecessor;
             }
         }
+    }
 
-        if (!any_coalesced)
-            break;
+    return count;
+}
+
+internal u32* find_loop_depths(Arena* arena, ControlFlowGraph* cfg) {
+    u32* depths = arena_push_array(arena, u32, cfg->block_count);
+    u32* marks = arena_push_array(arena, u32, cfg->block_count);
+    u32* body = arena_push_array(arena, u32, cfg->block_count);
+
+    for (u32 header = 0; header < cfg->block_count; ++header) {
+        u32 body_count = find_loop_body(cfg, header, marks, header + 1, body);
+        for (u32 i = 0; i < body_count; ++i) {
+            ++depths[body[i]];
+        }
     }
 
-    Set live_ranges_to_select = {0};
-    for (i64 i = 0; i < bytecode->register_count; ++i) {
-        set_insert(&live_ranges_to_select, get_lr(lrs, i));
+    return depths;
+}
+
+// Spilling a live range adds a load before each use and a store after each definition.
+// Code in a loop is taken to run LOOP_WEIGHT times as often as the code around it.
+#define LOOP_WEIGHT 10.0
+#define MAX_WEIGHTED_LOOP_DEPTH 30
+
+internal f64* weigh_blocks(Arena* arena, ControlFlowGraph* cfg) {
+    Scratch scratch = get_scratch(arena);
+
+    u32* loop_depths = find_loop_depths(scratch.arena, cfg);
+    f64* weights = arena_push_array(arena, f64, cfg->block_count);
+    for (u32 b = 0; b < cfg->block_count; ++b) {
+        u32 depth = loop_depths[b] < MAX_WEIGHTED_LOOP_DEPTH ? loop_depths[b] : MAX_WEIGHTED_LOOP_DEPTH;
+
+        weights[b] = 1.0;
+        for (u32 i = 0; i < depth; ++i) {
+            weights[b] *= LOOP_WEIGHT;
+        }
     }
 
-    i64* colors = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    release_scratch(&scratch);
+    return weights;
+}
+
+// A range that only ever holds one constant is rematerialized instead: its definitions
+// go and the immediate is loaded again before each use, which costs no memory traffic.
+#define REMATERIALIZE_WEIGHT 0.5
+
+// The slot of a spilled register that is rematerialized rather than stored.
+#define REMATERIALIZE -2
+
+// Finds the registers, or live ranges when lrs is given, whose every definition is an
+// OP_IMM of the same constant or a copy of a register that is. Their entry is that
+// OP_IMM, others are OP_INVALID, or OP_NOOP for those never defined. Copies are followed
+// until nothing changes, as a register only turns from undefined to constant to invalid.
+internal bool merge_immediate(Bytecode* bytecode, Instruction* immediate, Instruction* definition) {
+    Instruction merged = *immediate;
+
+    if (definition->op != OP_IMM) {
+        merged.op = OP_INVALID;
+    }
+    else if (immediate->op == OP_NOOP) {
+        merged = *definition;
+    }
+    else if (immediate->op == OP_IMM && (immediate->type != definition->type || bytecode->constants[immediate->a2] != bytecode->constants[definition->a2])) {
+        merged.op = OP_INVALID;
+    }
+
+    bool changed = merged.op != immediate->op;
+    *immediate = merged;
+    return changed;
+}
+
+internal void find_immediates(Bytecode* bytecode, i64* lrs, Instruction* immediates) {
     for (i64 i = 0; i < bytecode->register_count; ++i) {
-        colors[i] = -1;
+        immediates[i] = (Instruction){ .op = OP_NOOP };
     }
 
-    int select_count = 0;
-    i64* select_stack = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    bool any_copies = false;
 
-    for (;;) {
-        bool any_removed = false;
+    for (int i = 0; i < bytecode->length; ++i) {
+        Instruction* ins = bytecode->instructions + i;
 
-        foreach_set(&live_ranges_to_select, lr_it)
-        {
-            i64 lr = lr_it.value;
+        u32* uses[2];
+        u32* defined;
+        get_operands(ins, uses, &defined);
 
-            u32 num_interferences = count_active_interferences(adjacency_lists[lr]);
-            if (num_interferences < register_count)
-            {
-                select_stack[select_count++] = lr;
-                set_remove(&live_ranges_to_select, lr);
-                
-                for (AdjacencyNode* edge = adjacency_lists[lr]; edge; edge = edge->next) {
-                    edge->active = false;
-                    find_edge(adjacency_lists[edge->var], lr)->active = false;
-                }
+        if (defined && ins->op != OP_COPY) {
+            merge_immediate(bytecode, immediates + (lrs ? get_lr(lrs, *defined) : *defined), ins);
+        }
+
+        any_copies |= ins->op == OP_COPY;
+    }
+
+    for (bool changed = any_copies; changed;) {
+        changed = false;
+
+        for (int i = 0; i < bytecode->length; ++i) {
+            Instruction* ins = bytecode->instructions + i;
+            if (ins->op != OP_COPY)
+                continue;
 
-                any_removed = true;
+            Instruction* source = immediates + (lrs ? get_lr(lrs, ins->a2) : ins->a2);
+            Instruction* immediate = immediates + (lrs ? get_lr(lrs, ins->a1) : ins->a1);
+
+            // An undefined source stays pending until it is settled.
+            if (source->op != OP_NOOP && source != immediate) {
+                changed |= merge_immediate(bytecode, immediate, source);
             }
         }
-
-        if (!any_removed)
-            break;
     }
+}
 
-    assert(live_ranges_to_select.count == 0);
+internal void spill_register(Bytecode* bytecode, Instruction* immediates, i64* slots, i64 reg) {
+    slots[reg] = immediates[reg].op == OP_IMM ? REMATERIALIZE : bytecode->slot_count++;
+}
 
-    // TODO: Select non-trivially colorable LRs based on spill metrics
+typedef struct {
+    f64 cost;              // Definitions and uses, weighted by loop depth and rematerialization.
+    u32 reference_count;   // Definitions and uses.
+    u32 length;            // Instructions the range is live across.
+} SpillMetrics;
+
+internal void measure_spill_costs(ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness, i64* lrs, Instruction* immediates,
+                                  f64* block_weights, SparseSet* live_now, SpillMetrics* metrics) {
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        BasicBlock* b = cfg->blocks + block_index;
+        f64 weight = block_weights[block_index];
+
+        sparse_set_clear(live_now);
+        foreach_bit(liveness->live_out + block_index, name) {
+            sparse_set_insert(live_now, (u32)get_lr(lrs, liveness->global_registers[name.value]));
+        }
 
-    while (select_count > 0) {
-        i64 lr = select_stack[--select_count];
+        for (int i = b->end-1; i >= b->start; --i) {
+            for (u32 live_index = 0; live_index < live_now->count; ++live_index) {
+                ++metrics[live_now->dense[live_index]].length;
+            }
 
-        bool occupied_colors[128] = {0};
-        assert(register_count <= LENGTH(occupied_colors));
+            u32* uses[2];
+            u32* defined;
+            int use_count = get_operands(bytecode->instructions + i, uses, &defined);
 
-        for (AdjacencyNode* edge = adjacency_lists[lr]; edge; edge = edge->next) {
-            if (edge->active) {
-                i64 edge_color = colors[edge->var];
-                assert(edge_color != -1);
-                occupied_colors[colors[edge->var]] = true;
+            if (defined) {
+                i64 lr = get_lr(lrs, *defined);
+                SpillMetrics* m = metrics + lr;
+                m->cost += immediates[lr].op == OP_IMM ? 0 : weight;
+                ++m->reference_count;
+                sparse_set_remove(live_now, (u32)lr);
             }
 
-            find_edge(adjacency_lists[edge->var], lr)->active = true;
-        }
-        
-        for (u32 i = 0; i < register_count; ++i) {
-            if (!occupied_colors[i]) {
-                colors[lr] = i;
-                break;
+            for (int u = 0; u < use_count; ++u) {
+                i64 lr = get_lr(lrs, *uses[u]);
+                SpillMetrics* m = metrics + lr;
+                m->cost += immediates[lr].op == OP_IMM ? weight * REMATERIALIZE_WEIGHT : weight;
+                ++m->reference_count;
+                sparse_set_insert(live_now, (u32)lr);
             }
         }
+    }
+}
 
-        assert(colors[lr] != -1);
+// Lower is a better range to spill.
+internal f64 spill_metric(SpillHeuristic heuristic, SpillMetrics* metrics, u32 degree) {
+    static_assert(NUM_SPILL_HEURISTICS == 3, "not all spill heuristics handled");
+    switch (heuristic) {
+        default:
+            assert(false);
+            return 0;
+
+        case SPILL_BY_DENSITY:
+            return metrics->cost / (metrics->length + 1);
+        case SPILL_BY_DEGREE:
+            return metrics->cost / (degree + 1);
+        case SPILL_BY_REFERENCES:
+            return (f64)metrics->reference_count / (degree + 1);
     }
+}
 
-    /*
-    for (i64 i = 0; i < bytecode->register_count; ++i) {
-        printf("%lld -> %lld\n", i, colors[get_lr(lrs, i)]);
+// Worklists of the simplify phase, as in Briggs' optimistic coloring. Ranges of
+// insignificant degree, below k, wait on a stack to be removed; the rest are in a set
+// until removing their neighbors brings them below k or one is chosen to spill.
+// Degrees count the neighbors still in the graph.
+typedef struct {
+    u32 k;
+    u32* degrees;
+    bool* removed;
+
+    u32 low_count;
+    u32* low;
+    SparseSet high;
+
+    int select_count;
+    i64* select_stack;
+} SimplifyWorklists;
+
+internal void remove_live_range(SimplifyWorklists* worklists, InterferenceGraph* graph, i64 lr) {
+    worklists->select_stack[worklists->select_count++] = lr;
+    worklists->removed[lr] = true;
+
+    AdjacencyList* list = graph->adjacency + lr;
+    for (u32 i = 0; i < list->count; ++i) {
+        u32 neighbor = list->neighbors[i];
+        if (!worklists->removed[neighbor] && --worklists->degrees[neighbor] == worklists->k - 1) {
+            sparse_set_remove(&worklists->high, neighbor);
+            worklists->low[worklists->low_count++] = neighbor;
+        }
     }
-    */
+}
 
-    for (int i = 0; i < bytecode->length; ++i) {
-        Instruction* ins = bytecode->instructions + i;
+// A definition interferes with everything live across it, except that a copy does not
+// interfere with its source so that the two can be coalesced.
+internal void build_interference_graph(InterferenceGraph* graph, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness,
+                                       SparseSet* live_now, Instruction** copies, int* copy_count) {
+    for (u32 block_index = 0; block_index < cfg->block_count; ++block_index) {
+        BasicBlock* b = cfg->blocks + block_index;
 
-        #define REMAP(var) colors[get_lr(lrs, var)]
-        
-        static_assert(NUM_OPS == 16, "not all ops handled");
-        switch (ins->op)
-        {
-            default:
-                assert(false);
-                break;
+        sparse_set_clear(live_now);
+        foreach_bit(liveness->live_out + block_index, name) {
+            sparse_set_insert(live_now, liveness->global_registers[name.value]);
+        }
 
-            case OP_NOOP:
-            case OP_JMP:
-                break;
+        for (int i = b->end-1; i >= b->start; --i) {
+            Instruction* ins = bytecode->instructions + i;
 
-            case OP_IMM:
-            case OP_CJMP:
-            case OP_RET:
-                ins->a1 = REMAP(ins->a1);
-                break;
+            u32* uses[2];
+            u32* defined;
+            int use_count = get_operands(ins, uses, &defined);
 
-            case OP_COPY:
-            case OP_CAST:
-                ins->a1 = REMAP(ins->a1);
-                ins->a2 = REMAP(ins->a2);
-                break;
+            if (defined) {
+                sparse_set_remove(live_now, *defined);
 
-            case OP_ADD:
-            case OP_SUB:
-            case OP_MUL:
-            case OP_DIV:
-            case OP_LESS:
-            case OP_LEQUAL:
-            case OP_EQUAL:
-            case OP_NEQUAL:
-                ins->a1 = REMAP(ins->a1);
-                ins->a2 = REMAP(ins->a2);
-                ins->a3 = REMAP(ins->a3);
+                for (u32 live_index = 0; live_index < live_now->count; ++live_index) {
+                    u32 other = live_now->dense[live_index];
+                    if (ins->op != OP_COPY || other != ins->a2) {
+                        add_interference(graph, other, *defined);
+                    }
+                }
+            }
+
+            if (ins->op == OP_COPY) {
+                copies[(*copy_count)++] = ins;
+            }
+
+            for (int u = 0; u < use_count; ++u) {
+                sparse_set_insert(live_now, *uses[u]);
+            }
+        }
+    }
+}
+
+// One round of building the interference graph, coalescing, simplifying and selecting.
+// When every live range gets a color the bytecode is rewritten to use them. Otherwise
+// the ranges left without one get a stack slot in slots, or REMATERIALIZE with their
+// OP_IMM in immediates, the bytecode is rewritten to name each register by its live
+// range, and the number of spilled ranges is returned.
+internal u32 color_registers(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness, u32 register_count,
+                             SpillHeuristic heuristic, f64* block_weights, i64 spillable_count, i64* slots, Instruction* immediates,
+                             GraphColoringStats* stats) {
+    Scratch scratch = get_scratch(arena);
+
+    InterferenceGraph graph = new_interference_graph(scratch.arena, bytecode->register_count);
+
+    int copy_count = 0;
+    Instruction** copies = arena_push_array(scratch.arena, Instruction*, bytecode->length);
+
+    SparseSet live_now = new_sparse_set(scratch.arena, (u32)bytecode->register_count);
+
+    build_interference_graph(&graph, cfg, bytecode, liveness, &live_now, copies, &copy_count);
+
+    // Both ends of an edge list it.
+    u64 edge_ends = 0;
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        edge_ends += graph.adjacency[i].count;
+    }
+
+    ++stats->rounds;
+    stats->live_ranges += bytecode->register_count;
+    stats->interferences += edge_ends / 2;
+
+    i64* lrs = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        lrs[i] = i;
+    }
+
+    // Merging ranges only adds edges, so a copy whose ranges interfere is dropped for
+    // good, while one that fails the conservative test can pass after other merges.
+    u32* marks = arena_push_array(scratch.arena, u32, bytecode->register_count);
+    u32 mark = 0;
+
+    for (;;) {
+        bool any_coalesced = false;
+
+        for (int i = copy_count-1; i >= 0; --i)
+        {
+            Instruction* copy = copies[i];
+            assert(copy->op == OP_COPY);
+
+            i64 lr1 = get_lr(lrs, copy->a1);
+            i64 lr2 = get_lr(lrs, copy->a2);
+
+            if (lr1 != lr2) {
+                if (check_interference(&graph, lr1, lr2)) {
+                    copies[i] = copies[--copy_count];
+                    continue;
+                }
+
+                if (!can_coalesce(&graph, lr1, lr2, register_count, marks, ++mark)) {
+                    continue;
+                }
+
+                // The range with fewer edges is merged into the other.
+                if (graph.adjacency[lr1].count < graph.adjacency[lr2].count) {
+                    i64 swap = lr1;
+                    lr1 = lr2;
+                    lr2 = swap;
+                }
+
+                //printf("Coalesced %lld and %lld\n", lr1, lr2);
+                merge_live_ranges(&graph, lr1, lr2);
+                lrs[lr2] = lr1;
+                ++stats->coalesced;
+                any_coalesced = true;
+            }
+
+            copy->op = OP_NOOP;
+            copies[i] = copies[--copy_count];
+        }
+
+        if (!any_coalesced)
+            break;
+    }
+
+    SimplifyWorklists worklists = {
+        .k = register_count,
+        .degrees = arena_push_array(scratch.arena, u32, bytecode->register_count),
+        .removed = arena_push_array(scratch.arena, bool, bytecode->register_count),
+        .low = arena_push_array(scratch.arena, u32, bytecode->register_count),
+        .high = new_sparse_set(scratch.arena, (u32)bytecode->register_count),
+        .select_stack = arena_push_array(scratch.arena, i64, bytecode->register_count)
+    };
+
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        if (lrs[i] == i) {
+            worklists.degrees[i] = graph.adjacency[i].count;
+            if (worklists.degrees[i] < register_count) {
+                worklists.low[worklists.low_count++] = (u32)i;
+            }
+            else {
+                sparse_set_insert(&worklists.high, (u32)i);
+            }
+        }
+    }
+
+    i64* colors = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        colors[i] = -1;
+    }
+
+    bool* occupied_colors = arena_push_array(scratch.arena, bool, register_count);
+
+    SpillMetrics* metrics = 0;
+
+    for (;;) {
+        if (worklists.low_count > 0) {
+            remove_live_range(&worklists, &graph, worklists.low[--worklists.low_count]);
+            continue;
+        }
+
+        if (worklists.high.count == 0)
+            break;
+
+        // No range is trivially colorable. The cheapest one is pushed anyway and spilled
+        // only if its neighbors end up taking every color. Ranges made by spilling are
+        // already as short as they can be, so they are left for last.
+        if (!metrics) {
+            find_immediates(bytecode, lrs, immediates);
+
+            metrics = arena_push_array(scratch.arena, SpillMetrics, bytecode->register_count);
+            measure_spill_costs(cfg, bytecode, liveness, lrs, immediates, block_weights, &live_now, metrics);
+        }
+
+        i64 candidate = -1;
+        f64 candidate_metric = 0;
+
+        for (u32 i = 0; i < worklists.high.count; ++i) {
+            i64 lr = worklists.high.dense[i];
+            if (lr >= spillable_count && candidate != -1) {
+                continue;
+            }
+
+            f64 metric = spill_metric(heuristic, metrics + lr, worklists.degrees[lr]);
+            if (candidate == -1 || candidate >= spillable_count || (lr < spillable_count && metric < candidate_metric)) {
+                candidate = lr;
+                candidate_metric = metric;
+            }
+        }
+
+        sparse_set_remove(&worklists.high, (u32)candidate);
+        remove_live_range(&worklists, &graph, candidate);
+    }
+
+    u32 spill_count = 0;
+
+    // Neighbors removed after a range are selected before it, so those are the ones with
+    // colors by now.
+    while (worklists.select_count > 0) {
+        i64 lr = worklists.select_stack[--worklists.select_count];
+
+        memset(occupied_colors, 0, register_count * sizeof(*occupied_colors));
+
+        AdjacencyList* list = graph.adjacency + lr;
+        for (u32 i = 0; i < list->count; ++i) {
+            i64 neighbor_color = colors[list->neighbors[i]];
+            if (neighbor_color != -1) {
+                occupied_colors[neighbor_color] = true;
+            }
+        }
+
+        for (u32 i = 0; i < register_count; ++i) {
+            if (!occupied_colors[i]) {
+                colors[lr] = i;
                 break;
+            }
+        }
+
+        if (colors[lr] == -1) {
+            assert(lr < spillable_count);
+            spill_register(bytecode, immediates, slots, lr);
+            ++spill_count;
+        }
+    }
+
+    /*
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        printf("%lld -> %lld\n", i, colors[get_lr(lrs, i)]);
+    }
+    */
+
+    i64* mapping = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        mapping[i] = spill_count ? get_lr(lrs, i) : colors[get_lr(lrs, i)];
+    }
+
+    remap_registers(bytecode, mapping);
+
+    release_scratch(&scratch);
+    return spill_count;
+}
+
+internal Instruction load_spilled_register(u32 reg, u32 into, i64* slots, Instruction* immediates) {
+    if (slots[reg] == REMATERIALIZE) {
+        Instruction load = immediates[reg];
+        load.a1 = into;
+        return load;
+    }
+
+    return (Instruction){ .op = OP_RELOAD, .a1 = into, .a2 = (u32)slots[reg] };
+}
+
+// Writes an instruction with its references to spilled registers replaced to expanded
+// and returns the number of instructions written, at most four. Each spilled use is
+// loaded into a new register just before the instruction and a spilled definition is
+// stored from one just after, so the new ranges are a single instruction long. A copy
+// to or from a spilled register becomes the store or load itself. The definitions of
+// a rematerialized register become OP_NOOP.
+internal int expand_spilled_references(Instruction ins, i64* slots, Instruction* immediates, i64* register_count, Instruction* expanded) {
+    int count = 0;
+
+    // A rematerialized register is only copied from one holding the same constant.
+    if (ins.op == OP_COPY && slots[ins.a1] == REMATERIALIZE) {
+        expanded[count++] = (Instruction){ .op = OP_NOOP };
+        return count;
+    }
+
+    if (ins.op == OP_COPY && (slots[ins.a1] != -1 || slots[ins.a2] != -1)) {
+        u32 source = ins.a2;
+
+        if (slots[ins.a2] != -1) {
+            source = slots[ins.a1] != -1 ? (u32)(*register_count)++ : ins.a1;
+            expanded[count++] = load_spilled_register(ins.a2, source, slots, immediates);
+        }
+
+        if (slots[ins.a1] != -1) {
+            expanded[count++] = (Instruction){ .op = OP_SPILL, .a1 = (u32)slots[ins.a1], .a2 = source };
+        }
+
+        return count;
+    }
+
+    u32* uses[2];
+    u32* defined;
+    int use_count = get_operands(&ins, uses, &defined);
+
+    if (defined && slots[*defined] == REMATERIALIZE) {
+        assert(ins.op == OP_IMM);
+        expanded[count++] = (Instruction){ .op = OP_NOOP };
+        return count;
+    }
+
+    u32 originals[2] = {0};
+    for (int u = 0; u < use_count; ++u) {
+        originals[u] = *uses[u];
+    }
+
+    for (int u = 0; u < use_count; ++u) {
+        // Both operands can name the same spilled register, it is loaded once.
+        if (slots[originals[u]] == -1 || (u > 0 && originals[u] == originals[0])) {
+            continue;
+        }
+
+        u32 loaded = (u32)(*register_count)++;
+        expanded[count++] = load_spilled_register(originals[u], loaded, slots, immediates);
+
+        for (int v = u; v < use_count; ++v) {
+            if (originals[v] == originals[u]) {
+                *uses[v] = loaded;
+            }
+        }
+    }
+
+    i64 stored_slot = defined ? slots[*defined] : -1;
+    if (stored_slot != -1) {
+        *defined = (u32)(*register_count)++;
+    }
+
+    expanded[count++] = ins;
+
+    if (stored_slot != -1) {
+        expanded[count++] = (Instruction){ .op = OP_SPILL, .a1 = (u32)stored_slot, .a2 = *defined };
+    }
+
+    return count;
+}
+
+void reserve_instructions(Arena* arena, Bytecode* bytecode, int length) {
+    if (length > bytecode->capacity) {
+        int capacity = bytecode->capacity ? bytecode->capacity : 256;
+        while (capacity < length) {
+            capacity *= 2;
         }
 
-        #undef REMAP
+        bytecode->instructions = arena_grow_array(arena, bytecode->instructions, bytecode->length, capacity);
+        bytecode->labels = arena_grow_array(arena, bytecode->labels, bytecode->length, capacity);
+        bytecode->lines = arena_grow_array(arena, bytecode->lines, bytecode->length, capacity);
+        bytecode->capacity = capacity;
+    }
+}
+
+// Instructions only ever move back, so the code is compacted in place. A label on a NOOP
+// moves to the next instruction kept, and when that one has a label of its own, jumps to
+// the moved label are retargeted to it.
+void remove_noops(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode) {
+    Scratch scratch = get_scratch(arena);
+
+    int* locations = arena_push_array(scratch.arena, int, bytecode->length + 1);
+    int* aliases = arena_push_array(scratch.arena, int, bytecode->label_count);
+    for (int i = 0; i < bytecode->label_count; ++i) {
+        aliases[i] = i;
+    }
+
+    int out = 0;
+    int pending_label = -1;
+
+    for (int i = 0; i < bytecode->length; ++i) {
+        locations[i] = out;
+        int label = bytecode->labels[i];
+
+        if (bytecode->instructions[i].op == OP_NOOP) {
+            if (label != -1) {
+                if (pending_label == -1) {
+                    pending_label = label;
+                }
+                else {
+                    aliases[label] = pending_label;
+                }
+            }
+            continue;
+        }
+
+        if (pending_label != -1) {
+            if (label == -1) {
+                label = pending_label;
+            }
+            else {
+                aliases[pending_label] = label;
+            }
+            pending_label = -1;
+        }
+
+        bytecode->instructions[out] = bytecode->instructions[i];
+        bytecode->labels[out] = label;
+        bytecode->lines[out] = bytecode->lines[i];
+        ++out;
+    }
+
+    locations[bytecode->length] = out;
+    if (pending_label != -1) {
+        aliases[pending_label] = bytecode->label_count - 1;
+    }
+
+    // The later labels of a run of NOOPs alias its first, which in turn may alias the
+    // label that stays, so a chain is at most two long.
+    for (int i = 0; i < bytecode->label_count; ++i) {
+        aliases[i] = aliases[aliases[i]];
+    }
+
+    for (int i = 0; i < out; ++i) {
+        Instruction* ins = bytecode->instructions + i;
+        if (ins->op == OP_JMP) {
+            ins->a1 = aliases[ins->a1];
+        }
+        else if (ins->op == OP_CJMP) {
+            ins->a2 = aliases[ins->a2];
+            ins->a3 = aliases[ins->a3];
+        }
+    }
+
+    for (int i = 0; i < bytecode->label_count; ++i) {
+        bytecode->label_locations[i] = locations[bytecode->label_locations[i]];
+    }
+
+    bytecode->length = out;
+    release_scratch(&scratch);
+
+    // Blocks can end up empty, which the graph does not expect of any but the entry.
+    // Reachability does not change, so analyzing control flow again reports nothing.
+    ControlFlowGraph* rebuilt = analyze_control_flow(arena, 0, bytecode);
+    assert(rebuilt);
+    *cfg = *rebuilt;
+}
+
+// Whether an instruction does nothing but write its result. The VM faults on division by
+// zero, so division only qualifies when every definition of its divisor is a constant
+// other than zero.
+internal bool is_pure(Bytecode* bytecode, Instruction* ins, Instruction* immediates) {
+    static_assert(NUM_OPS == 18, "not all ops handled");
+    switch (ins->op) {
+        default:
+            return false;
+
+        case OP_IMM:
+        case OP_COPY:
+        case OP_CAST:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_LESS:
+        case OP_LEQUAL:
+        case OP_EQUAL:
+        case OP_NEQUAL:
+            return true;
+
+        case OP_DIV: {
+            Instruction* divisor = immediates + ins->a3;
+            if (divisor->op != OP_IMM)
+                return false;
+
+            return bytecode->constants[divisor->a2] != 0;
+        }
+    }
+}
+
+// Liveness of registers that are not faint: a register is live only when an instruction
+// with an effect reads it, or a pure one whose result is live. Unlike plain liveness,
+// this sees through a chain of dead code spanning blocks in one solve.
+typedef struct {
+    Bytecode* bytecode;
+    ControlFlowGraph* cfg;
+    Liveness* liveness;
+    i64* names;
+    Instruction* immediates;
+    SparseSet live_now;
+    Bitset live_in;
+} FaintSets;
+
+// Walks a block back from live_out, leaving in live_now the registers live at its start.
+// Pure instructions whose result is not live are dropped when asked, and counted.
+internal u32 walk_faint_block(FaintSets* sets, u32 block, Bitset* live_out, bool drop) {
+    Bytecode* bytecode = sets->bytecode;
+    SparseSet* live_now = &sets->live_now;
+
+    sparse_set_clear(live_now);
+    foreach_bit(live_out, name) {
+        sparse_set_insert(live_now, sets->liveness->global_registers[name.value]);
+    }
+
+    u32 dead_count = 0;
+
+    for (int i = sets->cfg->blocks[block].end-1; i >= sets->cfg->blocks[block].start; --i) {
+        Instruction* ins = bytecode->instructions + i;
+
+        u32* uses[2];
+        u32* defined;
+        int use_count = get_operands(ins, uses, &defined);
+
+        if (defined && !sparse_set_has(live_now, *defined) && is_pure(bytecode, ins, sets->immediates)) {
+            if (drop) {
+                *ins = (Instruction){ .op = OP_NOOP };
+            }
+            ++dead_count;
+            continue;
+        }
+
+        if (defined) {
+            sparse_set_remove(live_now, *defined);
+        }
+
+        for (int u = 0; u < use_count; ++u) {
+            sparse_set_insert(live_now, *uses[u]);
+        }
+    }
+
+    return dead_count;
+}
+
+// Faint variables only ever become live as the solver goes, so the block's live_in is
+// merged in rather than replaced.
+internal bool faint_transfer(void* context, u32 block, Bitset* live_out, Bitset* live_in) {
+    FaintSets* sets = context;
+    walk_faint_block(sets, block, live_out, false);
+
+    bitset_clear(&sets->live_in);
+    for (u32 i = 0; i < sets->live_now.count; ++i) {
+        i64 name = sets->names[sets->live_now.dense[i]];
+        if (name != -1) {
+            bitset_insert(&sets->live_in, name);
+        }
+    }
+
+    return bitset_union(live_in, &sets->live_in);
+}
+
+// Faint registers are a subset of live ones, so they fit in the global names liveness
+// already gave out, and once dead code is gone they are exactly the live ones.
+u32 eliminate_dead_code(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness) {
+    Scratch scratch = get_scratch(arena);
+    i64 register_count = bytecode->register_count;
+
+    FaintSets sets = {
+        .bytecode = bytecode,
+        .cfg = cfg,
+        .liveness = liveness,
+        .names = arena_push_array(scratch.arena, i64, register_count),
+        .immediates = arena_push_array(scratch.arena, Instruction, register_count),
+        .live_now = new_sparse_set(scratch.arena, (u32)register_count),
+        .live_in = new_bitset(scratch.arena, liveness->global_count)
+    };
+
+    for (i64 i = 0; i < register_count; ++i) {
+        sets.names[i] = -1;
+    }
+    for (u32 name = 0; name < liveness->global_count; ++name) {
+        sets.names[liveness->global_registers[name]] = name;
+    }
+
+    find_immediates(bytecode, 0, sets.immediates);
+
+    DataFlowProblem problem = {
+        .direction = DATA_FLOW_BACKWARD,
+        .bit_count = liveness->global_count,
+        .meet = bitset_union,
+        .transfer = faint_transfer,
+        .context = &sets
+    };
+
+    DataFlowSolution solution = solve_data_flow(scratch.arena, cfg, &problem);
+
+    u32 removed = 0;
+    for (u32 b = 0; b < cfg->block_count; ++b) {
+        removed += walk_faint_block(&sets, b, solution.inputs + b, true);
+    }
+
+    if (removed) {
+        for (u32 b = 0; b < cfg->block_count; ++b) {
+            bitset_copy(liveness->live_in + b, solution.outputs + b);
+            bitset_copy(liveness->live_out + b, solution.inputs + b);
+        }
+    }
+
+    release_scratch(&scratch);
+
+    return removed;
+}
+
+// Instructions only ever move forward, so the code is expanded in place from the back.
+// Labels move to the first instruction written for the one they were on, which keeps
+// the loads for an instruction inside its block.
+internal void insert_spill_code(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, i64* slots, Instruction* immediates) {
+    Scratch scratch = get_scratch(arena);
+
+    Instruction expanded[4];
+
+    int* locations = arena_push_array(scratch.arena, int, bytecode->length + 1);
+    int length = 0;
+    for (int i = 0; i < bytecode->length; ++i) {
+        i64 unused_register_count = bytecode->register_count;
+        locations[i] = length;
+        length += expand_spilled_references(bytecode->instructions[i], slots, immediates, &unused_register_count, expanded);
+    }
+    locations[bytecode->length] = length;
+
+    reserve_instructions(arena, bytecode, length);
+
+    for (int i = bytecode->length; i-- > 0;) {
+        int label = bytecode->labels[i];
+        int line = bytecode->lines[i];
+        int count = expand_spilled_references(bytecode->instructions[i], slots, immediates, &bytecode->register_count, expanded);
+
+        for (int j = 0; j < count; ++j) {
+            int location = locations[i] + j;
+            bytecode->instructions[location] = expanded[j];
+            bytecode->labels[location] = j == 0 ? label : -1;
+            bytecode->lines[location] = line;
+        }
+    }
+
+    for (int i = 0; i < bytecode->label_count; ++i) {
+        bytecode->label_locations[i] = locations[bytecode->label_locations[i]];
+    }
+
+    for (u32 b = 0; b < cfg->block_count; ++b) {
+        cfg->blocks[b].start = locations[cfg->blocks[b].start];
+        cfg->blocks[b].end = locations[cfg->blocks[b].end];
+    }
+
+    bytecode->length = length;
+    release_scratch(&scratch);
+}
+
+// A block of copies inserted before a block when splitting live ranges around a loop.
+typedef struct {
+    int label;       // Index among the new labels, -1 when there is no pad.
+    u32 loop;        // Header of the loop the pad belongs to.
+    u32 copy_start;
+    u32 copy_count;
+} LoopPad;
+
+// A block can get both kinds of pad, the exit pad of one loop falling into the
+// preheader of the next.
+typedef struct {
+    LoopPad exit;      // Entered from the loop that exits to the block.
+    LoopPad preheader; // Entered from outside the loop the block heads.
+} BlockPads;
+
+// The block whose last instruction can fall into block b, or -1.
+internal int find_fall_through(ControlFlowGraph* cfg, Bytecode* bytecode, int* block_of, u32 b) {
+    int start = cfg->blocks[b].start;
+    if (start == 0)
+        return -1;
+
+    u8 op = bytecode->instructions[start - 1].op;
+    return op == OP_JMP || op == OP_CJMP || op == OP_RET ? -1 : block_of[start - 1];
+}
+
+internal int retarget_jump(BlockPads* pads, u32 target, u32 loop, int label, int first_new_label) {
+    if (pads[target].exit.label != -1 && loop == pads[target].exit.loop) {
+        return first_new_label + pads[target].exit.label;
+    }
+
+    if (pads[target].preheader.label != -1 && loop != target) {
+        return first_new_label + pads[target].preheader.label;
+    }
+
+    return label;
+}
+
+// Splits live ranges at the boundaries of innermost loops where more values are live at
+// once than there are registers, so that the part of a range inside the loop and the
+// parts outside it can be colored or spilled apart. A value the loop refers to gets a
+// new register inside it, copied from the old one in a preheader and back before each
+// exit it is live after. Coalescing merges the copies again where that is safe. Values
+// are only split when their references in the loop cost more than the copies would as
+// spill code.
+//
+// Returns whether anything was split, in which case cfg is rebuilt for the new blocks.
+internal bool split_live_ranges_around_loops(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness, f64* block_weights,
+                                             u32 register_count, GraphColoringStats* stats) {
+    Scratch scratch = get_scratch(arena);
+
+    u32 block_count = cfg->block_count;
+    i64 original_register_count = bytecode->register_count;
+
+    bool* is_header = arena_push_array(scratch.arena, bool, block_count);
+    for (u32 b = 0; b < block_count; ++b) {
+        for (u32 e = cfg->predecessor_offsets[b]; e < cfg->predecessor_offsets[b + 1]; ++e) {
+            is_header[b] |= cfg->predecessors[e] >= b;
+        }
+    }
+
+    int* block_of = arena_push_array(scratch.arena, int, bytecode->length);
+    for (int i = 0; i < bytecode->length; ++i) {
+        block_of[i] = -1;
+    }
+
+    for (u32 b = 0; b < block_count; ++b) {
+        for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; ++i) {
+            block_of[i] = (int)b;
+        }
+    }
+
+    Instruction* immediates = arena_push_array(scratch.arena, Instruction, original_register_count);
+    find_immediates(bytecode, 0, immediates);
+
+    // Loop-weighted references to each register inside the loop being split.
+    f64* inside_costs = arena_push_array(scratch.arena, f64, original_register_count);
+
+    i64* renames = arena_push_array(scratch.arena, i64, original_register_count);
+    for (i64 i = 0; i < original_register_count; ++i) {
+        renames[i] = -1;
+    }
+
+    // Global names of the values split, which are all live across a block boundary.
+    u32* names = arena_push_array(scratch.arena, u32, original_register_count);
+    for (u32 g = 0; g < liveness->global_count; ++g) {
+        names[liveness->global_registers[g]] = g;
+    }
+
+    // Each block is in at most one split loop, as only innermost loops are split.
+    u32* loops = arena_push_array(scratch.arena, u32, block_count);
+    for (u32 b = 0; b < block_count; ++b) {
+        loops[b] = UINT32_MAX;
+    }
+
+    BlockPads* pads = arena_push_array(scratch.arena, BlockPads, block_count);
+    for (u32 b = 0; b < block_count; ++b) {
+        pads[b].exit.label = -1;
+        pads[b].preheader.label = -1;
+    }
+
+    u32* marks = arena_push_array(scratch.arena, u32, block_count);
+    u32* exit_marks = arena_push_array(scratch.arena, u32, block_count);
+    u32* body = arena_push_array(scratch.arena, u32, block_count);
+    u32* exits = arena_push_array(scratch.arena, u32, block_count);
+    u32* split = arena_push_array(scratch.arena, u32, liveness->global_count);
+
+    SparseSet live_now = new_sparse_set(scratch.arena, (u32)original_register_count);
+
+    u32 copy_count = 0;
+    u32 copy_capacity = 0;
+    Instruction* copies = 0;
+
+    int pad_count = 0;
+
+    for (u32 header = 0; header < block_count; ++header) {
+        if (!is_header[header])
+            continue;
+
+        u32 mark = header + 1;
+        u32 body_count = find_loop_body(cfg, header, marks, mark, body);
+
+        bool splittable = cfg->blocks[header].start < cfg->blocks[header].end;
+        for (u32 i = 1; i < body_count; ++i) {
+            splittable &= !is_header[body[i]];
+        }
+
+        if (!splittable)
+            continue;
+
+        u32 pressure = 0;
+
+        for (u32 i = 0; i < body_count; ++i) {
+            BasicBlock* b = cfg->blocks + body[i];
+
+            sparse_set_clear(&live_now);
+            foreach_bit(liveness->live_out + body[i], name) {
+                sparse_set_insert(&live_now, liveness->global_registers[name.value]);
+            }
+
+            for (int j = b->end-1; j >= b->start; --j) {
+                pressure = live_now.count > pressure ? live_now.count : pressure;
+
+                u32* uses[2];
+                u32* defined;
+                int use_count = get_operands(bytecode->instructions + j, uses, &defined);
+
+                if (defined) {
+                    sparse_set_remove(&live_now, *defined);
+                }
+
+                for (int u = 0; u < use_count; ++u) {
+                    sparse_set_insert(&live_now, *uses[u]);
+                    inside_costs[*uses[u]] += block_weights[body[i]];
+                }
+
+                if (defined) {
+                    inside_costs[*defined] += block_weights[body[i]];
+                }
+            }
+
+            pressure = live_now.count > pressure ? live_now.count : pressure;
+        }
+
+        // Values the loop never refers to are live all through it. Splitting helps when
+        // they are what crowds the loop, as its own values then fit in registers once the
+        // others are spilled around it. Constants coming in, such as loop invariants
+        // moved out, crowd it no more, since spilling them only loads them again.
+        u32 through_count = 0;
+        foreach_bit(liveness->live_in + header, name) {
+            u32 reg = liveness->global_registers[name.value];
+            through_count += inside_costs[reg] == 0 || immediates[reg].op == OP_IMM;
+        }
+
+        // The new blocks go right before the header and the exits, so nothing can fall
+        // into the preheader from inside the loop or into an exit pad from outside it.
+        int entry = find_fall_through(cfg, bytecode, block_of, header);
+        splittable = pressure > register_count && pressure - through_count <= register_count;
+        splittable &= entry == -1 || marks[entry] != mark;
+
+        u32 exit_count = 0;
+        for (u32 i = 0; i < body_count; ++i) {
+            for (u32 e = cfg->successor_offsets[body[i]]; e < cfg->successor_offsets[body[i] + 1]; ++e) {
+                u32 exit = cfg->successors[e];
+                if (marks[exit] == mark || exit_marks[exit] == mark)
+                    continue;
+
+                exit_marks[exit] = mark;
+                exits[exit_count++] = exit;
+
+                int fall_through = find_fall_through(cfg, bytecode, block_of, exit);
+                splittable &= cfg->blocks[exit].start < cfg->blocks[exit].end && pads[exit].exit.label == -1;
+                splittable &= fall_through == -1 || marks[fall_through] == mark;
+            }
+        }
+
+        u32 split_count = 0;
+
+        // Each preheader runs once per entry, like the code outside the loop.
+        foreach_bit(liveness->live_in + header, name) {
+            u32 reg = liveness->global_registers[name.value];
+
+            f64 boundary_cost = block_weights[header] / LOOP_WEIGHT;
+            for (u32 e = 0; e < exit_count; ++e) {
+                if (bitset_has(liveness->live_in + exits[e], name.value)) {
+                    boundary_cost += block_weights[exits[e]];
+                }
+            }
+
+            if (splittable && inside_costs[reg] > boundary_cost && immediates[reg].op != OP_IMM) {
+                split[split_count++] = reg;
+            }
+        }
+
+        for (u32 i = 0; i < body_count; ++i) {
+            for (int j = cfg->blocks[body[i]].start; j < cfg->blocks[body[i]].end; ++j) {
+                u32* uses[2];
+                u32* defined;
+                int use_count = get_operands(bytecode->instructions + j, uses, &defined);
+
+                for (int u = 0; u < use_count; ++u) {
+                    inside_costs[*uses[u]] = 0;
+                }
+
+                if (defined) {
+                    inside_costs[*defined] = 0;
+                }
+            }
+        }
+
+        if (!split_count)
+            continue;
+
+        // The preheader and every exit pad could copy each split value.
+        if (copy_count + (exit_count + 1) * split_count > copy_capacity) {
+            u32 capacity = copy_capacity ? copy_capacity : 64;
+            while (capacity < copy_count + (exit_count + 1) * split_count) {
+                capacity *= 2;
+            }
+
+            copies = arena_grow_array(scratch.arena, copies, copy_count, capacity);
+            copy_capacity = capacity;
+        }
+
+        pads[header].preheader = (LoopPad){ .label = pad_count++, .loop = header, .copy_start = copy_count };
+
+        for (u32 s = 0; s < split_count; ++s) {
+            renames[split[s]] = bytecode->register_count++;
+            copies[copy_count++] = (Instruction){ .op = OP_COPY, .a1 = (u32)renames[split[s]], .a2 = split[s] };
+        }
+
+        pads[header].preheader.copy_count = copy_count - pads[header].preheader.copy_start;
+
+        for (u32 e = 0; e < exit_count; ++e) {
+            LoopPad pad = { .label = -1, .loop = header, .copy_start = copy_count };
+
+            for (u32 s = 0; s < split_count; ++s) {
+                if (bitset_has(liveness->live_in + exits[e], names[split[s]])) {
+                    copies[copy_count++] = (Instruction){ .op = OP_COPY, .a1 = split[s], .a2 = (u32)renames[split[s]] };
+                }
+            }
+
+            pad.copy_count = copy_count - pad.copy_start;
+            if (pad.copy_count) {
+                pad.label = pad_count++;
+                pads[exits[e]].exit = pad;
+            }
+        }
+
+        for (u32 i = 0; i < body_count; ++i) {
+            loops[body[i]] = header;
+
+            for (int j = cfg->blocks[body[i]].start; j < cfg->blocks[body[i]].end; ++j) {
+                u32* uses[2];
+                u32* defined;
+                int use_count = get_operands(bytecode->instructions + j, uses, &defined);
+
+                for (int u = 0; u < use_count; ++u) {
+                    if (*uses[u] < original_register_count && renames[*uses[u]] != -1) {
+                        *uses[u] = (u32)renames[*uses[u]];
+                    }
+                }
+
+                if (defined && *defined < original_register_count && renames[*defined] != -1) {
+                    *defined = (u32)renames[*defined];
+                }
+            }
+        }
+
+        for (u32 s = 0; s < split_count; ++s) {
+            renames[split[s]] = -1;
+        }
+
+        stats->split += split_count;
+    }
+
+    if (!pad_count) {
+        release_scratch(&scratch);
+        return false;
+    }
+
+    // The new labels go before the end label, which stays last.
+    int end_label = bytecode->label_count - 1;
+    int new_end_label = end_label + pad_count;
+
+    for (int i = 0; i < bytecode->length; ++i) {
+        Instruction* ins = bytecode->instructions + i;
+
+        if (ins->op == OP_JMP) {
+            ins->a1 = ins->a1 == (u32)end_label ? (u32)new_end_label : ins->a1;
+        }
+        else if (ins->op == OP_CJMP) {
+            ins->a2 = ins->a2 == (u32)end_label ? (u32)new_end_label : ins->a2;
+            ins->a3 = ins->a3 == (u32)end_label ? (u32)new_end_label : ins->a3;
+        }
+    }
+
+    // A jump from inside a loop to the block it exits to lands on the exit pad, and one
+    // from outside a loop to its header on the preheader.
+    for (u32 b = 0; b < block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+        if (block->start == block->end)
+            continue;
+
+        Instruction* ins = bytecode->instructions + block->end - 1;
+
+        if (ins->op == OP_JMP && (int)ins->a1 != new_end_label) {
+            u32 target = block_of[bytecode->label_locations[ins->a1]];
+            ins->a1 = retarget_jump(pads, target, loops[b], ins->a1, end_label);
+        }
+        else if (ins->op == OP_CJMP) {
+            if ((int)ins->a2 != new_end_label) {
+                ins->a2 = retarget_jump(pads, block_of[bytecode->label_locations[ins->a2]], loops[b], ins->a2, end_label);
+            }
+            if ((int)ins->a3 != new_end_label) {
+                ins->a3 = retarget_jump(pads, block_of[bytecode->label_locations[ins->a3]], loops[b], ins->a3, end_label);
+            }
+        }
+    }
+
+    int length = bytecode->length;
+    Instruction* instructions = arena_push_array(scratch.arena, Instruction, length);
+    int* labels = arena_push_array(scratch.arena, int, length);
+    int* lines = arena_push_array(scratch.arena, int, length);
+    memcpy(instructions, bytecode->instructions, length * sizeof(*instructions));
+    memcpy(labels, bytecode->labels, length * sizeof(*labels));
+    memcpy(lines, bytecode->lines, length * sizeof(*lines));
+
+    reserve_instructions(arena, bytecode, length + (int)copy_count);
+
+    bytecode->label_locations = arena_grow_array(arena, bytecode->label_locations, bytecode->label_count, new_end_label + 1);
+    bytecode->label_count = new_end_label + 1;
+
+    int out = 0;
+    for (int i = 0; i < length; ++i) {
+        int b = block_of[i];
+        if (b != -1 && cfg->blocks[b].start == i) {
+            LoopPad* block_pads[] = { &pads[b].exit, &pads[b].preheader };
+
+            for (int p = 0; p < LENGTH(block_pads); ++p) {
+                LoopPad* pad = block_pads[p];
+                if (pad->label == -1)
+                    continue;
+
+                bytecode->label_locations[end_label + pad->label] = out;
+
+                for (u32 c = 0; c < pad->copy_count; ++c) {
+                    bytecode->instructions[out] = copies[pad->copy_start + c];
+                    bytecode->labels[out] = c == 0 ? end_label + pad->label : -1;
+                    bytecode->lines[out] = lines[i];
+                    ++out;
+                }
+            }
+        }
+
+        if (labels[i] != -1) {
+            bytecode->label_locations[labels[i]] = out;
+        }
+
+        bytecode->instructions[out] = instructions[i];
+        bytecode->labels[out] = labels[i];
+        bytecode->lines[out] = lines[i];
+        ++out;
+    }
+
+    bytecode->length = out;
+    bytecode->label_locations[new_end_label] = out;
+
+    release_scratch(&scratch);
+
+    // The pads are reachable and fall into blocks that were, so analyzing control flow
+    // again reports nothing and needs no source.
+    ControlFlowGraph* rebuilt = analyze_control_flow(arena, 0, bytecode);
+    assert(rebuilt);
+    *cfg = *rebuilt;
+
+    return true;
+}
+
+// Chaitin-Briggs: build, coalesce, simplify and select until every live range has one
+// of register_count colors, spilling the ranges that don't and starting over with the
+// liveness of the rewritten code.
+void allocate_registers(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness, u32 register_count, SpillHeuristic heuristic, GraphColoringStats* stats) {
+    // An instruction can load both of its operands from the stack.
+    assert(register_count >= 2);
+
+    Scratch scratch = get_scratch(arena);
+
+    GraphColoringStats unused_stats;
+    if (!stats) {
+        stats = &unused_stats;
+    }
+    *stats = (GraphColoringStats){0};
+
+    f64* block_weights = weigh_blocks(scratch.arena, cfg);
+    if (split_live_ranges_around_loops(arena, cfg, bytecode, liveness, block_weights, register_count, stats)) {
+        liveness = analyze_liveness(arena, cfg, bytecode);
+        block_weights = weigh_blocks(scratch.arena, cfg);
+    }
+
+    // Registers above this were made by spilling.
+    i64 spillable_count = bytecode->register_count;
+
+    for (;;) {
+        Scratch round = get_scratch(arena);
+
+        i64* slots = arena_push_array(round.arena, i64, bytecode->register_count);
+        for (i64 i = 0; i < bytecode->register_count; ++i) {
+            slots[i] = -1;
+        }
+
+        Instruction* immediates = arena_push_array(round.arena, Instruction, bytecode->register_count);
+
+        u32 spill_count = color_registers(arena, cfg, bytecode, liveness, register_count, heuristic, block_weights, spillable_count,
+                                          slots, immediates, stats);
+        if (spill_count) {
+            insert_spill_code(arena, cfg, bytecode, slots, immediates);
+        }
+
+        release_scratch(&round);
+
+        if (!spill_count)
+            break;
+
+        liveness = analyze_liveness(arena, cfg, bytecode);
+    }
+
+    bytecode->register_count = register_count;
+    release_scratch(&scratch);
+}
+
+// Linear scan in the manner of Poletto and Sarkar. Instruction i reads its operands at
+// position 2i and writes its result at 2i + 1, so a register last read by an instruction
+// can be reused for the one it defines. Each register gets a single interval from its
+// first to its last live position, holes included, which is coarser than the graph but
+// needs only one pass over the code.
+typedef struct {
+    u32* starts;
+    u32* ends;
+    u32* order; // Registers with an interval, by start.
+    u32 count;
+} LiveIntervals;
+
+internal LiveIntervals build_live_intervals(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness) {
+    LiveIntervals intervals = {
+        .starts = arena_push_array(arena, u32, bytecode->register_count),
+        .ends = arena_push_array(arena, u32, bytecode->register_count),
+    };
+
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        intervals.starts[i] = UINT32_MAX;
+    }
+
+    #define EXTEND(reg, position) \
+        intervals.starts[reg] = (position) < intervals.starts[reg] ? (position) : intervals.starts[reg]; \
+        intervals.ends[reg] = (position) > intervals.ends[reg] ? (position) : intervals.ends[reg]
+
+    for (u32 b = 0; b < cfg->block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+
+        foreach_bit(liveness->live_in + b, name) {
+            EXTEND(liveness->global_registers[name.value], 2 * (u32)block->start);
+        }
+
+        foreach_bit(liveness->live_out + b, name) {
+            EXTEND(liveness->global_registers[name.value], 2 * (u32)block->end - 1);
+        }
+
+        for (int i = block->start; i < block->end; ++i) {
+            u32* uses[2];
+            u32* defined;
+            int use_count = get_operands(bytecode->instructions + i, uses, &defined);
+
+            for (int u = 0; u < use_count; ++u) {
+                EXTEND(*uses[u], 2 * (u32)i);
+            }
+
+            if (defined) {
+                EXTEND(*defined, 2 * (u32)i + 1);
+            }
+        }
+    }
+
+    #undef EXTEND
+
+    // Counting sort by start.
+    u32 position_count = 2 * (u32)bytecode->length + 1;
+    u32* offsets = arena_push_array(arena, u32, position_count + 1);
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        if (intervals.starts[i] != UINT32_MAX) {
+            ++offsets[intervals.starts[i] + 1];
+            ++intervals.count;
+        }
+    }
+
+    for (u32 p = 0; p < position_count; ++p) {
+        offsets[p + 1] += offsets[p];
+    }
+
+    intervals.order = arena_push_array(arena, u32, intervals.count);
+    for (i64 i = 0; i < bytecode->register_count; ++i) {
+        if (intervals.starts[i] != UINT32_MAX) {
+            intervals.order[offsets[intervals.starts[i]]++] = (u32)i;
+        }
+    }
+
+    return intervals;
+}
+
+// Assigns each interval one of the first allocatable registers, or a stack slot when
+// more intervals overlap than there are registers. The interval that ends last is the
+// one spilled, or rematerialized if it holds a constant. Returns the number of
+// intervals spilled.
+internal u32 scan_live_intervals(Arena* arena, Bytecode* bytecode, LiveIntervals* intervals, u32 allocatable, Instruction* immediates,
+                                 i64* assignments, i64* slots) {
+    Scratch scratch = get_scratch(arena);
+
+    // Live intervals holding a register, by end.
+    u32* active = arena_push_array(scratch.arena, u32, allocatable + 1);
+    u32 active_count = 0;
+
+    bool* free_registers = arena_push_array(scratch.arena, bool, allocatable + 1);
+    for (u32 r = 0; r < allocatable; ++r) {
+        free_registers[r] = true;
+    }
+
+    u32 spill_count = 0;
+
+    for (u32 k = 0; k < intervals->count; ++k) {
+        u32 reg = intervals->order[k];
+        u32 start = intervals->starts[reg];
+        u32 end = intervals->ends[reg];
+
+        u32 expired = 0;
+        while (expired < active_count && intervals->ends[active[expired]] < start) {
+            free_registers[assignments[active[expired]]] = true;
+            ++expired;
+        }
+
+        active_count -= expired;
+        memmove(active, active + expired, active_count * sizeof(*active));
+
+        // A copy that ends its source's interval can take over the source's register
+        // and disappear.
+        i64 assignment = -1;
+        if (start % 2 == 1) {
+            Instruction* ins = bytecode->instructions + start / 2;
+            if (ins->op == OP_COPY && ins->a1 == reg && assignments[ins->a2] != -1 && free_registers[assignments[ins->a2]]) {
+                assignment = assignments[ins->a2];
+            }
+        }
+
+        for (u32 r = 0; assignment == -1 && r < allocatable; ++r) {
+            if (free_registers[r]) {
+                assignment = r;
+            }
+        }
+
+        if (assignment == -1) {
+            ++spill_count;
+
+            u32 last = active_count ? active[active_count - 1] : 0;
+            if (!active_count || intervals->ends[last] <= end) {
+                spill_register(bytecode, immediates, slots, reg);
+                continue;
+            }
+
+            assignment = assignments[last];
+            assignments[last] = -1;
+            spill_register(bytecode, immediates, slots, last);
+            --active_count;
+        }
+
+        assignments[reg] = assignment;
+        free_registers[assignment] = false;
+
+        u32 position = active_count++;
+        while (position > 0 && intervals->ends[active[position - 1]] > end) {
+            active[position] = active[position - 1];
+            --position;
+        }
+        active[position] = reg;
+    }
+
+    release_scratch(&scratch);
+    return spill_count;
+}
+
+// The fast allocator. It keeps every copy that is not the last use of its source and
+// spills without regard for loops, in exchange for a single linear pass. When anything
+// is spilled the scan is redone with the last two registers held back for the values
+// spill code loads and stores, which never live past the instruction they belong to.
+void allocate_registers_linear_scan(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness, u32 register_count) {
+    // An instruction can load both of its operands from the stack.
+    assert(register_count >= 2);
+
+    Scratch scratch = get_scratch(arena);
+
+    LiveIntervals intervals = build_live_intervals(scratch.arena, cfg, bytecode, liveness);
+
+    i64 original_count = bytecode->register_count;
+    i64* assignments = arena_push_array(scratch.arena, i64, original_count);
+    i64* slots = arena_push_array(scratch.arena, i64, original_count);
+
+    Instruction* immediates = arena_push_array(scratch.arena, Instruction, original_count);
+    find_immediates(bytecode, 0, immediates);
+
+    u32 spill_count = 0;
+    for (u32 allocatable = register_count;; allocatable = register_count - 2) {
+        for (i64 i = 0; i < original_count; ++i) {
+            assignments[i] = -1;
+            slots[i] = -1;
+        }
+
+        bytecode->slot_count = 0;
+        spill_count = scan_live_intervals(arena, bytecode, &intervals, allocatable, immediates, assignments, slots);
+
+        if (!spill_count || allocatable != register_count)
+            break;
+    }
+
+    if (spill_count) {
+        insert_spill_code(arena, cfg, bytecode, slots, immediates);
+    }
+
+    i64* mapping = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    for (i64 i = 0; i < original_count; ++i) {
+        // Registers only unreachable code refers to can have any register.
+        mapping[i] = assignments[i] != -1 ? assignments[i] : 0;
+    }
+
+    // Registers made by spilling are each written once, just before the instruction they
+    // belong to reads them or just after it writes them. Loads for the two operands of
+    // an instruction take the two held back registers, a result the first.
+    u32 load_count = 0;
+    for (int i = 0; i < bytecode->length; ++i) {
+        Instruction* ins = bytecode->instructions + i;
+
+        u32* uses[2];
+        u32* defined;
+        get_operands(ins, uses, &defined);
+
+        bool is_temporary = defined && *defined >= original_count;
+        bool is_load = is_temporary && (ins->op == OP_RELOAD || ins->op == OP_IMM);
+
+        if (is_load) {
+            assert(load_count < 2);
+            mapping[*defined] = register_count - 2 + load_count;
+        }
+        else if (is_temporary) {
+            mapping[*defined] = register_count - 2;
+        }
+
+        load_count = is_load ? load_count + 1 : 0;
+    }
+
+    remap_registers(bytecode, mapping);
+
+    for (int i = 0; i < bytecode->length; ++i) {
+        Instruction* ins = bytecode->instructions + i;
+        if (ins->op == OP_COPY && ins->a1 == ins->a2) {
+            ins->op = OP_NOOP;
+        }
     }
 
     bytecode->register_count = register_count;
@@ -4,8 +4,54 @@
 
 Bytecode* generate_bytecode(Arena* arena, ASTFunction* ast_function);
 
-BasicBlock* analyze_control_flow(Arena* arena, char* source, Bytecode* bytecode);
+Op ast_binary_op(ASTKind kind);
 
-void analyze_data_flow(BasicBlock* graph, Bytecode* bytecode);
+ControlFlowGraph* analyze_control_flow(Arena* arena, Source* source, Bytecode* bytecode);
 
-void allocate_registers(BasicBlock* graph, Bytecode* bytecode, u32 register_count);
\ No newline at end of file
+Liveness* analyze_liveness(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode);
+
+// Points uses at the registers an instruction reads and defined at the one it writes, or
+// at null when it writes none. Returns the number of uses.
+int get_operands(Instruction* ins, u32** uses, u32** defined);
+
+// Grows the instruction, label and line arrays to hold at least length instructions.
+void reserve_instructions(Arena* arena, Bytecode* bytecode, int length);
+
+// An edge to a block no later in reverse postorder closes a loop, whose body is every
+// block that reaches the edge without passing its header. Collects the body into body,
+// header first, and marks its blocks with mark. Returns the number of blocks, zero when
+// the block heads no loop.
+u32 find_loop_body(ControlFlowGraph* cfg, u32 header, u32* marks, u32 mark, u32* body);
+
+// Drops every OP_NOOP and fixes up labels and jumps. The graph is analyzed again.
+void remove_noops(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode);
+
+// Drops instructions with no effect but a result that is never read, including stores
+// overwritten before being read, and whatever computed only for them. They are left as
+// OP_NOOPs, so the graph stays valid, and liveness is brought up to date in place.
+// Returns the number of instructions dropped.
+u32 eliminate_dead_code(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness);
+
+// How the register allocator picks a live range to spill when no range is trivially
+// colorable.
+typedef enum {
+    SPILL_BY_DENSITY,    // Fewest loop-weighted references per instruction the range is live across.
+    SPILL_BY_DEGREE,     // Fewest loop-weighted references per interfering range, as in Chaitin's allocator.
+    SPILL_BY_REFERENCES, // Fewest references per interfering range, ignoring loops.
+
+    NUM_SPILL_HEURISTICS
+} SpillHeuristic;
+
+// Summed over the rounds of build, coalesce, simplify and select.
+typedef struct {
+    u32 rounds;
+    u64 live_ranges;   // As built, before coalescing.
+    u64 interferences; // As built, before coalescing.
+    u64 coalesced;
+    u64 split;         // Live ranges split around loops.
+} GraphColoringStats;
+
+// Stats are optional.
+void allocate_registers(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness, u32 register_count, SpillHeuristic heuristic, GraphColoringStats* stats);
+void allocate_registers_linear_scan(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness, u32 register_count);
+void assign_registers_directly(Bytecode* bytecode);
\ No newline at end of file
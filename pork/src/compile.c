@@ -0,0 +1,157 @@
+#include <stdio.h>
+
+#include "compile.h"
+#include "bytecode.h"
+#include "fold.h"
+#include "gvn.h"
+#include "loop.h"
+#include "parse.h"
+#include "semantics.h"
+#include "ssa.h"
+
+typedef struct {
+    CompileStats* stats;
+    Arena* arena;
+    f64 start;
+    u64 allocated;
+    ScratchWatermark watermark;
+} PhaseTimer;
+
+internal void begin_phase(PhaseTimer* timer) {
+    if (timer->stats) {
+        timer->allocated = timer->arena->allocated;
+        timer->watermark = begin_scratch_watermark();
+        timer->start = get_time();
+    }
+}
+
+internal void end_phase(PhaseTimer* timer, CompilePhase phase) {
+    if (timer->stats) {
+        timer->stats->seconds[phase] += get_time() - timer->start;
+        timer->stats->arena_bytes[phase] += timer->arena->allocated - timer->allocated;
+        timer->stats->scratch_bytes[phase] += end_scratch_watermark(&timer->watermark);
+    }
+}
+
+Bytecode* compile(Arena* arena, Source* source, OptimizationLevel level, RegisterAllocator allocator, CompileStats* stats) {
+    PhaseTimer timer = { .stats = stats, .arena = arena };
+
+    Program program = {0};
+    init_program(arena, &program);
+
+    begin_phase(&timer);
+    ASTFunction* ast_function = parse(arena, source, &program);
+    end_phase(&timer, PHASE_PARSE);
+    if (!ast_function)
+        return 0;
+
+    begin_phase(&timer);
+    bool semantics_ok = analyze_semantics(arena, source, &program, ast_function);
+    end_phase(&timer, PHASE_SEMANTICS);
+    if (!semantics_ok)
+        return 0;
+
+    if (level != OPTIMIZE_NONE) {
+        begin_phase(&timer);
+        fold_constants(arena, ast_function);
+        end_phase(&timer, PHASE_FOLD);
+    }
+
+    begin_phase(&timer);
+    Bytecode* bytecode = generate_bytecode(arena, ast_function);
+    end_phase(&timer, PHASE_BYTECODE);
+
+    // Always run for its diagnostics, even when nothing else uses the graph.
+    begin_phase(&timer);
+    ControlFlowGraph* cfg = analyze_control_flow(arena, source, bytecode);
+    end_phase(&timer, PHASE_CONTROL_FLOW);
+    if (!cfg) return 0;
+
+    if (level == OPTIMIZE_NONE) {
+        begin_phase(&timer);
+        assign_registers_directly(bytecode);
+        end_phase(&timer, PHASE_REGISTERS);
+    }
+    else {
+        if (level == OPTIMIZE_SSA) {
+            begin_phase(&timer);
+            insert_preheaders(arena, cfg, bytecode);
+            end_phase(&timer, PHASE_OPTIMIZE);
+        }
+
+        begin_phase(&timer);
+        Liveness* liveness = analyze_liveness(arena, cfg, bytecode);
+        end_phase(&timer, PHASE_DATA_FLOW);
+
+        if (level == OPTIMIZE_SSA) {
+            begin_phase(&timer);
+            SSAForm* ssa = construct_ssa(arena, cfg, bytecode, liveness);
+            end_phase(&timer, PHASE_SSA);
+
+            begin_phase(&timer);
+            hoist_loop_invariants(arena, cfg, bytecode, ssa);
+            number_values(arena, cfg, bytecode, ssa);
+            end_phase(&timer, PHASE_OPTIMIZE);
+
+            begin_phase(&timer);
+            destruct_ssa(arena, cfg, bytecode, ssa);
+            end_phase(&timer, PHASE_SSA);
+
+            begin_phase(&timer);
+            liveness = analyze_liveness(arena, cfg, bytecode);
+            end_phase(&timer, PHASE_DATA_FLOW);
+        }
+
+        begin_phase(&timer);
+        eliminate_dead_code(arena, cfg, bytecode, liveness);
+        end_phase(&timer, PHASE_OPTIMIZE);
+
+        begin_phase(&timer);
+        if (allocator == ALLOCATE_LINEAR_SCAN) {
+            allocate_registers_linear_scan(arena, cfg, bytecode, liveness, VM_REGISTER_COUNT);
+        }
+        else {
+            allocate_registers(arena, cfg, bytecode, liveness, VM_REGISTER_COUNT, SPILL_BY_DENSITY, 0);
+        }
+
+        // Dead code and coalesced copies are left as NOOPs, which the VM would still dispatch.
+        remove_noops(arena, cfg, bytecode);
+        end_phase(&timer, PHASE_REGISTERS);
+    }
+
+    return bytecode;
+}
+
+char* compile_phase_name(CompilePhase phase) {
+    static_assert(NUM_COMPILE_PHASES == 9, "not all phases named");
+    switch (phase) {
+        default:
+            assert(false);
+            return "";
+        case PHASE_PARSE:
+            return "parse";
+        case PHASE_SEMANTICS:
+            return "semantics";
+        case PHASE_FOLD:
+            return "fold";
+        case PHASE_BYTECODE:
+            return "bytecode";
+        case PHASE_CONTROL_FLOW:
+            return "control flow";
+        case PHASE_DATA_FLOW:
+            return "data flow";
+        case PHASE_SSA:
+            return "ssa";
+        case PHASE_OPTIMIZE:
+            return "optimize";
+        case PHASE_REGISTERS:
+            return "registers";
+    }
+}
+
+void print_compile_stats(CompileStats* stats) {
+    for (int i = 0; i < NUM_COMPILE_PHASES; ++i) {
+        printf("%-12s %9.3f ms %9.2f MB arena %9.2f MB scratch\n", compile_phase_name(i), stats->seconds[i] * 1000.0,
+               (f64)stats->arena_bytes[i] / (1024.0 * 1024.0), (f64)stats->scratch_bytes[i] / (1024.0 * 1024.0));
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "types.h"
+
+typedef enum {
+    OPTIMIZE_NONE, // -O0: no folding, no liveness, every virtual register gets its own VM register.
+    OPTIMIZE_FULL,
+    OPTIMIZE_SSA,  // -O2: also takes the function through SSA form, moving loop invariants out and merging values computed twice.
+} OptimizationLevel;
+
+// The register allocator used when optimizing.
+typedef enum {
+    ALLOCATE_GRAPH_COLORING, // Coalesces copies and spills by loop depth.
+    ALLOCATE_LINEAR_SCAN,    // Compiles faster, keeps more copies and spills.
+} RegisterAllocator;
+
+#define VM_REGISTER_COUNT 8
+
+typedef enum {
+    PHASE_PARSE,
+    PHASE_SEMANTICS,
+    PHASE_FOLD,
+    PHASE_BYTECODE,
+    PHASE_CONTROL_FLOW,
+    PHASE_DATA_FLOW,
+    PHASE_SSA,
+    PHASE_OPTIMIZE,
+    PHASE_REGISTERS,
+
+    NUM_COMPILE_PHASES
+} CompilePhase;
+
+// Each compile adds to the stats of the phases it runs. Arena bytes are what a phase
+// leaves behind, scratch bytes how high its temporary allocations rose.
+typedef struct {
+    f64 seconds[NUM_COMPILE_PHASES];
+    u64 arena_bytes[NUM_COMPILE_PHASES];
+    u64 scratch_bytes[NUM_COMPILE_PHASES];
+} CompileStats;
+
+// Stats are optional.
+Bytecode* compile(Arena* arena, Source* source, OptimizationLevel level, RegisterAllocator allocator, CompileStats* stats);
+
+char* compile_phase_name(CompilePhase phase);
+void print_compile_stats(CompileStats* stats);
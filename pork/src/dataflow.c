@@ -0,0 +1,75 @@
+#include "dataflow.h"
+
+// Round-robin worklist: blocks are visited in reverse postorder for forward problems
+// and in postorder for backward ones, so information flows along every edge except loop
+// back edges within a single sweep. Only blocks whose neighbors changed are revisited.
+DataFlowSolution solve_data_flow(Arena* arena, ControlFlowGraph* cfg, DataFlowProblem* problem) {
+    u32 block_count = cfg->block_count;
+
+    DataFlowSolution solution = {
+        .inputs = arena_push_array(arena, Bitset, block_count),
+        .outputs = arena_push_array(arena, Bitset, block_count)
+    };
+
+    for (u32 b = 0; b < block_count; ++b) {
+        solution.inputs[b] = new_bitset(arena, problem->bit_count);
+        solution.outputs[b] = new_bitset(arena, problem->bit_count);
+        if (problem->initially_full) {
+            bitset_fill(solution.outputs + b, problem->bit_count);
+        }
+    }
+
+    bool forward = problem->direction == DATA_FLOW_FORWARD;
+    u32* source_offsets = forward ? cfg->predecessor_offsets : cfg->successor_offsets;
+    u32* sources = forward ? cfg->predecessors : cfg->successors;
+    u32* dependent_offsets = forward ? cfg->successor_offsets : cfg->predecessor_offsets;
+    u32* dependents = forward ? cfg->successors : cfg->predecessors;
+
+    Scratch scratch = get_scratch(arena);
+
+    Bitset pending = new_bitset(scratch.arena, block_count);
+    bitset_fill(&pending, block_count);
+    u32 pending_count = block_count;
+
+    while (pending_count) {
+        for (u32 i = 0; i < block_count; ++i) {
+            u32 b = forward ? i : block_count - 1 - i;
+            if (!bitset_has(&pending, b)) {
+                continue;
+            }
+
+            bitset_remove(&pending, b);
+            --pending_count;
+
+            Bitset* input = solution.inputs + b;
+            u32 first = source_offsets[b];
+            u32 last = source_offsets[b + 1];
+
+            if (first == last) {
+                bitset_clear(input);
+            }
+            else {
+                bitset_copy(input, solution.outputs + sources[first]);
+                for (u32 e = first + 1; e < last; ++e) {
+                    problem->meet(input, solution.outputs + sources[e]);
+                }
+            }
+
+            ++solution.visit_count;
+
+            if (problem->transfer(problem->context, b, input, solution.outputs + b)) {
+                for (u32 e = dependent_offsets[b]; e < dependent_offsets[b + 1]; ++e) {
+                    u32 dependent = dependents[e];
+                    if (!bitset_has(&pending, dependent)) {
+                        bitset_insert(&pending, dependent);
+                        ++pending_count;
+                    }
+                }
+            }
+        }
+    }
+
+    release_scratch(&scratch);
+
+    return solution;
+}
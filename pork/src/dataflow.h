@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.h"
+
+typedef enum {
+    DATA_FLOW_FORWARD,
+    DATA_FLOW_BACKWARD,
+} DataFlowDirection;
+
+// A bitvector problem over a control flow graph. A block's input is the meet of the
+// outputs of its predecessors for forward problems, of its successors for backward ones.
+// Blocks with no such neighbors get the empty set.
+typedef struct {
+    DataFlowDirection direction;
+    u32 bit_count;
+
+    // Outputs start full for intersection problems and empty for union problems.
+    bool initially_full;
+
+    // Merges another neighbor's output into an input, bitset_union or bitset_intersect.
+    bool (*meet)(Bitset* set, Bitset* other);
+
+    // Brings a block's output up to date with its input and returns whether it changed.
+    // Values only move one way through the lattice, so outputs can be updated in place.
+    bool (*transfer)(void* context, u32 block, Bitset* input, Bitset* output);
+    void* context;
+} DataFlowProblem;
+
+typedef struct {
+    // At block starts for forward problems and at block ends for backward ones, the
+    // outputs at the other end.
+    Bitset* inputs;
+    Bitset* outputs;
+
+    u32 visit_count;
+} DataFlowSolution;
+
+DataFlowSolution solve_data_flow(Arena* arena, ControlFlowGraph* cfg, DataFlowProblem* problem);
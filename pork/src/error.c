@@ -4,23 +4,26 @@
 
 #include "error.h"
 
-internal int find_line_length(char* line_memory) {
+internal int find_line_length(Source* source, char* line_memory) {
+    char* end = source->memory + source->length;
     int line_length = 0;
 
-    while (line_memory[line_length] != '\n' && line_memory[line_length] != '\0') {
+    while (line_memory + line_length < end && line_memory[line_length] != '\n' && line_memory[line_length] != '\r') {
         ++line_length;
     }
 
     return line_length;
 }
 
-void error_at_token(char* source, Token token, char* format, ...) {
+void error_at_token(Source* source, Token token, char* format, ...) {
+    char* end = source->memory + source->length;
+
     char* line_memory = token.memory;
-    while (*line_memory != '\n' && line_memory != source) {
+    while (line_memory != source->memory && (line_memory == end || *line_memory != '\n')) {
         --line_memory;
     }
     
-    while (isspace(*line_memory)) {
+    while (line_memory < token.memory && isspace(*line_memory)) {
         ++line_memory;
     }
 
@@ -29,7 +32,7 @@ void error_at_token(char* source, Token token, char* format, ...) {
 
     int arrow_offset = prefix_length + (int)(token.memory-line_memory);
 
-    printf("%s%.*s\n", prefix, find_line_length(line_memory), line_memory);
+    printf("%s%.*s\n", prefix, find_line_length(source, line_memory), line_memory);
     printf("%*s^ ", arrow_offset, "");
 
     va_list argument_list;
@@ -40,17 +43,19 @@ void error_at_token(char* source, Token token, char* format, ...) {
     printf("\n");
 }
 
-void error_on_line(char* source, int line, char* format, ...) {
-    char* line_memory = source;
+void error_on_line(Source* source, int line, char* format, ...) {
+    char* end = source->memory + source->length;
+
+    char* line_memory = source->memory;
     for (int i = 1; i < line; ++i) {
-        while (*line_memory != '\n' && *line_memory != '\0') {
+        while (line_memory < end && *line_memory != '\n') {
             ++line_memory;
         }
-        assert(*line_memory == '\n' && "line out of bounds");
+        assert(line_memory < end && "line out of bounds");
         ++line_memory;
     }
 
-    while (isspace(*line_memory)) {
+    while (line_memory < end && isspace(*line_memory)) {
         ++line_memory;
     }
 
@@ -61,5 +66,5 @@ void error_on_line(char* source, int line, char* format, ...) {
     vprintf(format, argument_list);
     va_end(argument_list);
 
-    printf(": '%.*s'\n", find_line_length(line_memory), line_memory);
+    printf(": '%.*s'\n", find_line_length(source, line_memory), line_memory);
 }
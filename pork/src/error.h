@@ -2,5 +2,5 @@
 
 #include "types.h"
 
-void error_at_token(char* source, Token token, char* format, ...);
-void error_on_line(char* source, int line, char* format, ...);
+void error_at_token(Source* source, Token token, char* format, ...);
+void error_on_line(Source* source, int line, char* format, ...);
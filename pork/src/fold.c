@@ -0,0 +1,319 @@
+#include "fold.h"
+#include "bytecode.h"
+#include "vm.h"
+
+typedef struct {
+    u32 node;
+    bool finish;
+} FoldWork;
+
+typedef struct {
+    AST* ast;
+    Arena* scratch;
+
+    FoldWork* work;
+    u32 work_count;
+    u32 work_capacity;
+
+    u8* flags;
+} Folder;
+
+enum {
+    FOLD_PURE = 1 << 0, // Evaluating the node has no side effects, so it can be dropped.
+    FOLD_RETURNS = 1 << 1, // The statement contains a return.
+};
+
+internal void push_work(Folder* folder, u32 node, bool finish) {
+    if (folder->work_count == folder->work_capacity) {
+        u32 capacity = folder->work_capacity ? folder->work_capacity * 2 : 256;
+        folder->work = arena_grow_array(folder->scratch, folder->work, folder->work_count, capacity);
+        folder->work_capacity = capacity;
+    }
+
+    folder->work[folder->work_count++] = (FoldWork){ .node = node, .finish = finish };
+}
+
+internal bool is_literal(AST* ast, u32 node, i64 value) {
+    return ast->kinds[node] == AST_INT_LITERAL && wrap_to_type(ast->types[node]->op_type, ast->literals[ast->a1[node]]) == value;
+}
+
+internal i64 literal_value(AST* ast, u32 node) {
+    assert(ast->kinds[node] == AST_INT_LITERAL);
+    return wrap_to_type(ast->types[node]->op_type, ast->literals[ast->a1[node]]);
+}
+
+// Turns the node into a literal. The slot belongs to one of the node's operands,
+// which is unreachable afterwards.
+internal void make_literal(AST* ast, u32 node, u32 literal, i64 value) {
+    u32 slot = ast->a1[literal];
+
+    ast->kinds[node] = AST_INT_LITERAL;
+    ast->a1[node] = slot;
+    ast->a2[node] = 0;
+    ast->a3[node] = 0;
+    ast->literals[slot] = wrap_to_type(ast->types[node]->op_type, value);
+}
+
+// Replaces the node by one of its children, keeping its place in the tree.
+internal void replace_node(AST* ast, u32 node, u32 child) {
+    ast->kinds[node] = ast->kinds[child];
+    ast->tokens[node] = ast->tokens[child];
+    ast->a1[node] = ast->a1[child];
+    ast->a2[node] = ast->a2[child];
+    ast->a3[node] = ast->a3[child];
+}
+
+internal void make_empty_block(AST* ast, u32 node) {
+    ast->kinds[node] = AST_BLOCK;
+    ast->a1[node] = 0;
+    ast->a2[node] = 0;
+    ast->a3[node] = 0;
+}
+
+internal void fold_binary(Folder* folder, u32 node) {
+    AST* ast = folder->ast;
+
+    u32 left = ast->a1[node];
+    u32 right = ast->a2[node];
+    ASTKind kind = ast->kinds[node];
+
+    bool left_is_literal = ast->kinds[left] == AST_INT_LITERAL;
+    bool right_is_literal = ast->kinds[right] == AST_INT_LITERAL;
+
+    if (left_is_literal && right_is_literal) {
+        i64 left_value = literal_value(ast, left);
+        i64 right_value = literal_value(ast, right);
+
+        // Division by zero is left for the VM to trip over.
+        if (kind != AST_DIV || right_value != 0) {
+            make_literal(ast, node, left, evaluate_binary(ast_binary_op(kind), ast->types[node]->op_type, left_value, right_value));
+        }
+
+        return;
+    }
+
+    switch (kind) {
+        default:
+            break;
+
+        case AST_ADD:
+            if (is_literal(ast, left, 0)) {
+                replace_node(ast, node, right);
+            }
+            else if (is_literal(ast, right, 0)) {
+                replace_node(ast, node, left);
+            }
+            break;
+
+        case AST_SUB:
+            if (is_literal(ast, right, 0)) {
+                replace_node(ast, node, left);
+            }
+            break;
+
+        case AST_MUL:
+            if (is_literal(ast, left, 1)) {
+                replace_node(ast, node, right);
+            }
+            else if (is_literal(ast, right, 1)) {
+                replace_node(ast, node, left);
+            }
+            else if (is_literal(ast, left, 0) && (folder->flags[right] & FOLD_PURE)) {
+                make_literal(ast, node, left, 0);
+            }
+            else if (is_literal(ast, right, 0) && (folder->flags[left] & FOLD_PURE)) {
+                make_literal(ast, node, right, 0);
+            }
+            break;
+
+        case AST_DIV:
+            if (is_literal(ast, right, 1)) {
+                replace_node(ast, node, left);
+            }
+            break;
+    }
+}
+
+internal void fold_node(Folder* folder, u32 node) {
+    AST* ast = folder->ast;
+    u8* flags = folder->flags;
+
+    static_assert(NUM_AST_KINDS == 18, "not all ast kinds handled");
+    switch (ast->kinds[node]) {
+        default:
+            assert(false);
+            break;
+
+        case AST_INT_LITERAL:
+        case AST_VARIABLE:
+        case AST_ASSIGN:
+        case AST_BLOCK:
+        case AST_RETURN:
+        case AST_VARIABLE_DECL:
+            break;
+
+        case AST_CAST: {
+            u32 expression = ast->a1[node];
+            if (ast->kinds[expression] == AST_INT_LITERAL) {
+                make_literal(ast, node, expression, literal_value(ast, expression));
+            }
+            break;
+        }
+
+        case AST_ADD:
+        case AST_SUB:
+        case AST_MUL:
+        case AST_DIV:
+        case AST_LESS:
+        case AST_LEQUAL:
+        case AST_EQUAL:
+        case AST_NEQUAL:
+            fold_binary(folder, node);
+            break;
+
+        // Branches with a return are kept, so that dropping them cannot change which
+        // code the control flow diagnostics consider reachable.
+        case AST_IF: {
+            u32 condition = ast->a1[node];
+            bool returns = (flags[ast->a2[node]] | flags[ast->a3[node]]) & FOLD_RETURNS;
+
+            if (ast->kinds[condition] == AST_INT_LITERAL && !returns) {
+                u32 taken = literal_value(ast, condition) ? ast->a2[node] : ast->a3[node];
+                if (taken) {
+                    replace_node(ast, node, taken);
+                }
+                else {
+                    make_empty_block(ast, node);
+                }
+            }
+            break;
+        }
+
+        case AST_WHILE: {
+            u32 condition = ast->a1[node];
+            bool returns = flags[ast->a2[node]] & FOLD_RETURNS;
+
+            if (ast->kinds[condition] == AST_INT_LITERAL && literal_value(ast, condition) == 0 && !returns) {
+                make_empty_block(ast, node);
+            }
+            break;
+        }
+    }
+
+    // Computed on the folded node, whose children are final by now.
+    switch (ast->kinds[node]) {
+        default:
+            break;
+
+        case AST_INT_LITERAL:
+        case AST_VARIABLE:
+            flags[node] = FOLD_PURE;
+            break;
+
+        case AST_CAST:
+            flags[node] = flags[ast->a1[node]] & FOLD_PURE;
+            break;
+
+        case AST_ADD:
+        case AST_SUB:
+        case AST_MUL:
+        case AST_LESS:
+        case AST_LEQUAL:
+        case AST_EQUAL:
+        case AST_NEQUAL:
+            flags[node] = flags[ast->a1[node]] & flags[ast->a2[node]] & FOLD_PURE;
+            break;
+
+        // Dropping a division that could be by zero would lose the fault.
+        case AST_DIV: {
+            u32 right = ast->a2[node];
+            if (ast->kinds[right] == AST_INT_LITERAL && literal_value(ast, right) != 0) {
+                flags[node] = flags[ast->a1[node]] & FOLD_PURE;
+            }
+            break;
+        }
+
+        case AST_RETURN:
+            flags[node] = FOLD_RETURNS;
+            break;
+
+        case AST_BLOCK:
+            for (u32 statement = ast->a1[node]; statement; statement = ast->nexts[statement]) {
+                flags[node] |= flags[statement] & FOLD_RETURNS;
+            }
+            break;
+
+        case AST_IF:
+        case AST_WHILE:
+            flags[node] = (flags[ast->a2[node]] | flags[ast->a3[node]]) & FOLD_RETURNS;
+            break;
+    }
+}
+
+// Evaluates constant subexpressions, applies algebraic identities and drops the dead
+// branch of ifs with a constant condition. Runs between semantic analysis and bytecode
+// generation, on a tree whose nodes are all typed.
+void fold_constants(Arena* arena, ASTFunction* ast_function) {
+    AST* ast = &ast_function->ast;
+    Scratch scratch = get_scratch(arena);
+
+    Folder folder = {
+        .ast = ast,
+        .scratch = scratch.arena,
+        .flags = arena_push_zero(scratch.arena, ast->count)
+    };
+
+    push_work(&folder, ast_function->body, false);
+
+    while (folder.work_count) {
+        FoldWork work = folder.work[--folder.work_count];
+        u32 node = work.node;
+
+        if (work.finish) {
+            fold_node(&folder, node);
+            continue;
+        }
+
+        push_work(&folder, node, true);
+
+        switch (ast->kinds[node]) {
+            default:
+                break;
+
+            case AST_CAST:
+            case AST_RETURN:
+                push_work(&folder, ast->a1[node], false);
+                break;
+
+            case AST_ADD:
+            case AST_SUB:
+            case AST_MUL:
+            case AST_DIV:
+            case AST_LESS:
+            case AST_LEQUAL:
+            case AST_EQUAL:
+            case AST_NEQUAL:
+            case AST_ASSIGN:
+                push_work(&folder, ast->a1[node], false);
+                push_work(&folder, ast->a2[node], false);
+                break;
+
+            case AST_BLOCK:
+                for (u32 statement = ast->a1[node]; statement; statement = ast->nexts[statement]) {
+                    push_work(&folder, statement, false);
+                }
+                break;
+
+            case AST_IF:
+            case AST_WHILE:
+                push_work(&folder, ast->a1[node], false);
+                push_work(&folder, ast->a2[node], false);
+                if (ast->a3[node]) {
+                    push_work(&folder, ast->a3[node], false);
+                }
+                break;
+        }
+    }
+
+    release_scratch(&scratch);
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "types.h"
+
+void fold_constants(Arena* arena, ASTFunction* ast_function);
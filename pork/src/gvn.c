@@ -0,0 +1,141 @@
+#include "gvn.h"
+#include "bytecode.h"
+
+// Operands are value numbers, except for the source type of OP_CAST.
+typedef struct {
+    u8 op;
+    u8 type;
+    i64 a;
+    i64 b;
+} ValueKey;
+
+typedef struct {
+    ValueKey key;
+    u32 leader; // The register holding the value, UINT32_MAX for an empty slot.
+    u32 block;
+} ValueSlot;
+
+internal u32 hash_value_key(ValueKey key) {
+    u64 hash = ((u64)key.op << 8 | key.type) * 0x9e3779b97f4a7c15;
+    hash = (hash ^ (u64)key.a) * 0xff51afd7ed558ccd;
+    hash ^= hash >> 32;
+    hash = (hash ^ (u64)key.b) * 0xff51afd7ed558ccd;
+
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    hash ^= hash >> 33;
+
+    return (u32)hash;
+}
+
+internal bool value_keys_equal(ValueKey x, ValueKey y) {
+    return x.op == y.op && x.type == y.type && x.a == y.a && x.b == y.b;
+}
+
+// Whether the instruction's result depends on nothing but its operands, in which case
+// key is set. Operands of commutative ops are put in order. Constants are left alone:
+// merging them would keep one register live across everything between their uses,
+// where the allocator can rematerialize each where it is needed.
+internal bool get_value_key(Bytecode* bytecode, Instruction* ins, u32* numbers, ValueKey* key) {
+    *key = (ValueKey){ .op = ins->op, .type = ins->type };
+
+    static_assert(NUM_OPS == 18, "not all ops handled");
+    switch (ins->op) {
+        default:
+            return false;
+
+        case OP_CAST:
+            key->a = numbers[ins->a2];
+            key->b = ins->a3;
+            return true;
+
+        case OP_ADD:
+        case OP_MUL:
+        case OP_EQUAL:
+        case OP_NEQUAL: {
+            u32 left = numbers[ins->a2];
+            u32 right = numbers[ins->a3];
+            key->a = left < right ? left : right;
+            key->b = left < right ? right : left;
+            return true;
+        }
+
+        case OP_SUB:
+        case OP_DIV:
+        case OP_LESS:
+        case OP_LEQUAL:
+            key->a = numbers[ins->a2];
+            key->b = numbers[ins->a3];
+            return true;
+    }
+}
+
+// Blocks are visited in a preorder walk of the dominator tree. Nothing is ever taken out
+// of the table: an entry whose block does not dominate the one being visited belongs to
+// a subtree already left, and is overwritten by the next value with its key.
+u32 number_values(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, SSAForm* ssa) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+    i64 register_count = bytecode->register_count;
+    DominatorTree* tree = ssa->dominators;
+
+    u32* numbers = arena_push_array(scratch.arena, u32, register_count);
+    for (i64 i = 0; i < register_count; ++i) {
+        numbers[i] = (u32)i;
+    }
+
+    // At least twice as many slots as instructions, so probes stay short without growing.
+    u32 slot_count = 16;
+    while (slot_count < (u32)bytecode->length * 2) {
+        slot_count *= 2;
+    }
+
+    u32 mask = slot_count - 1;
+    ValueSlot* slots = arena_push_array(scratch.arena, ValueSlot, slot_count);
+    for (u32 s = 0; s < slot_count; ++s) {
+        slots[s].leader = UINT32_MAX;
+    }
+
+    u32* order = arena_push_array(scratch.arena, u32, block_count);
+    for (u32 b = 0; b < block_count; ++b) {
+        order[tree->preorder[b]] = b;
+    }
+
+    u32 replaced = 0;
+
+    for (u32 k = 0; k < block_count; ++k) {
+        u32 b = order[k];
+
+        for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; ++i) {
+            Instruction* ins = bytecode->instructions + i;
+
+            if (ins->op == OP_COPY) {
+                numbers[ins->a1] = numbers[ins->a2];
+                continue;
+            }
+
+            ValueKey key;
+            if (!get_value_key(bytecode, ins, numbers, &key))
+                continue;
+
+            u32 s = hash_value_key(key) & mask;
+            while (slots[s].leader != UINT32_MAX && !value_keys_equal(slots[s].key, key)) {
+                s = (s + 1) & mask;
+            }
+
+            ValueSlot* slot = slots + s;
+            if (slot->leader != UINT32_MAX && dominates(tree, slot->block, b)) {
+                numbers[ins->a1] = slot->leader;
+                *ins = (Instruction){ .op = OP_COPY, .type = ins->type, .a1 = ins->a1, .a2 = slot->leader };
+                ++replaced;
+            }
+            else {
+                *slot = (ValueSlot){ .key = key, .leader = ins->a1, .block = b };
+            }
+        }
+    }
+
+    release_scratch(&scratch);
+
+    return replaced;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "types.h"
+#include "ssa.h"
+
+// Dominator-scoped value numbering on SSA form. An instruction computing what one in a
+// dominating block already has, by op, type and the value numbers of its operands, is
+// replaced with a copy of that result for the register allocator to coalesce. Copies
+// pass their source's number on. Returns the number of instructions replaced.
+u32 number_values(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, SSAForm* ssa);
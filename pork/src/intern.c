@@ -0,0 +1,92 @@
+#include "intern.h"
+
+// Mixes eight bytes at a time; generated code has long identifiers with common prefixes.
+internal u32 hash_name(char* name, u32 length) {
+    u64 hash = length * 0x9e3779b97f4a7c15;
+
+    while (length >= 8) {
+        u64 word;
+        memcpy(&word, name, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccd;
+        hash ^= hash >> 32;
+        name += 8;
+        length -= 8;
+    }
+
+    u64 tail = 0;
+    memcpy(&tail, name, length);
+    hash ^= tail;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    hash ^= hash >> 33;
+
+    return (u32)hash;
+}
+
+internal void grow_slots(Arena* arena, SymbolTable* table) {
+    table->slot_count = table->slot_count ? table->slot_count * 2 : 256;
+    table->slots = arena_push_array(arena, u32, table->slot_count);
+
+    u32 mask = table->slot_count - 1;
+
+    for (u32 symbol = 1; symbol <= table->count; ++symbol) {
+        u32 i = table->hashes[symbol] & mask;
+        while (table->slots[i]) {
+            i = (i + 1) & mask;
+        }
+        table->slots[i] = symbol;
+    }
+}
+
+internal void grow_symbols(Arena* arena, SymbolTable* table) {
+    u32 capacity = table->capacity ? table->capacity * 2 : 128;
+
+    char** names = arena_push_array(arena, char*, capacity);
+    u32* lengths = arena_push_array(arena, u32, capacity);
+    u32* hashes = arena_push_array(arena, u32, capacity);
+
+    if (table->capacity) {
+        memcpy(names, table->names, sizeof(char*) * table->capacity);
+        memcpy(lengths, table->lengths, sizeof(u32) * table->capacity);
+        memcpy(hashes, table->hashes, sizeof(u32) * table->capacity);
+    }
+
+    table->names = names;
+    table->lengths = lengths;
+    table->hashes = hashes;
+    table->capacity = capacity;
+}
+
+u32 intern(Arena* arena, SymbolTable* table, char* name, u32 length) {
+    if (table->count * 2 >= table->slot_count) {
+        grow_slots(arena, table);
+    }
+
+    u32 hash = hash_name(name, length);
+    u32 mask = table->slot_count - 1;
+    u32 i = hash & mask;
+
+    while (table->slots[i]) {
+        u32 symbol = table->slots[i];
+        if (table->hashes[symbol] == hash && table->lengths[symbol] == length && memcmp(table->names[symbol], name, length) == 0) {
+            return symbol;
+        }
+        i = (i + 1) & mask;
+    }
+
+    // Symbol 0 is reserved, so ids are stored at their own index.
+    if (table->count + 1 >= table->capacity) {
+        grow_symbols(arena, table);
+    }
+
+    u32 symbol = ++table->count;
+    table->names[symbol] = name;
+    table->lengths[symbol] = length;
+    table->hashes[symbol] = hash;
+    table->slots[i] = symbol;
+
+    return symbol;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+#include "types.h"
+
+u32 intern(Arena* arena, SymbolTable* table, char* name, u32 length);
@@ -1,12 +1,23 @@
 #include <ctype.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LEXER_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LEXER_SSE2
+#endif
+
 #include "lexer.h"
+#include "intern.h"
 
-Lexer init_lexer(char* source) {
+Lexer init_lexer(char* begin, char* end, LexerMode mode) {
     return (Lexer) {
-        .pointer = source,
-        .line = 1
+        .pointer = begin,
+        .end = end,
+        .line = 1,
+        .mode = mode
     };
 }
 
@@ -59,12 +70,12 @@ internal int identifier_kind(char* start, char* pointer) {
         case 'w':
             return check_keyword(start, pointer, "while", TOKEN_WHILE);
     }
-    
+
     return TOKEN_IDENTIFIER;
 }
 
 internal bool match(Lexer* lexer, char c) {
-    if (*lexer->pointer == c) {
+    if (lexer->pointer < lexer->end && *lexer->pointer == c) {
         ++lexer->pointer;
         return true;
     }
@@ -72,44 +83,42 @@ internal bool match(Lexer* lexer, char c) {
     return false;
 }
 
-Token get_token(Lexer* lexer) {
-    if (lexer->cache.memory) {
-        Token token = lexer->cache;
-        lexer->cache.memory = 0;
-        return token;
-    }
-
-    while (isspace(*lexer->pointer)) {
+internal Token lex_reference(Lexer* lexer) {
+    while (lexer->pointer < lexer->end && isspace(*lexer->pointer)) {
         if (*lexer->pointer == '\n') {
             ++lexer->line;
         }
         ++lexer->pointer;
     }
 
+    if (lexer->pointer == lexer->end) {
+        return (Token) {
+            .kind = TOKEN_EOF,
+            .memory = lexer->end,
+            .line = lexer->line
+        };
+    }
+
     char* start = lexer->pointer++;
-    int kind = *(start);
+    int kind = (u8)*start < 128 ? *start : TOKEN_UNKNOWN;
     int line = lexer->line;
 
     switch (*start) {
         default:
             if (isdigit(*start)) {
-                while (isdigit(*lexer->pointer)) {
+                while (lexer->pointer < lexer->end && isdigit(*lexer->pointer)) {
                     ++lexer->pointer;
                 }
                 kind = TOKEN_INT_LITERAL;
             }
             else if(is_identifier(*start)) {
-                while (is_identifier(*lexer->pointer)) {
+                while (lexer->pointer < lexer->end && is_identifier(*lexer->pointer)) {
                     ++lexer->pointer;
                 }
                 kind = identifier_kind(start, lexer->pointer);
             }
             break;
 
-        case '\0':
-            --lexer->pointer;
-            break;
-
         case '<':
             if (match(lexer, '='))
                 kind = TOKEN_LESS_EQUAL;
@@ -136,16 +145,345 @@ Token get_token(Lexer* lexer) {
     };
 }
 
-Token peek_token(Lexer* lexer) {
-    if (!lexer->cache.memory) {
-        lexer->cache = get_token(lexer);
+enum {
+    CHAR_SPACE      = 1 << 0,
+    CHAR_NEWLINE    = 1 << 1,
+    CHAR_DIGIT      = 1 << 2,
+    CHAR_IDENTIFIER = 1 << 3,
+};
+
+#define S CHAR_SPACE
+#define N CHAR_NEWLINE
+#define D CHAR_DIGIT
+#define I CHAR_IDENTIFIER
+
+// Matches isspace/isdigit/is_identifier in the C locale. Bytes >= 0x80 have no class.
+internal const u8 char_classes[256] = {
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   S,   S|N, S,   S,   S,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    S,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    D|I, D|I, D|I, D|I, D|I, D|I, D|I, D|I, D|I, D|I, 0,   0,   0,   0,   0,   0,
+    0,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,
+    I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   0,   0,   0,   0,   I,
+    0,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,
+    I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   I,   0,   0,   0,   0,   0,
+};
+
+#undef S
+#undef N
+#undef D
+#undef I
+
+#define CLASS_OF(c) char_classes[(u8)(c)]
+
+typedef struct {
+    char* keyword;
+    int length;
+    int kind;
+} Keyword;
+
+// Perfect hash over the keyword set: (c0 + 2*c1 + length) mod 32 is collision free.
+#define KEYWORD_HASH(start, length) (((u8)(start)[0] + 2 * (u8)(start)[1] + (length)) & 31)
+
+internal const Keyword keyword_table[32] = {
+    [1]  = { "else",   4, TOKEN_ELSE   },
+    [2]  = { "return", 6, TOKEN_RETURN },
+    [4]  = { "u64",    3, TOKEN_U64    },
+    [7]  = { "u8",     2, TOKEN_U8     },
+    [12] = { "while",  5, TOKEN_WHILE  },
+    [14] = { "i16",    3, TOKEN_I16    },
+    [18] = { "i32",    3, TOKEN_I32    },
+    [23] = { "if",     2, TOKEN_IF     },
+    [24] = { "i64",    3, TOKEN_I64    },
+    [26] = { "u16",    3, TOKEN_U16    },
+    [27] = { "i8",     2, TOKEN_I8     },
+    [30] = { "u32",    3, TOKEN_U32    },
+};
+
+internal int keyword_kind(char* start, int length) {
+    if (length < 2 || length > 6) {
+        return TOKEN_IDENTIFIER;
+    }
+
+    const Keyword* keyword = keyword_table + KEYWORD_HASH(start, length);
+    if (keyword->length == length && memcmp(start, keyword->keyword, length) == 0) {
+        return keyword->kind;
+    }
+
+    return TOKEN_IDENTIFIER;
+}
+
+#if defined(LEXER_AVX2)
+
+#define CHUNK_SIZE 32
+#define ALL_LANES 0xFFFFFFFF
+
+typedef __m256i Chunk;
+
+internal Chunk load_chunk(char* pointer) {
+    return _mm256_loadu_si256((__m256i*)pointer);
+}
+
+// Lanes where lo <= c <= hi, using the unsigned min trick since there is no unsigned byte compare.
+internal u32 chunk_in_range(Chunk chunk, u8 lo, u8 hi) {
+    __m256i offset = _mm256_sub_epi8(chunk, _mm256_set1_epi8((char)lo));
+    __m256i clamped = _mm256_min_epu8(offset, _mm256_set1_epi8((char)(hi - lo)));
+    return (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(offset, clamped));
+}
+
+internal u32 chunk_equal(Chunk chunk, char c) {
+    return (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(c)));
+}
+
+internal Chunk chunk_to_lower(Chunk chunk) {
+    return _mm256_or_si256(chunk, _mm256_set1_epi8(0x20));
+}
+
+#elif defined(LEXER_SSE2)
+
+#define CHUNK_SIZE 16
+#define ALL_LANES 0xFFFF
+
+typedef __m128i Chunk;
+
+internal Chunk load_chunk(char* pointer) {
+    return _mm_loadu_si128((__m128i*)pointer);
+}
+
+// Lanes where lo <= c <= hi, using the unsigned min trick since there is no unsigned byte compare.
+internal u32 chunk_in_range(Chunk chunk, u8 lo, u8 hi) {
+    __m128i offset = _mm_sub_epi8(chunk, _mm_set1_epi8((char)lo));
+    __m128i clamped = _mm_min_epu8(offset, _mm_set1_epi8((char)(hi - lo)));
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(offset, clamped));
+}
+
+internal u32 chunk_equal(Chunk chunk, char c) {
+    return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+}
+
+internal Chunk chunk_to_lower(Chunk chunk) {
+    return _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+}
+
+#endif
+
+// Each skip function consumes whole chunks while at least one fits before the end of
+// the source, then finishes with a scalar table lookup loop.
+
+internal char* skip_whitespace(char* pointer, char* end, int* line) {
+#if defined(CHUNK_SIZE)
+    // Most tokens are separated by a single space, which isn't worth a chunk load.
+    if (end - pointer >= 2 && pointer[0] == ' ' && !(CLASS_OF(pointer[1]) & CHAR_SPACE)) {
+        return pointer + 1;
+    }
+
+    while (end - pointer >= CHUNK_SIZE && (CLASS_OF(*pointer) & CHAR_SPACE)) {
+        Chunk chunk = load_chunk(pointer);
+        u32 newlines = chunk_equal(chunk, '\n');
+        u32 spaces = chunk_in_range(chunk, '\t', '\r') | chunk_equal(chunk, ' ');
+
+        if (spaces != ALL_LANES) {
+            u32 run = count_trailing_zeros32(~spaces);
+            *line += count_set_bits32(newlines & ((1u << run) - 1));
+            return pointer + run;
+        }
+
+        *line += count_set_bits32(newlines);
+        pointer += CHUNK_SIZE;
+    }
+#endif
+
+    while (pointer < end && (CLASS_OF(*pointer) & CHAR_SPACE)) {
+        *line += (CLASS_OF(*pointer) & CHAR_NEWLINE) != 0;
+        ++pointer;
+    }
+
+    return pointer;
+}
+
+internal char* skip_digits(char* pointer, char* end) {
+#if defined(CHUNK_SIZE)
+    while (end - pointer >= CHUNK_SIZE) {
+        u32 digits = chunk_in_range(load_chunk(pointer), '0', '9');
+        if (digits != ALL_LANES) {
+            return pointer + count_trailing_zeros32(~digits);
+        }
+        pointer += CHUNK_SIZE;
+    }
+#endif
+
+    while (pointer < end && (CLASS_OF(*pointer) & CHAR_DIGIT)) {
+        ++pointer;
     }
 
-    return lexer->cache;
+    return pointer;
 }
 
-void jump_to_token(Lexer* lexer, Token token) {
-    lexer->cache.memory = 0;
-    lexer->pointer = token.memory;
-    lexer->line = token.line;
-}
\ No newline at end of file
+internal char* skip_identifier(char* pointer, char* end) {
+#if defined(CHUNK_SIZE)
+    while (end - pointer >= CHUNK_SIZE) {
+        Chunk chunk = load_chunk(pointer);
+        u32 identifier = chunk_in_range(chunk_to_lower(chunk), 'a', 'z') | chunk_in_range(chunk, '0', '9') | chunk_equal(chunk, '_');
+        if (identifier != ALL_LANES) {
+            return pointer + count_trailing_zeros32(~identifier);
+        }
+        pointer += CHUNK_SIZE;
+    }
+#endif
+
+    while (pointer < end && (CLASS_OF(*pointer) & CHAR_IDENTIFIER)) {
+        ++pointer;
+    }
+
+    return pointer;
+}
+
+internal Token lex_fast(Lexer* lexer) {
+    char* end = lexer->end;
+    char* start = skip_whitespace(lexer->pointer, end, &lexer->line);
+
+    if (start == end) {
+        lexer->pointer = end;
+        return (Token) {
+            .kind = TOKEN_EOF,
+            .memory = end,
+            .line = lexer->line
+        };
+    }
+
+    char* pointer = start + 1;
+    int kind = (u8)*start < 128 ? *start : TOKEN_UNKNOWN;
+
+    u8 char_class = CLASS_OF(*start);
+
+    if (char_class & CHAR_DIGIT) {
+        pointer = skip_digits(pointer, end);
+        kind = TOKEN_INT_LITERAL;
+    }
+    else if (char_class & CHAR_IDENTIFIER) {
+        pointer = skip_identifier(pointer, end);
+        kind = keyword_kind(start, (int)(pointer-start));
+    }
+    else {
+        bool equal_follows = pointer < end && *pointer == '=';
+
+        switch (*start) {
+            case '<':
+                if (equal_follows) {
+                    ++pointer;
+                    kind = TOKEN_LESS_EQUAL;
+                }
+                break;
+            case '>':
+                if (equal_follows) {
+                    ++pointer;
+                    kind = TOKEN_GREATER_EQUAL;
+                }
+                break;
+            case '=':
+                if (equal_follows) {
+                    ++pointer;
+                    kind = TOKEN_EQUAL_EQUAL;
+                }
+                break;
+            case '!':
+                if (equal_follows) {
+                    ++pointer;
+                    kind = TOKEN_BANG_EQUAL;
+                }
+                break;
+        }
+    }
+
+    lexer->pointer = pointer;
+
+    return (Token) {
+        .kind = kind,
+        .memory = start,
+        .length = (int)(pointer-start),
+        .line = lexer->line
+    };
+}
+
+Token get_token(Lexer* lexer) {
+    return lexer->mode == LEXER_FAST ? lex_fast(lexer) : lex_reference(lexer);
+}
+
+TokenBuffer* tokenize(Arena* arena, Source* source, SymbolTable* symbols) {
+    assert(source->length < UINT32_MAX && "source too large");
+
+    TokenBuffer* tokens = arena_push_type(arena, TokenBuffer);
+
+    u32 token_capacity = (u32)(source->length / 4) + 16;
+    tokens->kinds = arena_push_array(arena, u8, token_capacity);
+    tokens->offsets = arena_push_array(arena, u32, token_capacity);
+    tokens->lengths = arena_push_array(arena, u32, token_capacity);
+    tokens->symbols = arena_push_array(arena, u32, token_capacity);
+
+    u32 line_capacity = (u32)(source->length / 32) + 16;
+    tokens->line_starts = arena_push_array(arena, u32, line_capacity);
+
+    Lexer lexer = init_lexer(source->memory, source->memory + source->length, LEXER_FAST);
+
+    for (;;) {
+        Token token = lex_fast(&lexer);
+
+        if (tokens->count == token_capacity) {
+            token_capacity *= 2;
+            tokens->kinds = arena_grow_array(arena, tokens->kinds, tokens->count, token_capacity);
+            tokens->offsets = arena_grow_array(arena, tokens->offsets, tokens->count, token_capacity);
+            tokens->lengths = arena_grow_array(arena, tokens->lengths, tokens->count, token_capacity);
+            tokens->symbols = arena_grow_array(arena, tokens->symbols, tokens->count, token_capacity);
+        }
+
+        while (tokens->line_count < (u32)token.line) {
+            if (tokens->line_count == line_capacity) {
+                line_capacity *= 2;
+                tokens->line_starts = arena_grow_array(arena, tokens->line_starts, tokens->line_count, line_capacity);
+            }
+            tokens->line_starts[tokens->line_count++] = tokens->count;
+        }
+
+        u32 index = tokens->count++;
+        tokens->kinds[index] = (u8)token.kind;
+        tokens->offsets[index] = (u32)(token.memory - source->memory);
+        tokens->lengths[index] = token.length;
+        tokens->symbols[index] = token.kind == TOKEN_IDENTIFIER ? intern(arena, symbols, token.memory, token.length) : 0;
+
+        if (token.kind == TOKEN_EOF) {
+            break;
+        }
+    }
+
+    return tokens;
+}
+
+int token_line(TokenBuffer* tokens, u32 index) {
+    // The line of a token is the number of lines starting at or before it.
+    u32 low = 0;
+    u32 high = tokens->line_count;
+
+    while (low < high) {
+        u32 middle = low + (high - low) / 2;
+        if (tokens->line_starts[middle] <= index) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return (int)low;
+}
+
+Token token_at(Source* source, TokenBuffer* tokens, u32 index) {
+    assert(index < tokens->count);
+
+    return (Token) {
+        .kind = tokens->kinds[index],
+        .memory = source->memory + tokens->offsets[index],
+        .length = tokens->lengths[index],
+        .line = token_line(tokens, index),
+        .symbol = tokens->symbols[index]
+    };
+}
@@ -2,15 +2,23 @@
 
 #include "types.h"
 
+typedef enum {
+    LEXER_FAST,
+    LEXER_REFERENCE,
+} LexerMode;
+
 typedef struct {
     char* pointer;
+    char* end;
     int line;
-    Token cache;
+    LexerMode mode;
 } Lexer;
 
-Lexer init_lexer(char* source);
+Lexer init_lexer(char* begin, char* end, LexerMode mode);
 
 Token get_token(Lexer* lexer);
-Token peek_token(Lexer* lexer);
 
-void jump_to_token(Lexer* lexer, Token token);
+TokenBuffer* tokenize(Arena* arena, Source* source, SymbolTable* symbols);
+
+Token token_at(Source* source, TokenBuffer* tokens, u32 index);
+int token_line(TokenBuffer* tokens, u32 index);
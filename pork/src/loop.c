@@ -0,0 +1,447 @@
+#include "loop.h"
+#include "bytecode.h"
+
+internal bool falls_through(Bytecode* bytecode, BasicBlock* block) {
+    if (block->end == block->start)
+        return true;
+
+    u8 op = bytecode->instructions[block->end - 1].op;
+    return op != OP_JMP && op != OP_CJMP && op != OP_RET;
+}
+
+LoopNest* analyze_loops(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+
+    LoopNest* nest = arena_push_type(arena, LoopNest);
+
+    u32* loop_of = arena_push_array(scratch.arena, u32, block_count);
+    for (u32 b = 0; b < block_count; ++b) {
+        loop_of[b] = UINT32_MAX;
+
+        for (u32 e = cfg->predecessor_offsets[b]; e < cfg->predecessor_offsets[b + 1]; ++e) {
+            if (cfg->predecessors[e] >= b && loop_of[b] == UINT32_MAX) {
+                loop_of[b] = nest->loop_count++;
+            }
+        }
+    }
+
+    u32 loop_count = nest->loop_count;
+    nest->headers = arena_push_array(arena, u32, loop_count);
+    nest->parents = arena_push_array(arena, u32, loop_count);
+    nest->preheaders = arena_push_array(arena, u32, loop_count);
+    nest->innermost = arena_push_array(arena, u32, block_count);
+
+    for (u32 b = 0; b < block_count; ++b) {
+        nest->innermost[b] = UINT32_MAX;
+        if (loop_of[b] != UINT32_MAX) {
+            nest->headers[loop_of[b]] = b;
+        }
+    }
+
+    // Inner loops have the larger headers, so going from the back each block is first
+    // reached by its innermost loop and each header by the loop right around it.
+    u32* marks = arena_push_array(scratch.arena, u32, block_count);
+    u32* body = arena_push_array(scratch.arena, u32, block_count);
+
+    for (u32 l = loop_count; l-- > 0;) {
+        nest->parents[l] = UINT32_MAX;
+
+        u32 body_count = find_loop_body(cfg, nest->headers[l], marks, l + 1, body);
+        for (u32 i = 0; i < body_count; ++i) {
+            u32 b = body[i];
+            if (nest->innermost[b] == UINT32_MAX) {
+                nest->innermost[b] = l;
+            }
+
+            u32 inner = loop_of[b];
+            if (i > 0 && inner != UINT32_MAX && nest->parents[inner] == UINT32_MAX) {
+                nest->parents[inner] = l;
+            }
+        }
+    }
+
+    // Numbered like the dominator tree, parents being before their children here too.
+    u32* sizes = arena_push_array(scratch.arena, u32, loop_count);
+    for (u32 l = loop_count; l-- > 0;) {
+        sizes[l] += 1;
+        if (nest->parents[l] != UINT32_MAX) {
+            sizes[nest->parents[l]] += sizes[l];
+        }
+    }
+
+    nest->preorder = arena_push_array(arena, u32, loop_count);
+    nest->subtree_ends = arena_push_array(arena, u32, loop_count);
+
+    u32* next_free = arena_push_array(scratch.arena, u32, loop_count);
+    u32 next_root = 0;
+
+    for (u32 l = 0; l < loop_count; ++l) {
+        u32 parent = nest->parents[l];
+        u32 number = parent == UINT32_MAX ? next_root : next_free[parent];
+
+        if (parent == UINT32_MAX) {
+            next_root += sizes[l];
+        }
+        else {
+            next_free[parent] += sizes[l];
+        }
+
+        next_free[l] = number + 1;
+        nest->preorder[l] = number;
+        nest->subtree_ends[l] = number + sizes[l];
+    }
+
+    for (u32 l = 0; l < loop_count; ++l) {
+        u32 header = nest->headers[l];
+        u32 entry = UINT32_MAX;
+        u32 entry_count = 0;
+
+        for (u32 e = cfg->predecessor_offsets[header]; e < cfg->predecessor_offsets[header + 1]; ++e) {
+            if (cfg->predecessors[e] < header) {
+                entry = cfg->predecessors[e];
+                ++entry_count;
+            }
+        }
+
+        bool is_preheader = entry_count == 1 && cfg->successor_offsets[entry + 1] - cfg->successor_offsets[entry] == 1;
+        is_preheader = is_preheader && cfg->blocks[entry].end == cfg->blocks[header].start && falls_through(bytecode, cfg->blocks + entry);
+        nest->preheaders[l] = is_preheader ? entry : UINT32_MAX;
+    }
+
+    release_scratch(&scratch);
+
+    return nest;
+}
+
+bool loop_contains(LoopNest* nest, u32 loop, u32 block) {
+    u32 inner = nest->innermost[block];
+    return inner != UINT32_MAX && nest->preorder[loop] <= nest->preorder[inner] && nest->preorder[inner] < nest->subtree_ends[loop];
+}
+
+bool insert_preheaders(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+    int length = bytecode->length;
+
+    LoopNest* nest = analyze_loops(scratch.arena, cfg, bytecode);
+
+    int* block_of = arena_push_array(scratch.arena, int, length);
+    for (int i = 0; i < length; ++i) {
+        block_of[i] = -1;
+    }
+
+    for (u32 b = 0; b < block_count; ++b) {
+        for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; ++i) {
+            block_of[i] = (int)b;
+        }
+    }
+
+    // Index among the new labels of the preheader before each header, or -1.
+    int* preheader_labels = arena_push_array(scratch.arena, int, length);
+    for (int i = 0; i < length; ++i) {
+        preheader_labels[i] = -1;
+    }
+
+    int added = 0;
+
+    for (u32 l = 0; l < nest->loop_count; ++l) {
+        u32 header = nest->headers[l];
+        int start = cfg->blocks[header].start;
+        if (nest->preheaders[l] != UINT32_MAX)
+            continue;
+
+        // Nothing from inside the loop may fall into the new block.
+        int before = start > 0 ? block_of[start - 1] : -1;
+        if (before != -1 && falls_through(bytecode, cfg->blocks + before) && loop_contains(nest, l, (u32)before))
+            continue;
+
+        preheader_labels[start] = added++;
+    }
+
+    if (!added) {
+        release_scratch(&scratch);
+        return false;
+    }
+
+    // The new labels go before the end label, which stays last.
+    int end_label = bytecode->label_count - 1;
+    int new_end_label = end_label + added;
+
+    for (u32 b = 0; b < block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+        if (block->start == block->end)
+            continue;
+
+        Instruction* ins = bytecode->instructions + block->end - 1;
+        u32* targets[2];
+        int target_count = 0;
+
+        if (ins->op == OP_JMP) {
+            targets[target_count++] = &ins->a1;
+        }
+        else if (ins->op == OP_CJMP) {
+            targets[target_count++] = &ins->a2;
+            targets[target_count++] = &ins->a3;
+        }
+
+        for (int t = 0; t < target_count; ++t) {
+            if ((int)*targets[t] == end_label) {
+                *targets[t] = (u32)new_end_label;
+                continue;
+            }
+
+            int location = bytecode->label_locations[*targets[t]];
+            int label = preheader_labels[location];
+            if (label != -1 && !loop_contains(nest, nest->innermost[block_of[location]], b)) {
+                *targets[t] = (u32)(end_label + label);
+            }
+        }
+    }
+
+    Instruction* instructions = arena_push_array(scratch.arena, Instruction, length);
+    int* labels = arena_push_array(scratch.arena, int, length);
+    int* lines = arena_push_array(scratch.arena, int, length);
+    memcpy(instructions, bytecode->instructions, length * sizeof(*instructions));
+    memcpy(labels, bytecode->labels, length * sizeof(*labels));
+    memcpy(lines, bytecode->lines, length * sizeof(*lines));
+
+    reserve_instructions(arena, bytecode, length + added);
+
+    bytecode->label_locations = arena_grow_array(arena, bytecode->label_locations, bytecode->label_count, new_end_label + 1);
+    bytecode->label_count = new_end_label + 1;
+
+    int out = 0;
+    for (int i = 0; i < length; ++i) {
+        if (preheader_labels[i] != -1) {
+            int label = end_label + preheader_labels[i];
+            bytecode->label_locations[label] = out;
+            bytecode->instructions[out] = (Instruction){ .op = OP_NOOP };
+            bytecode->labels[out] = label;
+            bytecode->lines[out] = lines[i];
+            ++out;
+        }
+
+        if (labels[i] != -1) {
+            bytecode->label_locations[labels[i]] = out;
+        }
+
+        bytecode->instructions[out] = instructions[i];
+        bytecode->labels[out] = labels[i];
+        bytecode->lines[out] = lines[i];
+        ++out;
+    }
+
+    bytecode->length = out;
+    bytecode->label_locations[new_end_label] = out;
+
+    release_scratch(&scratch);
+
+    // Every preheader falls into a header that was reachable, so analyzing control flow
+    // again reports nothing and needs no source.
+    ControlFlowGraph* rebuilt = analyze_control_flow(arena, 0, bytecode);
+    assert(rebuilt);
+    *cfg = *rebuilt;
+
+    return true;
+}
+
+// Whether an instruction computes the same value wherever it runs, and can run where
+// it would not have without faulting. Division only qualifies by a constant other than
+// zero.
+internal bool can_hoist(Bytecode* bytecode, Instruction* ins, Instruction** definitions) {
+    static_assert(NUM_OPS == 18, "not all ops handled");
+    switch (ins->op) {
+        default:
+            return false;
+
+        case OP_IMM:
+        case OP_COPY:
+        case OP_CAST:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_LESS:
+        case OP_LEQUAL:
+        case OP_EQUAL:
+        case OP_NEQUAL:
+            return true;
+
+        case OP_DIV: {
+            Instruction* divisor = definitions[ins->a3];
+            if (!divisor || divisor->op != OP_IMM)
+                return false;
+
+            return bytecode->constants[divisor->a2] != 0;
+        }
+    }
+}
+
+// Blocks are visited in reverse postorder, which is a preorder of the dominator tree, so
+// in SSA form every operand's definition has been seen, and placed, before it is used.
+// An instruction leaves a loop when none of its operands is defined in it, and then
+// tries the loop around it from the preheader it landed in. Instructions landing in the
+// same preheader keep their order.
+u32 hoist_loop_invariants(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, SSAForm* ssa) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+    int length = bytecode->length;
+    i64 register_count = bytecode->register_count;
+
+    LoopNest* nest = analyze_loops(scratch.arena, cfg, bytecode);
+    if (!nest->loop_count) {
+        release_scratch(&scratch);
+        return 0;
+    }
+
+    // The block each register is defined in once hoisting is done, UINT32_MAX for those
+    // never defined.
+    u32* homes = arena_push_array(scratch.arena, u32, register_count);
+    Instruction** definitions = arena_push_array(scratch.arena, Instruction*, register_count);
+    for (i64 i = 0; i < register_count; ++i) {
+        homes[i] = UINT32_MAX;
+    }
+
+    for (u32 b = 0; b < block_count; ++b) {
+        for (u32 p = ssa->phi_offsets[b]; p < ssa->phi_offsets[b + 1]; ++p) {
+            homes[ssa->phis[p].result] = b;
+        }
+
+        for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; ++i) {
+            Instruction* ins = bytecode->instructions + i;
+            u32* uses[2];
+            u32* defined;
+            get_operands(ins, uses, &defined);
+
+            if (defined) {
+                homes[*defined] = b;
+                definitions[*defined] = ins;
+            }
+        }
+    }
+
+    // The preheader each instruction moves to, UINT32_MAX for those staying.
+    u32* targets = arena_push_array(scratch.arena, u32, length);
+    for (int i = 0; i < length; ++i) {
+        targets[i] = UINT32_MAX;
+    }
+
+    // Moved instructions go at the end of their preheader, in compressed rows indexed by
+    // the instruction the preheader falls into.
+    u32* move_offsets = arena_push_array(scratch.arena, u32, length + 2);
+    u32 moved = 0;
+
+    for (u32 b = 0; b < block_count; ++b) {
+        if (nest->innermost[b] == UINT32_MAX)
+            continue;
+
+        for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; ++i) {
+            Instruction* ins = bytecode->instructions + i;
+            if (!can_hoist(bytecode, ins, definitions))
+                continue;
+
+            u32* uses[2];
+            u32* defined;
+            int use_count = get_operands(ins, uses, &defined);
+
+            u32 target = UINT32_MAX;
+
+            for (u32 l = nest->innermost[b]; l != UINT32_MAX && nest->preheaders[l] != UINT32_MAX; l = nest->parents[l]) {
+                bool invariant = true;
+                for (int u = 0; u < use_count; ++u) {
+                    u32 home = homes[*uses[u]];
+                    invariant &= home == UINT32_MAX || !loop_contains(nest, l, home);
+                }
+
+                if (!invariant)
+                    break;
+
+                target = nest->preheaders[l];
+            }
+
+            if (target != UINT32_MAX) {
+                targets[i] = target;
+                homes[*defined] = target;
+                ++move_offsets[cfg->blocks[target].end + 1];
+                ++moved;
+            }
+        }
+    }
+
+    if (!moved) {
+        release_scratch(&scratch);
+        return 0;
+    }
+
+    u32* cursors = arena_push_array(scratch.arena, u32, length + 1);
+    for (int i = 0; i <= length; ++i) {
+        move_offsets[i + 1] += move_offsets[i];
+        cursors[i] = move_offsets[i];
+    }
+
+    Instruction* moves = arena_push_array(scratch.arena, Instruction, moved);
+    int* move_lines = arena_push_array(scratch.arena, int, moved);
+
+    for (u32 b = 0; b < block_count; ++b) {
+        for (int i = cfg->blocks[b].start; i < cfg->blocks[b].end; ++i) {
+            if (targets[i] == UINT32_MAX)
+                continue;
+
+            u32 m = cursors[cfg->blocks[targets[i]].end]++;
+            moves[m] = bytecode->instructions[i];
+            move_lines[m] = bytecode->lines[i];
+            bytecode->instructions[i] = (Instruction){ .op = OP_NOOP };
+        }
+    }
+
+    Instruction* instructions = arena_push_array(scratch.arena, Instruction, length);
+    int* labels = arena_push_array(scratch.arena, int, length);
+    int* lines = arena_push_array(scratch.arena, int, length);
+    memcpy(instructions, bytecode->instructions, sizeof(Instruction) * length);
+    memcpy(labels, bytecode->labels, sizeof(int) * length);
+    memcpy(lines, bytecode->lines, sizeof(int) * length);
+
+    reserve_instructions(arena, bytecode, length + (int)moved);
+
+    // Where each instruction ends up, after the moves ahead of its label.
+    int* locations = arena_push_array(scratch.arena, int, length + 1);
+    int out = 0;
+
+    for (int i = 0; i <= length; ++i) {
+        for (u32 m = move_offsets[i]; m < move_offsets[i + 1]; ++m) {
+            bytecode->instructions[out] = moves[m];
+            bytecode->labels[out] = -1;
+            bytecode->lines[out] = move_lines[m];
+            ++out;
+        }
+
+        locations[i] = out;
+        if (i == length)
+            break;
+
+        bytecode->instructions[out] = instructions[i];
+        bytecode->labels[out] = labels[i];
+        bytecode->lines[out] = lines[i];
+        ++out;
+    }
+
+    bytecode->length = out;
+
+    for (int i = 0; i < bytecode->label_count; ++i) {
+        bytecode->label_locations[i] = locations[bytecode->label_locations[i]];
+    }
+
+    // Moves ahead of a label belong to the block before it, which is only empty for the
+    // entry.
+    for (u32 b = 0; b < block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+        int start = block->start;
+        int before = (int)(move_offsets[start + 1] - move_offsets[start]);
+        block->start = block->end > start ? locations[start] : locations[start] - before;
+        block->end = locations[block->end];
+    }
+
+    release_scratch(&scratch);
+
+    return moved;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+#include "ssa.h"
+
+// Natural loops, one per header with every back edge into it merged. Loops are numbered
+// by their headers, which dominate everything in them, so a loop comes after the loops
+// around it.
+typedef struct {
+    u32 loop_count;
+    u32* headers;
+    u32* parents;    // UINT32_MAX for outermost loops.
+    u32* preheaders; // The one block entering the loop from outside, UINT32_MAX when there is none.
+
+    u32* innermost; // Indexed by block, UINT32_MAX outside every loop.
+
+    // Numbers in a preorder walk of the nest. Loop a contains loop b exactly when
+    // preorder[a] <= preorder[b] < subtree_ends[a].
+    u32* preorder;
+    u32* subtree_ends;
+} LoopNest;
+
+// A preheader falls into the header and only into it, so code can be appended to it.
+LoopNest* analyze_loops(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode);
+bool loop_contains(LoopNest* nest, u32 loop, u32 block);
+
+// Gives every loop that has no preheader an OP_NOOP block right before its header, which
+// the jumps into the loop from outside are pointed at. Returns whether any was added, in
+// which case cfg is rebuilt.
+bool insert_preheaders(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode);
+
+// Moves instructions whose operands are all defined outside a loop into its preheader,
+// out of as many loops as allows. Instructions moved are left behind as OP_NOOPs for SSA
+// destruction to drop, so the blocks stay as they are. Returns the number moved.
+u32 hoist_loop_invariants(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, SSAForm* ssa);
@@ -1,81 +1,70 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "base.h"
-#include "parse.h"
-#include "bytecode.h"
-#include "set.h"
-#include "semantics.h"
+#include "bench.h"
+#include "compile.h"
 #include "vm.h"
 
-static Arena* scratch_arenas[2];
-
-Scratch get_scratch(Arena* conflict)
-{
-    for (int i = 0; i < LENGTH(scratch_arenas); ++i)
-    {
-        Arena* arena = scratch_arenas[i];
-        if (conflict != arena)
-        {
-            return (Scratch) {
-                .arena = arena,
-                .allocated = arena->allocated
-            };
-        }
+int main(int argument_count, char** arguments) {
+    if (argument_count > 1 && strcmp(arguments[1], "bench") == 0) {
+        return run_benchmarks(argument_count - 2, arguments + 2);
     }
 
-    assert(false);
-    return (Scratch){0};
-}
+    Arena* arena = new_arena(DEFAULT_ARENA_RESERVE, ARENA_HUGE_PAGES);
 
-void release_scratch(Scratch* scratch) {
-    assert(scratch->allocated <= scratch->arena->allocated);
-    scratch->arena->allocated = scratch->allocated;
-}
+    OptimizationLevel level = OPTIMIZE_FULL;
+    RegisterAllocator allocator = ALLOCATE_GRAPH_COLORING;
+    bool print_stats = false;
+    char* source_path = "examples/test.pork";
 
-int main() {
-    for (int i = 0; i < LENGTH(scratch_arenas); ++i) {
-        scratch_arenas[i] = new_arena(5 * 1024 * 1024);
+    for (int i = 1; i < argument_count; ++i) {
+        if (strcmp(arguments[i], "-O0") == 0) {
+            level = OPTIMIZE_NONE;
+        }
+        else if (strcmp(arguments[i], "-O1") == 0) {
+            level = OPTIMIZE_FULL;
+        }
+        else if (strcmp(arguments[i], "-O2") == 0) {
+            level = OPTIMIZE_SSA;
+        }
+        else if (strcmp(arguments[i], "-linear-scan") == 0) {
+            allocator = ALLOCATE_LINEAR_SCAN;
+        }
+        else if (strcmp(arguments[i], "-stats") == 0) {
+            print_stats = true;
+        }
+        else {
+            source_path = arguments[i];
+        }
     }
 
-    Arena* arena = new_arena(5 * 1024 * 1024);
-
-    char* source_path = "examples/test.pork";
-
-    FILE* file;
-    if(fopen_s(&file, source_path, "r")) {
+    MappedFile file;
+    if (!map_file(source_path, &file)) {
         printf("Failed to open '%s'\n", source_path);
         return 1;
     }
 
-    fseek(file, 0, SEEK_END);
-    size_t file_length = ftell(file);
-    rewind(file);
-
-    char* source = arena_push(arena, file_length + 1);
-    size_t source_length = fread(source, 1, file_length, file);
-    source[source_length] = '\0';
-
-    Program program = {0};
-    init_program(&program);
-
-    ASTFunction* ast_function = parse(arena, source, &program);
-    if (!ast_function)
-        return 1;
+    Source source = {
+        .memory = file.memory,
+        .length = file.size
+    };
 
-    if (!analyze_semantics(arena, source, &program, ast_function))
+    CompileStats stats = {0};
+    Bytecode* bytecode = compile(arena, &source, level, allocator, print_stats ? &stats : 0);
+    if (!bytecode)
         return 1;
 
-    Bytecode* bytecode = generate_bytecode(arena, ast_function);
-
-    BasicBlock* cfg = analyze_control_flow(arena, source, bytecode);
-    if (!cfg) return 1;
-
-    analyze_data_flow(cfg, bytecode);
-
-    allocate_registers(cfg, bytecode, 8);
+    if (print_stats) {
+        print_compile_stats(&stats);
+        print_arena_usage("arena", arena);
+        print_scratch_usage();
+    }
 
     i64 result = vm_execute(bytecode);
     printf("Result: %lld\n", result);
 
+    unmap_file(&file);
+
     return 1;
 }
\ No newline at end of file
@@ -6,63 +6,151 @@
 #include "error.h"
 
 typedef struct {
-    char* source;
+    u32 token;
+    u8 kind;
+    u8 precedence;
+} PendingOperator;
+
+typedef enum {
+    FRAME_BLOCK,
+    FRAME_IF,
+    FRAME_WHILE,
+} FrameKind;
+
+// A block, if or while whose closing '}' has not been reached yet.
+typedef struct {
+    FrameKind kind;
+    u32 token;
+
+    union {
+        struct { // Blocks.
+            u32 first;
+            u32 last;
+        };
+
+        struct { // Ifs and whiles.
+            u32 condition;
+            u32 block_then;
+        };
+    };
+} Frame;
+
+typedef struct {
+    Source* source;
     Arena* arena;
-    Lexer* lexer;
+    Arena* scratch;
+    TokenBuffer* tokens;
+    u32 cursor;
+    AST* ast;
     Program* program;
-} Parser; 
 
-ASTNode* new_ast_node(Arena* arena, ASTKind kind, Token token) {
-    ASTNode* node = arena_push_type(arena, ASTNode);
-    node->kind = kind;
-    node->token = token;
+    u32* operands;
+    u32 operand_count;
+    u32 operand_capacity;
+
+    PendingOperator* operators;
+    u32 operator_count;
+    u32 operator_capacity;
+
+    Frame* frames;
+    u32 frame_count;
+    u32 frame_capacity;
+} Parser;
+
+u32 new_ast_node(Arena* arena, AST* ast, ASTKind kind, u32 token) {
+    if (ast->count == ast->capacity) {
+        u32 capacity = ast->capacity ? ast->capacity * 2 : 256;
+        ast->kinds = arena_grow_array(arena, ast->kinds, ast->count, capacity);
+        ast->tokens = arena_grow_array(arena, ast->tokens, ast->count, capacity);
+        ast->types = arena_grow_array(arena, ast->types, ast->count, capacity);
+        ast->nexts = arena_grow_array(arena, ast->nexts, ast->count, capacity);
+        ast->a1 = arena_grow_array(arena, ast->a1, ast->count, capacity);
+        ast->a2 = arena_grow_array(arena, ast->a2, ast->count, capacity);
+        ast->a3 = arena_grow_array(arena, ast->a3, ast->count, capacity);
+        ast->capacity = capacity;
+
+        if (ast->count == 0) {
+            ++ast->count; // Reserve the null node.
+        }
+    }
+
+    u32 node = ast->count++;
+    ast->kinds[node] = (u8)kind;
+    ast->tokens[node] = token;
+    ast->types[node] = 0;
+    ast->nexts[node] = 0;
+    ast->a1[node] = 0;
+    ast->a2[node] = 0;
+    ast->a3[node] = 0;
+
+    return node;
+}
+
+u32 new_ast_literal(Arena* arena, AST* ast, u32 token, u64 value) {
+    if (ast->literal_count == ast->literal_capacity) {
+        u32 capacity = ast->literal_capacity ? ast->literal_capacity * 2 : 64;
+        ast->literals = arena_grow_array(arena, ast->literals, ast->literal_count, capacity);
+        ast->literal_capacity = capacity;
+    }
+
+    u32 node = new_ast_node(arena, ast, AST_INT_LITERAL, token);
+    ast->a1[node] = ast->literal_count;
+    ast->literals[ast->literal_count++] = value;
+
     return node;
 }
 
-internal ASTNode* new_node(Parser* parser, ASTKind kind, Token token) {
-    return new_ast_node(parser->arena, kind, token);
+internal u32 new_node(Parser* parser, ASTKind kind, u32 token) {
+    return new_ast_node(parser->arena, parser->ast, kind, token);
 }
 
-internal bool match(Parser* parser, int kind, char* description) {
-    Token token = peek_token(parser->lexer);
+internal int peek_kind(Parser* parser) {
+    return parser->tokens->kinds[parser->cursor];
+}
+
+internal Token peek_token(Parser* parser) {
+    return token_at(parser->source, parser->tokens, parser->cursor);
+}
 
-    if (token.kind == kind) {
-        get_token(parser->lexer);
+internal u32 next_token(Parser* parser) {
+    u32 token = parser->cursor;
+    if (peek_kind(parser) != TOKEN_EOF) {
+        ++parser->cursor;
+    }
+    return token;
+}
+
+internal bool match(Parser* parser, int kind, char* description) {
+    if (peek_kind(parser) == kind) {
+        next_token(parser);
         return true;
     }
 
-    error_at_token(parser->source, token, "expected %s", description);
+    error_at_token(parser->source, peek_token(parser), "expected %s", description);
     return false;
 }
 
 #define CONSUME(kind, description) if (!match(parser, kind, description)) { return 0; }
 
-internal ASTNode* parse_primary(Parser* parser)
+internal u32 parse_primary(Parser* parser)
 {
-    Token token = peek_token(parser->lexer);
-    switch (token.kind)
+    switch (peek_kind(parser))
     {
         case TOKEN_INT_LITERAL: {
-            get_token(parser->lexer);
-            ASTNode* node = new_node(parser, AST_INT_LITERAL, token);
-            node->int_literal = strtoull(token.memory, 0, 10);
-            return node;
+            Token token = peek_token(parser);
+            return new_ast_literal(parser->arena, parser->ast, next_token(parser), strtoull(token.memory, 0, 10));
         }
 
-        case TOKEN_IDENTIFIER: {
-            get_token(parser->lexer);
-            ASTNode* node = new_node(parser, AST_VARIABLE, token);
-            node->name = token;
-            return node;
-        }
+        case TOKEN_IDENTIFIER:
+            return new_node(parser, AST_VARIABLE, next_token(parser));
     }
 
-    error_at_token(parser->source, token, "expected an expression");
+    error_at_token(parser->source, peek_token(parser), "expected an expression");
     return 0;
 }
 
-internal int binary_precedence(Token op) {
-    switch (op.kind) {
+internal int operator_precedence(int kind) {
+    switch (kind) {
         default:
             return 0;
         case '*':
@@ -79,11 +167,13 @@ internal int binary_precedence(Token op) {
         case TOKEN_EQUAL_EQUAL:
         case TOKEN_BANG_EQUAL:
             return 5;
+        case '=':
+            return 1;
     }
 }
 
-internal ASTKind binary_ast_kind(Token op, bool* swap) {
-    switch (op.kind) {
+internal ASTKind operator_ast_kind(int kind, bool* swap) {
+    switch (kind) {
         default:
             assert(false);
             return 0;
@@ -109,90 +199,88 @@ internal ASTKind binary_ast_kind(Token op, bool* swap) {
             return AST_EQUAL;
         case TOKEN_BANG_EQUAL:
             return AST_NEQUAL;
+        case '=':
+            return AST_ASSIGN;
     }
 }
 
-internal ASTNode* parse_binary(Parser* parser, int caller_precedence) {
-    ASTNode* left = parse_primary(parser);
-    if (!left) return 0;
-
-    while (binary_precedence(peek_token(parser->lexer)) > caller_precedence) {
-        Token op = get_token(parser->lexer);
-        
-        ASTNode* right = parse_binary(parser, binary_precedence(op));
-        if (!right) return 0;
-
-        bool swap = false;
-        ASTNode* binary = new_node(parser, binary_ast_kind(op, &swap), op);
-        binary->left = swap ? right : left;
-        binary->right = swap ? left : right;
-
-        left = binary;
+internal void push_operand(Parser* parser, u32 node) {
+    if (parser->operand_count == parser->operand_capacity) {
+        u32 capacity = parser->operand_capacity ? parser->operand_capacity * 2 : 64;
+        parser->operands = arena_grow_array(parser->scratch, parser->operands, parser->operand_count, capacity);
+        parser->operand_capacity = capacity;
     }
 
-    return left;
+    parser->operands[parser->operand_count++] = node;
 }
 
-internal ASTNode* parse_assign(Parser* parser) {
-    ASTNode* left = parse_binary(parser, 0);
-    if (!left) return 0;
-
-    if (peek_token(parser->lexer).kind == '=') {
-        Token equal_token = get_token(parser->lexer);
-
-        ASTNode* right = parse_assign(parser);
-        if (!right) return 0;
-
-        ASTNode* assign = new_node(parser, AST_ASSIGN, equal_token);
-        assign->left = left;
-        assign->right = right;
-
-        left = assign;
+internal void push_operator(Parser* parser, u32 token, int kind) {
+    if (parser->operator_count == parser->operator_capacity) {
+        u32 capacity = parser->operator_capacity ? parser->operator_capacity * 2 : 64;
+        parser->operators = arena_grow_array(parser->scratch, parser->operators, parser->operator_count, capacity);
+        parser->operator_capacity = capacity;
     }
 
-    return left;
-}
-
-internal ASTNode* parse_expression(Parser* parser) {
-    return parse_assign(parser);
+    parser->operators[parser->operator_count++] = (PendingOperator){
+        .token = token,
+        .kind = kind,
+        .precedence = operator_precedence(kind)
+    };
 }
 
-internal ASTNode* parse_statement(Parser* parser);
+// Pops the topmost operator and its two operands and pushes the combined node.
+internal void reduce_operator(Parser* parser) {
+    assert(parser->operator_count && parser->operand_count >= 2);
 
-internal ASTNode* parse_block(Parser* parser) {
-    Token lbrace_token = peek_token(parser->lexer);
-    CONSUME('{', "{");
+    PendingOperator op = parser->operators[--parser->operator_count];
+    u32 right = parser->operands[--parser->operand_count];
+    u32 left = parser->operands[--parser->operand_count];
 
-    ASTNode head = {0};
-    ASTNode* cur = &head;
+    bool swap = false;
+    u32 node = new_node(parser, operator_ast_kind(op.kind, &swap), op.token);
+    parser->ast->a1[node] = swap ? right : left;
+    parser->ast->a2[node] = swap ? left : right;
 
-    while (peek_token(parser->lexer).kind != '}' && peek_token(parser->lexer).kind != TOKEN_EOF) {
-        ASTNode* statement = parse_statement(parser);
-        if (!statement) return 0;
+    parser->operands[parser->operand_count++] = node;
+}
 
-        cur->next = statement;
-        while (cur->next) {
-            cur = cur->next;
+// Operator precedence parsing over explicit operand and operator stacks, so that
+// arbitrarily long operator chains do not consume any native stack.
+internal u32 parse_expression(Parser* parser) {
+    parser->operand_count = 0;
+    parser->operator_count = 0;
+
+    for (;;) {
+        u32 operand = parse_primary(parser);
+        if (!operand) return 0;
+        push_operand(parser, operand);
+
+        int kind = peek_kind(parser);
+        int precedence = operator_precedence(kind);
+        if (!precedence) break;
+
+        // Binary operators are left-associative, assignment is right-associative.
+        while (parser->operator_count) {
+            PendingOperator* top = parser->operators + parser->operator_count - 1;
+            if (top->precedence < precedence || (top->precedence == precedence && kind == '=')) break;
+            reduce_operator(parser);
         }
-    }
 
-    CONSUME('}', "}");
-    ASTNode* block = new_node(parser, AST_BLOCK, lbrace_token);
-    block->first = head.next;
+        push_operator(parser, next_token(parser), kind);
+    }
 
-    return block;
-}
+    while (parser->operator_count) {
+        reduce_operator(parser);
+    }
 
-/*
-internal bool token_is(Token token, char* string) {
-    return token.length == strlen(string) && memcmp(token.memory, string, token.length) == 0;
+    assert(parser->operand_count == 1);
+    return parser->operands[0];
 }
-*/
 
-internal Type* find_type(Parser* parser, Token type_name) {
+internal Type* find_type(Parser* parser, int kind) {
     assert(parser->program->type_void && "program structure not initialized");
 
-    switch (type_name.kind) {
+    switch (kind) {
         case TOKEN_U64:
             return parser->program->type_u64;
         case TOKEN_U32:
@@ -212,31 +300,75 @@ internal Type* find_type(Parser* parser, Token type_name) {
             return parser->program->type_i8;
     }
 
-    error_at_token(parser->source, type_name, "unrecognized type");
+    error_at_token(parser->source, peek_token(parser), "unrecognized type");
     return parser->program->type_void;
 }
 
-internal ASTNode* parse_statement(Parser* parser) {
-    Token token = peek_token(parser->lexer);
+internal Frame* push_frame(Parser* parser, FrameKind kind, u32 token) {
+    if (parser->frame_count == parser->frame_capacity) {
+        u32 capacity = parser->frame_capacity ? parser->frame_capacity * 2 : 64;
+        parser->frames = arena_grow_array(parser->scratch, parser->frames, parser->frame_count, capacity);
+        parser->frame_capacity = capacity;
+    }
+
+    Frame* frame = parser->frames + parser->frame_count++;
+    *frame = (Frame){
+        .kind = kind,
+        .token = token
+    };
+
+    return frame;
+}
+
+internal Frame* top_frame(Parser* parser) {
+    assert(parser->frame_count);
+    return parser->frames + parser->frame_count - 1;
+}
+
+internal bool open_block(Parser* parser) {
+    u32 lbrace_token = parser->cursor;
+    CONSUME('{', "{");
+    push_frame(parser, FRAME_BLOCK, lbrace_token);
+    return true;
+}
+
+internal void append_statement(Parser* parser, u32 statement) {
+    AST* ast = parser->ast;
+    Frame* block = top_frame(parser);
+    assert(block->kind == FRAME_BLOCK);
+
+    if (block->last) {
+        ast->nexts[block->last] = statement;
+    }
+    else {
+        block->first = statement;
+    }
+
+    block->last = statement;
+    while (ast->nexts[block->last]) {
+        block->last = ast->nexts[block->last];
+    }
+}
+
+internal u32 parse_simple_statement(Parser* parser) {
+    AST* ast = parser->ast;
+    int kind = peek_kind(parser);
 
-    switch (token.kind) {
+    switch (kind) {
         default: {
-            ASTNode* expression = parse_expression(parser);
+            u32 expression = parse_expression(parser);
             if (!expression) return 0;
             CONSUME(';', ";");
             return expression;
-        } 
-
-        case '{':
-            return parse_block(parser);
+        }
 
         case TOKEN_RETURN: {
-            get_token(parser->lexer);
-            ASTNode* expression = parse_expression(parser);
+            u32 token = next_token(parser);
+            u32 expression = parse_expression(parser);
             if (!expression) return 0;
             CONSUME(';', ";");
-            ASTNode* ret = new_node(parser, AST_RETURN, token);
-            ret->expression = expression;
+            u32 ret = new_node(parser, AST_RETURN, token);
+            ast->a1[ret] = expression;
             return ret;
         }
 
@@ -249,84 +381,143 @@ internal ASTNode* parse_statement(Parser* parser) {
         case TOKEN_I16:
         case TOKEN_I8:
         {
-            get_token(parser->lexer);
-            Token name = peek_token(parser->lexer);
+            Type* type = find_type(parser, kind);
+            u32 token = next_token(parser);
+            u32 name = parser->cursor;
             CONSUME(TOKEN_IDENTIFIER, "an identifier");
 
-            ASTNode* assign = 0;
-            if (peek_token(parser->lexer).kind == '=') {
-                jump_to_token(parser->lexer, name);
-                assign = parse_assign(parser);
+            u32 assign = 0;
+            if (peek_kind(parser) == '=') {
+                parser->cursor = name;
+                assign = parse_expression(parser);
                 if (!assign) return 0;
             }
 
             CONSUME(';', ";");
-            
-            ASTNode* decl = new_node(parser, AST_VARIABLE_DECL, token);
-            decl->name = name;
-            decl->next = assign;
-            decl->type = find_type(parser, token);
+
+            u32 decl = new_node(parser, AST_VARIABLE_DECL, token);
+            ast->nexts[decl] = assign;
+            ast->types[decl] = type;
+            ++ast->variable_count;
 
             return decl;
         }
+    }
+}
 
-        case TOKEN_IF: {
-            get_token(parser->lexer);
+// Parses a block and everything nested in it. Blocks, ifs and whiles that are still
+// open are kept on an explicit frame stack instead of the native one.
+internal u32 parse_block(Parser* parser) {
+    AST* ast = parser->ast;
+    u32 base = parser->frame_count;
 
-            ASTNode* condition = parse_expression(parser);
-            if (!condition) return 0;
+    if (!open_block(parser)) return 0;
 
-            ASTNode* block_then = parse_block(parser);
-            if (!block_then) return 0;
+    for (;;) {
+        int kind = peek_kind(parser);
 
-            ASTNode* block_else = 0;
-            if (peek_token(parser->lexer).kind == TOKEN_ELSE) {
-                get_token(parser->lexer);
-                block_else = parse_block(parser);
-                if (!block_else) return 0;
+        switch (kind) {
+            default: {
+                u32 statement = parse_simple_statement(parser);
+                if (!statement) return 0;
+                append_statement(parser, statement);
+                break;
             }
 
-            ASTNode* if_statement = new_node(parser, AST_IF, token);
-            if_statement->conditional.condition = condition;
-            if_statement->conditional.block_then = block_then;
-            if_statement->conditional.block_else = block_else;
-
-            return if_statement;
-        }
+            case '{':
+                if (!open_block(parser)) return 0;
+                break;
 
-        case TOKEN_WHILE: {
-            get_token(parser->lexer);
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            {
+                u32 token = next_token(parser);
 
-            ASTNode* condition = parse_expression(parser);
-            if (!condition) return 0;
+                u32 condition = parse_expression(parser);
+                if (!condition) return 0;
 
-            ASTNode* body = parse_block(parser);
-            if (!body) return 0;
+                Frame* frame = push_frame(parser, kind == TOKEN_IF ? FRAME_IF : FRAME_WHILE, token);
+                frame->condition = condition;
 
-            ASTNode* while_statement = new_node(parser, AST_WHILE, token);
-            while_statement->conditional.condition = condition;
-            while_statement->conditional.block_then = body;
+                if (!open_block(parser)) return 0;
+                break;
+            }
 
-            return while_statement;
+            case '}':
+            case TOKEN_EOF:
+            {
+                CONSUME('}', "}");
+
+                Frame* frame = top_frame(parser);
+                assert(frame->kind == FRAME_BLOCK);
+
+                u32 statement = new_node(parser, AST_BLOCK, frame->token);
+                ast->a1[statement] = frame->first;
+                --parser->frame_count;
+
+                if (parser->frame_count == base) {
+                    return statement;
+                }
+
+                // Hand the finished block to the construct that opened it.
+                frame = top_frame(parser);
+
+                if (frame->kind == FRAME_IF && !frame->block_then) {
+                    frame->block_then = statement;
+
+                    if (peek_kind(parser) == TOKEN_ELSE) {
+                        next_token(parser);
+                        if (!open_block(parser)) return 0;
+                        break;
+                    }
+
+                    statement = 0;
+                }
+
+                if (frame->kind == FRAME_IF) {
+                    u32 if_statement = new_node(parser, AST_IF, frame->token);
+                    ast->a1[if_statement] = frame->condition;
+                    ast->a2[if_statement] = frame->block_then;
+                    ast->a3[if_statement] = statement;
+
+                    statement = if_statement;
+                    --parser->frame_count;
+                }
+                else if (frame->kind == FRAME_WHILE) {
+                    u32 while_statement = new_node(parser, AST_WHILE, frame->token);
+                    ast->a1[while_statement] = frame->condition;
+                    ast->a2[while_statement] = statement;
+
+                    statement = while_statement;
+                    --parser->frame_count;
+                }
+
+                append_statement(parser, statement);
+                break;
+            }
         }
     }
 }
 
-ASTFunction* parse(Arena* arena, char* source, Program* program) {
-    Lexer lexer = init_lexer(source);
+ASTFunction* parse(Arena* arena, Source* source, Program* program) {
+    ASTFunction* function = arena_push_type(arena, ASTFunction);
+    function->tokens = tokenize(arena, source, &program->symbols);
+
+    Scratch scratch = get_scratch(arena);
 
     Parser parser = {
         .source = source,
         .arena = arena,
-        .lexer = &lexer,
+        .scratch = scratch.arena,
+        .tokens = function->tokens,
+        .ast = &function->ast,
         .program = program
     };
 
-    ASTNode* body = parse_block(&parser);
-    if (!body) return 0;
+    function->body = parse_block(&parser);
+    release_scratch(&scratch);
 
-    ASTFunction* function = arena_push_type(arena, ASTFunction);
-    function->body = body;
+    if (!function->body) return 0;
 
     return function;
 }
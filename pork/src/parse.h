@@ -2,4 +2,4 @@
 
 #include "types.h"
 
-ASTFunction* parse(Arena* arena, char* source, Program* program);
+ASTFunction* parse(Arena* arena, Source* source, Program* program);
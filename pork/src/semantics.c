@@ -1,16 +1,19 @@
 #include "semantics.h"
 #include "error.h"
+#include "lexer.h"
 
 internal Type* new_type(Program* program, u64 size, OpType op_type) {
-    assert(program->type_count < MAX_TYPE_COUNT);
-    Type* type = program->types + (program->type_count++);
+    Type* type = arena_push_type(program->arena, Type);
+    ++program->type_count;
     type->op_type = op_type;
     type->size = size;
     return type;
 }
 
-void init_program(Program* program)
+void init_program(Arena* arena, Program* program)
 {
+    program->arena = arena;
+
     program->type_void = new_type(program, 0, OP_TYPE_NONE);
     program->type_integer_literal = new_type(program, 0, OP_I64);
 
@@ -86,86 +89,147 @@ Type* get_unsigned_integral_type(Program* program, Type* type) {
     return false;
 }
 
-typedef struct Scope Scope;
-struct Scope {
-    Scope* parent;
+typedef struct {
     Variable* variables;
-};
+} Scope;
 
-internal Variable* find_variable(Scope* scope, Token name) {
-    for (Variable* v = scope->variables; v; v = v->next) {
-        if (v->name.length == name.length && memcmp(v->name.memory, name.memory, name.length) == 0) {
-            return v;
-        }
-    }
-
-    if (scope->parent) {
-        return find_variable(scope->parent, name);
-    }
+typedef enum {
+    WORK_VISIT,
+    WORK_STATEMENTS, // Visit the node, then the statements following it.
+    WORK_FINISH,
+} WorkStage;
 
-    return 0;
-}
+typedef struct {
+    u32 node;
+    WorkStage stage;
+} Work;
 
 typedef struct {
     Arena* arena;
-    char* source;
+    Arena* scratch;
+    Source* source;
     Program* program;
     ASTFunction* ast_function;
+    AST* ast;
+
+    Work* work;
+    u32 work_count;
+    u32 work_capacity;
+
+    Scope* scopes;
+    u32 scope_count;
+    u32 scope_capacity;
+
+    // Innermost visible declaration of each symbol, indexed by symbol id.
+    Variable** bindings;
+    u32 variable_count;
 } Analyzer;
 
-internal ASTNode* clone_node(Arena* arena, ASTNode* node) {
-    ASTNode* clone = arena_push_type(arena, ASTNode);
-    memcpy(clone, node, sizeof(*node));
+internal Variable* find_variable(Analyzer* analyzer, u32 symbol) {
+    return analyzer->bindings[symbol];
+}
+
+internal void declare_variable(Analyzer* analyzer, Scope* scope, Variable* variable) {
+    variable->shadowed = analyzer->bindings[variable->symbol];
+    analyzer->bindings[variable->symbol] = variable;
+
+    variable->next = scope->variables;
+    scope->variables = variable;
+}
+
+internal void close_scope(Analyzer* analyzer, Scope* scope) {
+    for (Variable* v = scope->variables; v; v = v->next) {
+        analyzer->bindings[v->symbol] = v->shadowed;
+    }
+}
+
+internal Token node_token(Analyzer* analyzer, u32 node) {
+    return token_at(analyzer->source, analyzer->ast_function->tokens, analyzer->ast->tokens[node]);
+}
+
+internal u32 clone_node(Analyzer* analyzer, u32 node) {
+    AST* ast = analyzer->ast;
+
+    u32 clone = new_ast_node(analyzer->arena, ast, ast->kinds[node], ast->tokens[node]);
+    ast->types[clone] = ast->types[node];
+    ast->a1[clone] = ast->a1[node];
+    ast->a2[clone] = ast->a2[node];
+    ast->a3[clone] = ast->a3[node];
+
     return clone;
 }
 
-internal void set_subtree_integer_type(ASTNode* node, Type* type) {
-    node->type = type;
-
-    static_assert(NUM_AST_KINDS == 18, "not all ast kinds handled");
-    switch (node->kind) {
-        default:
-            assert(false);
-            break;
-
-        case AST_INT_LITERAL:
-            break;
-
-        case AST_VARIABLE: // These nodes should not appear in an integer-literal-typed sub-tree.
-        case AST_CAST:
-        case AST_ASSIGN:
-        case AST_BLOCK:
-        case AST_RETURN:
-        case AST_VARIABLE_DECL:
-        case AST_IF:
-        case AST_WHILE:
-            assert(false);
-            break;
-
-        case AST_ADD:
-        case AST_SUB:
-        case AST_MUL:
-        case AST_DIV:
-        case AST_LESS:
-        case AST_LEQUAL:
-        case AST_EQUAL:
-        case AST_NEQUAL:
-            set_subtree_integer_type(node->left, type);
-            set_subtree_integer_type(node->right, type);
-            break;
+internal void set_subtree_integer_type(Analyzer* analyzer, u32 root, Type* type) {
+    AST* ast = analyzer->ast;
+
+    Scratch scratch = get_scratch(analyzer->arena);
+    u32* stack = 0;
+    u32 count = 0;
+    u32 capacity = 0;
+
+    u32 node = root;
+    for (;;) {
+        ast->types[node] = type;
+
+        static_assert(NUM_AST_KINDS == 18, "not all ast kinds handled");
+        switch (ast->kinds[node]) {
+            default:
+                assert(false);
+                break;
+
+            case AST_INT_LITERAL:
+                break;
+
+            case AST_VARIABLE: // These nodes should not appear in an integer-literal-typed sub-tree.
+            case AST_CAST:
+            case AST_ASSIGN:
+            case AST_BLOCK:
+            case AST_RETURN:
+            case AST_VARIABLE_DECL:
+            case AST_IF:
+            case AST_WHILE:
+                assert(false);
+                break;
+
+            case AST_ADD:
+            case AST_SUB:
+            case AST_MUL:
+            case AST_DIV:
+            case AST_LESS:
+            case AST_LEQUAL:
+            case AST_EQUAL:
+            case AST_NEQUAL:
+                if (count == capacity) {
+                    capacity = capacity ? capacity * 2 : 64;
+                    stack = arena_grow_array(scratch.arena, stack, count, capacity);
+                }
+
+                stack[count++] = ast->a2[node];
+                node = ast->a1[node];
+                continue;
+        }
+
+        if (!count) break;
+        node = stack[--count];
     }
+
+    release_scratch(&scratch);
 }
 
-internal void implicit_cast(Analyzer* analyzer, ASTNode* node, Type* type) {
-    if (node->type != type) {
-        if (node->type == analyzer->program->type_integer_literal) {
-            set_subtree_integer_type(node, type);
+internal void implicit_cast(Analyzer* analyzer, u32 node, Type* type) {
+    AST* ast = analyzer->ast;
+
+    if (ast->types[node] != type) {
+        if (ast->types[node] == analyzer->program->type_integer_literal) {
+            set_subtree_integer_type(analyzer, node, type);
         }
         else {
-            ASTNode* clone = clone_node(analyzer->arena, node);
-            node->kind = AST_CAST;
-            node->type = type;
-            node->expression = clone;
+            u32 clone = clone_node(analyzer, node);
+            ast->kinds[node] = AST_CAST;
+            ast->types[node] = type;
+            ast->a1[node] = clone;
+            ast->a2[node] = 0;
+            ast->a3[node] = 0;
         }
     }
 }
@@ -176,199 +240,306 @@ internal bool can_coerce_type(Program* program, Type* type, Type* wanted_type) {
     return both_integral_and_wanted_is_larger || wanted_integral_and_type_integer_literal;
 }
 
-internal bool process_ast(Analyzer* analyzer, Scope* scope, ASTNode* node) {
+internal bool resolve_variable(Analyzer* analyzer, u32 node) {
     Program* program = analyzer->program;
+    AST* ast = analyzer->ast;
 
-    static_assert(NUM_AST_KINDS == 18, "not all ast kinds handled");
-    switch (node->kind) {
-        default:
-            assert(false);
-            return false;
+    u32 symbol = analyzer->ast_function->tokens->symbols[ast->tokens[node]];
+    Variable* variable = find_variable(analyzer, symbol);
 
-        case AST_INT_LITERAL:
-            node->type = program->type_integer_literal;
-            return true;
+    if (!variable) {
+        error_at_token(analyzer->source, node_token(analyzer, node), "undefined variable");
+        ast->types[node] = program->type_void;
+        return false;
+    }
 
-        case AST_VARIABLE: {
-            Variable* variable = find_variable(scope, node->name);
+    ast->a1[node] = (u32)(variable - ast->variables);
+    ast->types[node] = variable->type;
 
-            if (!variable) {
-                error_at_token(analyzer->source, node->token, "undefined variable");
-                node->type = program->type_void;
-                return false;
-            }
+    return true;
+}
 
-            node->variable = variable;
-            node->type = variable->type;
-            
-            return true;
-        }
+internal bool process_binary(Analyzer* analyzer, u32 node) {
+    Program* program = analyzer->program;
+    AST* ast = analyzer->ast;
 
-        case AST_CAST:
-            return process_ast(analyzer, scope, node->expression);
-
-        case AST_ADD:
-        case AST_SUB:
-        case AST_MUL:
-        case AST_DIV:
-        case AST_LESS:
-        case AST_LEQUAL:
-        case AST_EQUAL:
-        case AST_NEQUAL:
-        {
-            bool success = true;
-
-            success &= process_ast(analyzer, scope, node->left);
-            success &= process_ast(analyzer, scope, node->right);
-
-            if (node->left->type == node->right->type) {
-                node->type = node->left->type;
-            }
-            else {
-                bool left_is_integral = type_is_integral(program, node->left->type);
-                bool right_is_integral = type_is_integral(program, node->right->type);
+    u32 left = ast->a1[node];
+    u32 right = ast->a2[node];
 
-                if (left_is_integral && right_is_integral) // Implicitly cast the nodes to a common type.
-                {
-                    bool left_is_signed = type_is_signed_integral(program, node->left->type);
-                    bool right_is_signed = type_is_signed_integral(program, node->right->type);
+    if (ast->types[left] == ast->types[right]) {
+        ast->types[node] = ast->types[left];
+        return true;
+    }
 
-                    bool casted_type_is_signed = left_is_signed || right_is_signed;
-                    Type* casted_type = node->left->type->size > node->right->type->size ? node->left->type : node->right->type;
-                    casted_type = casted_type_is_signed ? get_signed_integral_type(program, casted_type) : get_unsigned_integral_type(program, casted_type);
+    bool left_is_integral = type_is_integral(program, ast->types[left]);
+    bool right_is_integral = type_is_integral(program, ast->types[right]);
 
-                    implicit_cast(analyzer, node->left, casted_type);
-                    implicit_cast(analyzer, node->right, casted_type);
+    if (left_is_integral && right_is_integral) // Implicitly cast the nodes to a common type.
+    {
+        bool left_is_signed = type_is_signed_integral(program, ast->types[left]);
+        bool right_is_signed = type_is_signed_integral(program, ast->types[right]);
 
-                    node->type = casted_type;
-                }
-                else if(left_is_integral && node->right->type == program->type_integer_literal) {
-                    set_subtree_integer_type(node->right, node->left->type);
-                    node->type = node->left->type;
-                }
-                else if(right_is_integral && node->left->type == program->type_integer_literal) {
-                    set_subtree_integer_type(node->left, node->right->type);
-                    node->type = node->right->type;
-                }
-                else {
-                    error_at_token(analyzer->source, node->token, "types of operands are invalid for this operation");
-                    node->type = program->type_void;
-                    success = false;
-                }
-            }
+        bool casted_type_is_signed = left_is_signed || right_is_signed;
+        Type* casted_type = ast->types[left]->size > ast->types[right]->size ? ast->types[left] : ast->types[right];
+        casted_type = casted_type_is_signed ? get_signed_integral_type(program, casted_type) : get_unsigned_integral_type(program, casted_type);
 
-            return success;
-        }
+        implicit_cast(analyzer, left, casted_type);
+        implicit_cast(analyzer, right, casted_type);
+
+        ast->types[node] = casted_type;
+    }
+    else if(left_is_integral && ast->types[right] == program->type_integer_literal) {
+        set_subtree_integer_type(analyzer, right, ast->types[left]);
+        ast->types[node] = ast->types[left];
+    }
+    else if(right_is_integral && ast->types[left] == program->type_integer_literal) {
+        set_subtree_integer_type(analyzer, left, ast->types[right]);
+        ast->types[node] = ast->types[right];
+    }
+    else {
+        error_at_token(analyzer->source, node_token(analyzer, node), "types of operands are invalid for this operation");
+        ast->types[node] = program->type_void;
+        return false;
+    }
 
-        case AST_ASSIGN:
-        {
-            bool success = true;
+    return true;
+}
 
-            success &= process_ast(analyzer, scope, node->left);
-            success &= process_ast(analyzer, scope, node->right);
+internal bool process_assign(Analyzer* analyzer, u32 node) {
+    Program* program = analyzer->program;
+    AST* ast = analyzer->ast;
 
-            if (node->left->kind != AST_VARIABLE) {
-                error_at_token(analyzer->source, node->left->token, "not assignable");
-                success = false;
-            }
+    bool success = true;
 
-            if (node->left->type == node->right->type) {
-                node->type = node->left->type;
-            }
-            else {
-                if (can_coerce_type(program, node->right->type, node->left->type)) {
-                    implicit_cast(analyzer, node->right, node->left->type);
-                    node->type = node->left->type;
-                }
-                else {
-                    error_at_token(analyzer->source, node->token, "types of operands are invalid for this operation");
-                    node->type = program->type_void;
-                    success = false;
-                }
-            }
+    u32 left = ast->a1[node];
+    u32 right = ast->a2[node];
+
+    if (ast->kinds[left] != AST_VARIABLE) {
+        error_at_token(analyzer->source, node_token(analyzer, left), "not assignable");
+        success = false;
+    }
 
-            return success;
+    if (ast->types[left] == ast->types[right]) {
+        ast->types[node] = ast->types[left];
+    }
+    else {
+        if (can_coerce_type(program, ast->types[right], ast->types[left])) {
+            implicit_cast(analyzer, right, ast->types[left]);
+            ast->types[node] = ast->types[left];
+        }
+        else {
+            error_at_token(analyzer->source, node_token(analyzer, node), "types of operands are invalid for this operation");
+            ast->types[node] = program->type_void;
+            success = false;
         }
+    }
 
-        case AST_BLOCK: {
-            bool success = true; 
+    return success;
+}
 
-            Scope inner_scope = {
-                .parent = scope,
-            };
+internal bool process_return(Analyzer* analyzer, u32 node) {
+    Program* program = analyzer->program;
+    AST* ast = analyzer->ast;
 
-            for (ASTNode* child = node->first; child; child = child->next) {
-                success &= process_ast(analyzer, &inner_scope, child);
-            }
+    u32 expression = ast->a1[node];
+    Type* return_type = analyzer->ast_function->return_type;
 
-            return success;
+    if (ast->types[expression] != return_type) {
+        if (can_coerce_type(program, ast->types[expression], return_type)) {
+            implicit_cast(analyzer, expression, return_type);
+            ast->types[node] = return_type;
         }
+        else {
+            error_at_token(analyzer->source, node_token(analyzer, node), "return type does not match the function signature");
+            ast->types[node] = program->type_void;
+            return false;
+        }
+    }
 
-        case AST_RETURN: {
-            bool success = process_ast(analyzer, scope, node->expression);
+    return true;
+}
 
-            if (node->expression->type != analyzer->ast_function->return_type) {
-                if (can_coerce_type(program, node->expression->type, analyzer->ast_function->return_type)) {
-                    implicit_cast(analyzer, node->expression, analyzer->ast_function->return_type);
-                    node->type = analyzer->ast_function->return_type;
-                }
-                else {
-                    error_at_token(analyzer->source, node->token, "return type does not match the function signature");
-                    success = false;
-                    node->type = program->type_void;
-                }
-            }
+internal bool process_variable_decl(Analyzer* analyzer, Scope* scope, u32 node) {
+    AST* ast = analyzer->ast;
 
-            return success;
-        }
+    u32 name = ast->tokens[node] + 1;
+    u32 symbol = analyzer->ast_function->tokens->symbols[name];
 
-        case AST_VARIABLE_DECL: {
-            if (find_variable(scope, node->name)) {
-                error_at_token(analyzer->source, node->name, "variable redefinition");
-                return false;
-            }
+    if (find_variable(analyzer, symbol)) {
+        error_at_token(analyzer->source, token_at(analyzer->source, analyzer->ast_function->tokens, name), "variable redefinition");
+        return false;
+    }
 
-            Variable* variable = arena_push_type(analyzer->arena, Variable);
-            variable->name = node->name;
-            variable->type = node->type;
+    u32 index = ++analyzer->variable_count;
+    assert(index <= ast->variable_count);
 
-            Variable** bucket = &scope->variables;
-            while (*bucket) {
-                bucket = &(*bucket)->next;
-            }
-            *bucket = variable;
+    Variable* variable = ast->variables + index;
+    variable->symbol = symbol;
+    variable->type = ast->types[node];
 
-            node->variable = variable;
+    declare_variable(analyzer, scope, variable);
 
-            return true;
-        }
+    ast->a1[node] = index;
 
-        case AST_IF:
-        case AST_WHILE:
-        {
-            bool success = true;
+    return true;
+}
 
-            success &= process_ast(analyzer, scope, node->conditional.condition);
-            success &= process_ast(analyzer, scope, node->conditional.block_then);
+internal void push_work(Analyzer* analyzer, u32 node, WorkStage stage) {
+    if (analyzer->work_count == analyzer->work_capacity) {
+        u32 capacity = analyzer->work_capacity ? analyzer->work_capacity * 2 : 256;
+        analyzer->work = arena_grow_array(analyzer->scratch, analyzer->work, analyzer->work_count, capacity);
+        analyzer->work_capacity = capacity;
+    }
+
+    analyzer->work[analyzer->work_count++] = (Work){ .node = node, .stage = stage };
+}
 
-            if (node->conditional.block_else) {
-                success &= process_ast(analyzer, scope, node->conditional.block_else);
+internal Scope* push_scope(Analyzer* analyzer) {
+    if (analyzer->scope_count == analyzer->scope_capacity) {
+        u32 capacity = analyzer->scope_capacity ? analyzer->scope_capacity * 2 : 64;
+        analyzer->scopes = arena_grow_array(analyzer->scratch, analyzer->scopes, analyzer->scope_count, capacity);
+        analyzer->scope_capacity = capacity;
+    }
+
+    Scope* scope = analyzer->scopes + analyzer->scope_count++;
+    scope->variables = 0;
+    return scope;
+}
+
+// Walks the tree in the same order as a recursive descent would, children before
+// their parent's checks, using an explicit work stack.
+internal bool process_ast(Analyzer* analyzer, u32 root) {
+    AST* ast = analyzer->ast;
+    bool success = true;
+
+    push_work(analyzer, root, WORK_VISIT);
+
+    while (analyzer->work_count) {
+        Work work = analyzer->work[--analyzer->work_count];
+        u32 node = work.node;
+
+        if (work.stage == WORK_FINISH) {
+            switch (ast->kinds[node]) {
+                default:
+                    assert(false);
+                    break;
+
+                case AST_ADD:
+                case AST_SUB:
+                case AST_MUL:
+                case AST_DIV:
+                case AST_LESS:
+                case AST_LEQUAL:
+                case AST_EQUAL:
+                case AST_NEQUAL:
+                    success &= process_binary(analyzer, node);
+                    break;
+
+                case AST_ASSIGN:
+                    success &= process_assign(analyzer, node);
+                    break;
+
+                case AST_BLOCK:
+                    close_scope(analyzer, analyzer->scopes + --analyzer->scope_count);
+                    break;
+
+                case AST_RETURN:
+                    success &= process_return(analyzer, node);
+                    break;
             }
 
-            return success;
+            continue;
+        }
+
+        if (work.stage == WORK_STATEMENTS && ast->nexts[node]) {
+            push_work(analyzer, ast->nexts[node], WORK_STATEMENTS);
+        }
+
+        static_assert(NUM_AST_KINDS == 18, "not all ast kinds handled");
+        switch (ast->kinds[node]) {
+            default:
+                assert(false);
+                success = false;
+                break;
+
+            case AST_INT_LITERAL:
+                ast->types[node] = analyzer->program->type_integer_literal;
+                break;
+
+            case AST_VARIABLE:
+                success &= resolve_variable(analyzer, node);
+                break;
+
+            case AST_CAST:
+                push_work(analyzer, ast->a1[node], WORK_VISIT);
+                break;
+
+            case AST_ADD:
+            case AST_SUB:
+            case AST_MUL:
+            case AST_DIV:
+            case AST_LESS:
+            case AST_LEQUAL:
+            case AST_EQUAL:
+            case AST_NEQUAL:
+            case AST_ASSIGN:
+                push_work(analyzer, node, WORK_FINISH);
+                push_work(analyzer, ast->a2[node], WORK_VISIT);
+                push_work(analyzer, ast->a1[node], WORK_VISIT);
+                break;
+
+            case AST_BLOCK:
+                push_scope(analyzer);
+                push_work(analyzer, node, WORK_FINISH);
+                if (ast->a1[node]) {
+                    push_work(analyzer, ast->a1[node], WORK_STATEMENTS);
+                }
+                break;
+
+            case AST_RETURN:
+                push_work(analyzer, node, WORK_FINISH);
+                push_work(analyzer, ast->a1[node], WORK_VISIT);
+                break;
+
+            case AST_VARIABLE_DECL:
+                assert(analyzer->scope_count);
+                success &= process_variable_decl(analyzer, analyzer->scopes + analyzer->scope_count - 1, node);
+                break;
+
+            case AST_IF:
+            case AST_WHILE:
+                if (ast->a3[node]) {
+                    push_work(analyzer, ast->a3[node], WORK_VISIT);
+                }
+                push_work(analyzer, ast->a2[node], WORK_VISIT);
+                push_work(analyzer, ast->a1[node], WORK_VISIT);
+                break;
         }
     }
+
+    return success;
 }
 
-bool analyze_semantics(Arena* arena, char* source, Program* program, ASTFunction* ast_function) {
+bool analyze_semantics(Arena* arena, Source* source, Program* program, ASTFunction* ast_function) {
+    AST* ast = &ast_function->ast;
+    ast->variables = arena_push_array(arena, Variable, ast->variable_count + 1);
+
     Analyzer analyzer = {
         .arena = arena,
         .source = source,
         .program = program,
-        .ast_function = ast_function
+        .ast_function = ast_function,
+        .ast = ast,
+        .bindings = arena_push_array(arena, Variable*, program->symbols.count + 1)
     };
 
     ast_function->return_type = program->type_i32;
 
-    return process_ast(&analyzer, 0, ast_function->body);
+    Scratch scratch = get_scratch(arena);
+    analyzer.scratch = scratch.arena;
+
+    bool success = process_ast(&analyzer, ast_function->body);
+
+    release_scratch(&scratch);
+    return success;
 }
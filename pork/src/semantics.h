@@ -2,9 +2,9 @@
 
 #include "types.h"
 
-void init_program(Program* program);
+void init_program(Arena* arena, Program* program);
 
-bool analyze_semantics(Arena* arena, char* source, Program* program, ASTFunction* ast_function);
+bool analyze_semantics(Arena* arena, Source* source, Program* program, ASTFunction* ast_function);
 
 bool type_is_integral(Program* program, Type* type);
 bool type_is_signed_integral(Program* program, Type* type);
@@ -17,13 +17,44 @@ internal u64 fnv1(void* memory, u64 size) {
     return hash;
 }
 
+Set new_set(Arena* arena) {
+    return (Set){ .arena = arena };
+}
+
+internal void set_rehash(Set* set, int capacity) {
+    i64* keys = set->keys;
+    u8* occupancy = set->occupancy;
+    int old_capacity = set->capacity;
+
+    set->keys = arena_push_array(set->arena, i64, capacity);
+    set->occupancy = arena_push_array(set->arena, u8, capacity);
+    set->capacity = capacity;
+    set->count = 0;
+    set->used = 0;
+
+    for (int i = 0; i < old_capacity; ++i) {
+        if (occupancy[i] == OCCUPIED) {
+            set_insert(set, keys[i]);
+        }
+    }
+}
+
 void set_insert(Set* set, i64 key) {
-    u64 hash = fnv1(&key, sizeof(key));
-    int i = hash % SET_CAPACITY;
+    if ((set->used + 1) * 4 > set->capacity * 3) {
+        // Only grow when live keys need the room, otherwise rehashing just clears tombstones.
+        int capacity = set->capacity ? set->capacity : 16;
+        while ((set->count + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+        set_rehash(set, capacity);
+    }
+
+    int mask = set->capacity - 1;
+    int i = fnv1(&key, sizeof(key)) & mask;
 
     int last_grave = -1;
 
-    for (int j = 0; j < SET_CAPACITY; ++j)
+    for (;;)
     {
         switch(set->occupancy[i])  {
             default:
@@ -41,7 +72,13 @@ void set_insert(Set* set, i64 key) {
                 break;
 
             case EMPTY: {
-                int index = last_grave == -1 ? i : last_grave;
+                int index = i;
+                if (last_grave != -1) {
+                    index = last_grave;
+                }
+                else {
+                    ++set->used;
+                }
                 set->keys[index] = key;
                 set->occupancy[index] = OCCUPIED;
                 ++set->count;
@@ -49,17 +86,20 @@ void set_insert(Set* set, i64 key) {
             }
         }
 
-        i = (i+1) % SET_CAPACITY;
+        i = (i+1) & mask;
     }
-
-    assert(false && "set is full");
 }
 
 internal int set_find_index(Set* set, i64 key) {
-    u64 hash = fnv1(&key, sizeof(key));
-    int i = hash % SET_CAPACITY;
+    if (set->count == 0) {
+        return -1;
+    }
 
-    for (int j = 0; j < SET_CAPACITY; ++j)
+    int mask = set->capacity - 1;
+    int i = fnv1(&key, sizeof(key)) & mask;
+
+    // The load limit guarantees an empty slot, so probing always terminates.
+    for (;;)
     {
         switch(set->occupancy[i])  {
             default:
@@ -79,10 +119,8 @@ internal int set_find_index(Set* set, i64 key) {
                 return -1;
         }
 
-        i = (i+1) % SET_CAPACITY;
+        i = (i+1) & mask;
     }
-
-    return -1;
 }
 
 bool set_has(Set* set, i64 key) {
@@ -96,9 +134,17 @@ void set_remove(Set* set, i64 key) {
     --set->count;
 }
 
+void set_clear(Set* set) {
+    if (set->capacity) {
+        memset(set->occupancy, EMPTY, set->capacity);
+    }
+    set->count = 0;
+    set->used = 0;
+}
+
 SetIterator set_begin(Set* set) {
     int index = 0;
-    while (index < SET_CAPACITY && set->occupancy[index] != OCCUPIED) {
+    while (index < set->capacity && set->occupancy[index] != OCCUPIED) {
         ++index;
     }
 
@@ -110,7 +156,7 @@ SetIterator set_begin(Set* set) {
 }
 
 bool set_continue(SetIterator* it) {
-    if (it->index < SET_CAPACITY) {
+    if (it->index < it->set->capacity) {
         it->value = it->set->keys[it->index];
         return true;
     }
@@ -121,5 +167,13 @@ bool set_continue(SetIterator* it) {
 void set_next(SetIterator* it) {
     do {
         ++it->index;
-    } while (it->index < SET_CAPACITY && it->set->occupancy[it->index] != OCCUPIED);
+    } while (it->index < it->set->capacity && it->set->occupancy[it->index] != OCCUPIED);
+}
+
+SparseSet new_sparse_set(Arena* arena, u32 universe) {
+    return (SparseSet){
+        .universe = universe,
+        .dense = arena_push_array(arena, u32, universe),
+        .sparse = arena_push_array(arena, u32, universe)
+    };
 }
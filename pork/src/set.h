@@ -2,12 +2,16 @@
 
 #include "base.h"
 
-#define SET_CAPACITY (1 << 8)
-
+// Open addressing with linear probing. The table lives in the set's arena and doubles
+// when occupied and removed slots pass three quarters of the capacity; a zeroed set
+// with an arena is empty and allocates nothing until the first insert.
 typedef struct {
+    Arena* arena;
     int count;
-    i64 keys[SET_CAPACITY];
-    u8 occupancy[SET_CAPACITY];
+    int used;
+    int capacity;
+    i64* keys;
+    u8* occupancy;
 } Set;
 
 typedef struct {
@@ -16,14 +20,52 @@ typedef struct {
     i64 value;
 } SetIterator;
 
+Set new_set(Arena* arena);
+
 void set_insert(Set* set, i64 key);
 bool set_has(Set* set, i64 key);
 void set_remove(Set* set, i64 key);
+void set_clear(Set* set);
 
 SetIterator set_begin(Set* set);
 bool set_continue(SetIterator* it);
 void set_next(SetIterator* it);
 
-Set set_clone(Set* set);
-
 #define foreach_set(set, it)  for (SetIterator it = set_begin(set); set_continue(&it); set_next(&it))
+
+// Sparse set over 0..universe-1 (Briggs and Torczon): members are packed in dense and
+// sparse maps each member to its slot there. Insert, remove and clear are constant time
+// and iteration visits only the members.
+typedef struct {
+    u32 count;
+    u32 universe;
+    u32* dense;
+    u32* sparse;
+} SparseSet;
+
+SparseSet new_sparse_set(Arena* arena, u32 universe);
+
+static inline bool sparse_set_has(SparseSet* set, u32 value) {
+    u32 slot = set->sparse[value];
+    return slot < set->count && set->dense[slot] == value;
+}
+
+static inline void sparse_set_insert(SparseSet* set, u32 value) {
+    assert(value < set->universe);
+    if (!sparse_set_has(set, value)) {
+        set->sparse[value] = set->count;
+        set->dense[set->count++] = value;
+    }
+}
+
+static inline void sparse_set_remove(SparseSet* set, u32 value) {
+    if (sparse_set_has(set, value)) {
+        u32 last = set->dense[--set->count];
+        set->dense[set->sparse[value]] = last;
+        set->sparse[last] = set->sparse[value];
+    }
+}
+
+static inline void sparse_set_clear(SparseSet* set) {
+    set->count = 0;
+}
@@ -0,0 +1,916 @@
+#include "ssa.h"
+#include "bytecode.h"
+#include "set.h"
+
+// Cooper, Harvey and Kennedy's iterative algorithm. Blocks are numbered in reverse
+// postorder, so walking two blocks up the tree until they meet only ever moves the one
+// with the larger number, and a single sweep suffices unless there are loops.
+DominatorTree* analyze_dominators(Arena* arena, ControlFlowGraph* cfg) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+
+    DominatorTree* tree = arena_push_type(arena, DominatorTree);
+    u32* idom = arena_push_array(arena, u32, block_count);
+    tree->immediate_dominators = idom;
+
+    for (u32 b = 1; b < block_count; ++b) {
+        idom[b] = UINT32_MAX;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (u32 b = 1; b < block_count; ++b) {
+            u32 dominator = UINT32_MAX;
+
+            for (u32 e = cfg->predecessor_offsets[b]; e < cfg->predecessor_offsets[b + 1]; ++e) {
+                u32 p = cfg->predecessors[e];
+                if (idom[p] == UINT32_MAX) {
+                    continue;
+                }
+
+                if (dominator == UINT32_MAX) {
+                    dominator = p;
+                    continue;
+                }
+
+                while (p != dominator) {
+                    while (p > dominator) p = idom[p];
+                    while (dominator > p) dominator = idom[dominator];
+                }
+            }
+
+            // Every block but the entry has a predecessor earlier in reverse postorder.
+            assert(dominator != UINT32_MAX);
+
+            if (idom[b] != dominator) {
+                idom[b] = dominator;
+                changed = true;
+            }
+        }
+    }
+
+    tree->child_offsets = arena_push_array(arena, u32, block_count + 1);
+    tree->children = arena_push_array(arena, u32, block_count);
+
+    for (u32 b = 1; b < block_count; ++b) {
+        ++tree->child_offsets[idom[b] + 1];
+    }
+    for (u32 b = 0; b < block_count; ++b) {
+        tree->child_offsets[b + 1] += tree->child_offsets[b];
+    }
+
+    u32* cursors = arena_push_array(scratch.arena, u32, block_count);
+    for (u32 b = 1; b < block_count; ++b) {
+        tree->children[tree->child_offsets[idom[b]] + cursors[idom[b]]++] = b;
+    }
+
+    // Parents come before their children, so subtree sizes add up from the back and each
+    // child takes the next free range of numbers within its parent's.
+    u32* sizes = arena_push_array(scratch.arena, u32, block_count);
+    for (u32 b = block_count; b-- > 0;) {
+        sizes[b] += 1;
+        if (b) {
+            sizes[idom[b]] += sizes[b];
+        }
+    }
+
+    tree->preorder = arena_push_array(arena, u32, block_count);
+    tree->subtree_ends = arena_push_array(arena, u32, block_count);
+
+    u32* next_free = cursors;
+    next_free[0] = 1;
+    tree->subtree_ends[0] = block_count;
+
+    for (u32 b = 1; b < block_count; ++b) {
+        u32 number = next_free[idom[b]];
+        next_free[idom[b]] += sizes[b];
+        next_free[b] = number + 1;
+        tree->preorder[b] = number;
+        tree->subtree_ends[b] = number + sizes[b];
+    }
+
+    // Frontiers are found from the joins: a join is in the frontier of every block on
+    // the way up from each of its predecessors to its immediate dominator. The first pass
+    // counts, the second fills, and stamps keep a join from being added twice.
+    tree->frontier_offsets = arena_push_array(arena, u32, block_count + 1);
+    u32* added = arena_push_array(scratch.arena, u32, block_count);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            for (u32 b = 0; b < block_count; ++b) {
+                tree->frontier_offsets[b + 1] += tree->frontier_offsets[b];
+                cursors[b] = tree->frontier_offsets[b];
+            }
+            tree->frontiers = arena_push_array(arena, u32, tree->frontier_offsets[block_count]);
+        }
+
+        for (u32 b = 1; b < block_count; ++b) {
+            if (cfg->predecessor_offsets[b + 1] - cfg->predecessor_offsets[b] < 2) {
+                continue;
+            }
+
+            u32 stamp = pass * block_count + b + 1;
+
+            for (u32 e = cfg->predecessor_offsets[b]; e < cfg->predecessor_offsets[b + 1]; ++e) {
+                for (u32 runner = cfg->predecessors[e]; runner != idom[b] && added[runner] != stamp; runner = idom[runner]) {
+                    added[runner] = stamp;
+                    if (pass == 0) {
+                        ++tree->frontier_offsets[runner + 1];
+                    }
+                    else {
+                        tree->frontiers[cursors[runner]++] = b;
+                    }
+                }
+            }
+        }
+    }
+
+    release_scratch(&scratch);
+
+    return tree;
+}
+
+bool dominates(DominatorTree* tree, u32 a, u32 b) {
+    return tree->preorder[a] <= tree->preorder[b] && tree->preorder[b] < tree->subtree_ends[a];
+}
+
+typedef struct {
+    u32 reg;
+    u32 previous;
+} RenameUndo;
+
+SSAForm* construct_ssa(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+    u32 global_count = liveness->global_count;
+    i64 register_count = bytecode->register_count;
+
+    SSAForm* ssa = arena_push_type(arena, SSAForm);
+    DominatorTree* tree = analyze_dominators(arena, cfg);
+    ssa->dominators = tree;
+
+    i64* names = arena_push_array(scratch.arena, i64, register_count);
+    for (i64 i = 0; i < register_count; ++i) {
+        names[i] = -1;
+    }
+    for (u32 g = 0; g < global_count; ++g) {
+        names[liveness->global_registers[g]] = g;
+    }
+
+    // How often each register is defined, and the blocks defining each global name in
+    // compressed rows. The first pass counts, the second fills.
+    u32* definition_counts = arena_push_array(scratch.arena, u32, register_count);
+    u8* types = arena_push_array(scratch.arena, u8, register_count);
+    u32* definition_offsets = arena_push_array(scratch.arena, u32, global_count + 1);
+    u32* definition_blocks = 0;
+    u32* cursors = arena_push_array(scratch.arena, u32, global_count);
+    u32* defined_in = arena_push_array(scratch.arena, u32, global_count);
+    u32 definition_total = 0;
+
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            for (u32 g = 0; g < global_count; ++g) {
+                definition_offsets[g + 1] += definition_offsets[g];
+                cursors[g] = definition_offsets[g];
+            }
+            definition_blocks = arena_push_array(scratch.arena, u32, definition_offsets[global_count]);
+        }
+
+        for (u32 b = 0; b < block_count; ++b) {
+            BasicBlock* block = cfg->blocks + b;
+            u32 stamp = pass * block_count + b + 1;
+
+            for (int i = block->start; i < block->end; ++i) {
+                Instruction* ins = bytecode->instructions + i;
+                u32* uses[2];
+                u32* defined;
+                get_operands(ins, uses, &defined);
+
+                if (!defined) {
+                    continue;
+                }
+
+                i64 name = names[*defined];
+
+                if (pass == 0) {
+                    ++definition_counts[*defined];
+                    ++definition_total;
+                    types[*defined] = ins->type;
+                }
+
+                if (name != -1 && defined_in[name] != stamp) {
+                    defined_in[name] = stamp;
+                    if (pass == 0) {
+                        ++definition_offsets[name + 1];
+                    }
+                    else {
+                        definition_blocks[cursors[name]++] = b;
+                    }
+                }
+            }
+        }
+    }
+
+    // Pruned placement: starting from the blocks defining a name, a phi goes into each
+    // block of their iterated dominance frontier where the name is live in. Only global
+    // names can be live in, the other registers never need one.
+    u32 site_count = 0;
+    u32 site_capacity = 256;
+    u32* site_blocks = arena_push_array(scratch.arena, u32, site_capacity);
+    u32* site_names = arena_push_array(scratch.arena, u32, site_capacity);
+
+    u32* has_phi = arena_push_array(scratch.arena, u32, block_count);
+    u32* queued = arena_push_array(scratch.arena, u32, block_count);
+    u32* worklist = arena_push_array(scratch.arena, u32, block_count);
+
+    for (u32 g = 0; g < global_count; ++g) {
+        u32 work_count = 0;
+        for (u32 d = definition_offsets[g]; d < definition_offsets[g + 1]; ++d) {
+            queued[definition_blocks[d]] = g + 1;
+            worklist[work_count++] = definition_blocks[d];
+        }
+
+        while (work_count) {
+            u32 x = worklist[--work_count];
+
+            for (u32 f = tree->frontier_offsets[x]; f < tree->frontier_offsets[x + 1]; ++f) {
+                u32 y = tree->frontiers[f];
+                if (has_phi[y] == g + 1 || !bitset_has(liveness->live_in + y, g)) {
+                    continue;
+                }
+
+                has_phi[y] = g + 1;
+
+                if (site_count == site_capacity) {
+                    u32 capacity = site_capacity * 2;
+                    site_blocks = arena_grow_array(scratch.arena, site_blocks, site_count, capacity);
+                    site_names = arena_grow_array(scratch.arena, site_names, site_count, capacity);
+                    site_capacity = capacity;
+                }
+                site_blocks[site_count] = y;
+                site_names[site_count] = g;
+                ++site_count;
+
+                if (queued[y] != g + 1) {
+                    queued[y] = g + 1;
+                    worklist[work_count++] = y;
+                }
+            }
+        }
+    }
+
+    ssa->phi_offsets = arena_push_array(arena, u32, block_count + 1);
+    ssa->phis = arena_push_array(arena, Phi, site_count);
+
+    for (u32 s = 0; s < site_count; ++s) {
+        ++ssa->phi_offsets[site_blocks[s] + 1];
+    }
+
+    u32* phi_cursors = arena_push_array(scratch.arena, u32, block_count);
+    for (u32 b = 0; b < block_count; ++b) {
+        ssa->phi_offsets[b + 1] += ssa->phi_offsets[b];
+        phi_cursors[b] = ssa->phi_offsets[b];
+    }
+
+    // Registers defined once and never merged already have a single definition.
+    bool* renamed = arena_push_array(scratch.arena, bool, register_count);
+    for (i64 i = 0; i < register_count; ++i) {
+        renamed[i] = definition_counts[i] > 1;
+    }
+
+    for (u32 s = 0; s < site_count; ++s) {
+        u32 b = site_blocks[s];
+        u32 original = liveness->global_registers[site_names[s]];
+
+        ssa->phis[phi_cursors[b]++] = (Phi){
+            .original = original,
+            .type = types[original],
+            .arguments = arena_push_array(arena, u32, cfg->predecessor_offsets[b + 1] - cfg->predecessor_offsets[b])
+        };
+        renamed[original] = true;
+    }
+
+    // Renaming walks the dominator tree in preorder, with the current name of each register
+    // in place. Names a block introduces are undone from a log once the walk leaves its
+    // subtree. Registers that are read before any definition reaches them keep their old
+    // name, which is no longer defined anywhere.
+    u32* current = arena_push_array(scratch.arena, u32, register_count);
+    for (i64 i = 0; i < register_count; ++i) {
+        current[i] = (u32)i;
+    }
+
+    RenameUndo* undo_log = arena_push_array(scratch.arena, RenameUndo, definition_total + site_count);
+    u32 log_count = 0;
+
+    u32* order = arena_push_array(scratch.arena, u32, block_count);
+    for (u32 b = 0; b < block_count; ++b) {
+        order[tree->preorder[b]] = b;
+    }
+
+    u32* open_blocks = arena_push_array(scratch.arena, u32, block_count);
+    u32* open_logs = arena_push_array(scratch.arena, u32, block_count);
+    u32 open_count = 0;
+
+    for (u32 k = 0; k < block_count; ++k) {
+        u32 b = order[k];
+
+        while (open_count && tree->subtree_ends[open_blocks[open_count - 1]] <= k) {
+            u32 mark = open_logs[--open_count];
+            while (log_count > mark) {
+                RenameUndo undo = undo_log[--log_count];
+                current[undo.reg] = undo.previous;
+            }
+        }
+
+        open_blocks[open_count] = b;
+        open_logs[open_count] = log_count;
+        ++open_count;
+
+        for (u32 p = ssa->phi_offsets[b]; p < ssa->phi_offsets[b + 1]; ++p) {
+            Phi* phi = ssa->phis + p;
+            phi->result = (u32)bytecode->register_count++;
+            undo_log[log_count++] = (RenameUndo){ .reg = phi->original, .previous = current[phi->original] };
+            current[phi->original] = phi->result;
+        }
+
+        BasicBlock* block = cfg->blocks + b;
+        for (int i = block->start; i < block->end; ++i) {
+            u32* uses[2];
+            u32* defined;
+            int use_count = get_operands(bytecode->instructions + i, uses, &defined);
+
+            for (int u = 0; u < use_count; ++u) {
+                *uses[u] = current[*uses[u]];
+            }
+
+            if (defined && renamed[*defined]) {
+                u32 name = (u32)bytecode->register_count++;
+                undo_log[log_count++] = (RenameUndo){ .reg = *defined, .previous = current[*defined] };
+                current[*defined] = name;
+                *defined = name;
+            }
+        }
+
+        for (u32 e = cfg->successor_offsets[b]; e < cfg->successor_offsets[b + 1]; ++e) {
+            u32 successor = cfg->successors[e];
+
+            u32 edge = cfg->predecessor_offsets[successor];
+            while (cfg->predecessors[edge] != b) {
+                ++edge;
+            }
+            edge -= cfg->predecessor_offsets[successor];
+
+            for (u32 p = ssa->phi_offsets[successor]; p < ssa->phi_offsets[successor + 1]; ++p) {
+                Phi* phi = ssa->phis + p;
+                phi->arguments[edge] = current[phi->original];
+            }
+        }
+    }
+
+    release_scratch(&scratch);
+
+    return ssa;
+}
+
+// Copies out of a block go before its jump, or after its last instruction when it falls
+// through, in which case they come ahead of the label of the block that follows.
+internal int find_exit_location(ControlFlowGraph* cfg, Bytecode* bytecode, u32 b, bool* after_label) {
+    BasicBlock* block = cfg->blocks + b;
+
+    if (block->end > block->start) {
+        u8 op = bytecode->instructions[block->end - 1].op;
+        if (op == OP_JMP || op == OP_CJMP) {
+            *after_label = true;
+            return block->end - 1;
+        }
+    }
+
+    *after_label = false;
+    return block->end;
+}
+
+typedef struct {
+    u32 a;
+    u32 b;
+} Interference;
+
+internal u32 find_class(u32* parents, u32 r) {
+    while (parents[r] != r) {
+        parents[r] = parents[parents[r]];
+        r = parents[r];
+    }
+    return r;
+}
+
+internal bool classes_interfere(u32* parents, u32* next_members, u32* neighbor_offsets, u32* neighbors, u32 a, u32 b) {
+    u32 member = a;
+    do {
+        for (u32 n = neighbor_offsets[member]; n < neighbor_offsets[member + 1]; ++n) {
+            if (find_class(parents, neighbors[n]) == b) {
+                return true;
+            }
+        }
+        member = next_members[member];
+    } while (member != a);
+
+    return false;
+}
+
+typedef struct {
+    u32 index;
+    u32 block;
+} Occurrence;
+
+internal Occurrence* push_occurrence(Arena* arena, Occurrence* occurrences, u32* count, u32* capacity, u32 index, u32 block) {
+    if (*count == *capacity) {
+        u32 grown = *capacity * 2;
+        occurrences = arena_grow_array(arena, occurrences, *count, grown);
+        *capacity = grown;
+    }
+    occurrences[(*count)++] = (Occurrence){ .index = index, .block = block };
+    return occurrences;
+}
+
+// Sorts occurrences into compressed rows keyed by register, or by block when by_block is
+// set, keeping the other half.
+internal u32* group_occurrences(Arena* arena, Occurrence* occurrences, u32 count, u32 key_count, bool by_block, u32** offsets_out) {
+    u32* offsets = arena_push_array(arena, u32, key_count + 1);
+    u32* values = arena_push_array(arena, u32, count);
+
+    for (u32 o = 0; o < count; ++o) {
+        ++offsets[(by_block ? occurrences[o].block : occurrences[o].index) + 1];
+    }
+
+    Scratch scratch = get_scratch(arena);
+    u32* cursors = arena_push_array(scratch.arena, u32, key_count);
+    for (u32 k = 0; k < key_count; ++k) {
+        offsets[k + 1] += offsets[k];
+        cursors[k] = offsets[k];
+    }
+
+    for (u32 o = 0; o < count; ++o) {
+        Occurrence occurrence = occurrences[o];
+        if (by_block) {
+            values[cursors[occurrence.block]++] = occurrence.index;
+        } else {
+            values[cursors[occurrence.index]++] = occurrence.block;
+        }
+    }
+
+    release_scratch(&scratch);
+    *offsets_out = offsets;
+    return values;
+}
+
+// Live-out rows of just the related registers. Each one is followed backward from the
+// blocks using it before any definition there, stopping at blocks that define it, so the
+// work is bounded by the size of the sets rather than by blocks times every name in the
+// function, which after renaming is most of its registers.
+internal u32* analyze_related_liveness(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, u32* indices, u32 related_count, u32** live_out_offsets) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+
+    u32 use_count = 0;
+    u32 use_capacity = 256;
+    Occurrence* uses = arena_push_array(scratch.arena, Occurrence, use_capacity);
+
+    u32 def_count = 0;
+    u32 def_capacity = 256;
+    Occurrence* defs = arena_push_array(scratch.arena, Occurrence, def_capacity);
+
+    // Block + 1 of the last definition seen.
+    u32* defined_in = arena_push_array(scratch.arena, u32, related_count);
+
+    for (u32 b = 0; b < block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+
+        for (int i = block->start; i < block->end; ++i) {
+            Instruction* ins = bytecode->instructions + i;
+            u32* operands[2];
+            u32* defined;
+            int operand_count = get_operands(ins, operands, &defined);
+
+            for (int u = 0; u < operand_count; ++u) {
+                u32 index = indices[*operands[u]];
+                if (index != UINT32_MAX && defined_in[index] != b + 1) {
+                    uses = push_occurrence(scratch.arena, uses, &use_count, &use_capacity, index, b);
+                }
+            }
+
+            if (defined && indices[*defined] != UINT32_MAX) {
+                u32 index = indices[*defined];
+                if (defined_in[index] != b + 1) {
+                    defs = push_occurrence(scratch.arena, defs, &def_count, &def_capacity, index, b);
+                    defined_in[index] = b + 1;
+                }
+            }
+        }
+    }
+
+    u32* use_offsets;
+    u32* use_blocks = group_occurrences(scratch.arena, uses, use_count, related_count, false, &use_offsets);
+    u32* def_offsets;
+    u32* def_blocks = group_occurrences(scratch.arena, defs, def_count, related_count, false, &def_offsets);
+
+    u32 live_count = 0;
+    u32 live_capacity = 256;
+    Occurrence* live = arena_push_array(scratch.arena, Occurrence, live_capacity);
+
+    // Register index + 1 of the last walk to mark each block.
+    u32* defines = arena_push_array(scratch.arena, u32, block_count);
+    u32* live_in = arena_push_array(scratch.arena, u32, block_count);
+    u32* live_out = arena_push_array(scratch.arena, u32, block_count);
+    u32* worklist = arena_push_array(scratch.arena, u32, block_count);
+
+    for (u32 r = 0; r < related_count; ++r) {
+        u32 stamp = r + 1;
+        u32 work_count = 0;
+
+        for (u32 d = def_offsets[r]; d < def_offsets[r + 1]; ++d) {
+            defines[def_blocks[d]] = stamp;
+        }
+
+        for (u32 u = use_offsets[r]; u < use_offsets[r + 1]; ++u) {
+            u32 b = use_blocks[u];
+            if (live_in[b] != stamp) {
+                live_in[b] = stamp;
+                worklist[work_count++] = b;
+            }
+        }
+
+        while (work_count) {
+            u32 b = worklist[--work_count];
+
+            for (u32 e = cfg->predecessor_offsets[b]; e < cfg->predecessor_offsets[b + 1]; ++e) {
+                u32 p = cfg->predecessors[e];
+
+                if (live_out[p] != stamp) {
+                    live_out[p] = stamp;
+                    live = push_occurrence(scratch.arena, live, &live_count, &live_capacity, r, p);
+                }
+
+                if (defines[p] != stamp && live_in[p] != stamp) {
+                    live_in[p] = stamp;
+                    worklist[work_count++] = p;
+                }
+            }
+        }
+    }
+
+    u32* result = group_occurrences(arena, live, live_count, block_count, true, live_out_offsets);
+    release_scratch(&scratch);
+    return result;
+}
+
+// Gives the registers around a phi one name wherever their live ranges allow, which
+// straight out of construction is everywhere. Interference is only computed among these
+// registers, and merged classes keep their members in circular lists so a merge can
+// check every pair. Copies left within one class are dropped.
+internal void coalesce_phi_copies(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, SSAForm* ssa, u32* phi_registers) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+    i64 register_count = bytecode->register_count;
+
+    u32 phi_count = ssa->phi_offsets[block_count];
+    u32 argument_count = 0;
+    for (u32 b = 0; b < block_count; ++b) {
+        u32 predecessor_count = cfg->predecessor_offsets[b + 1] - cfg->predecessor_offsets[b];
+        argument_count += (ssa->phi_offsets[b + 1] - ssa->phi_offsets[b]) * predecessor_count;
+    }
+
+    // Dense indices for the registers the copies connect.
+    u32* indices = arena_push_array(scratch.arena, u32, register_count);
+    for (i64 i = 0; i < register_count; ++i) {
+        indices[i] = UINT32_MAX;
+    }
+
+    u32 related_count = 0;
+    u32* related = arena_push_array(scratch.arena, u32, phi_count * 2 + argument_count);
+
+    for (u32 b = 0; b < block_count; ++b) {
+        u32 predecessor_count = cfg->predecessor_offsets[b + 1] - cfg->predecessor_offsets[b];
+
+        for (u32 p = ssa->phi_offsets[b]; p < ssa->phi_offsets[b + 1]; ++p) {
+            Phi* phi = ssa->phis + p;
+            u32 registers[] = { phi->result, phi_registers[p] };
+
+            for (u32 r = 0; r < 2 + predecessor_count; ++r) {
+                u32 reg = r < 2 ? registers[r] : phi->arguments[r - 2];
+                if (indices[reg] == UINT32_MAX) {
+                    indices[reg] = related_count;
+                    related[related_count++] = reg;
+                }
+            }
+        }
+    }
+
+    // Walking each block backward, a register defined interferes with every other one
+    // live past the definition, except the source of a copy.
+    u32 interference_count = 0;
+    u32 interference_capacity = 256;
+    Interference* interferences = arena_push_array(scratch.arena, Interference, interference_capacity);
+
+    u32* live_out_offsets;
+    u32* live_out = analyze_related_liveness(scratch.arena, cfg, bytecode, indices, related_count, &live_out_offsets);
+
+    SparseSet live = new_sparse_set(scratch.arena, related_count);
+
+    for (u32 b = 0; b < block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+
+        sparse_set_clear(&live);
+        for (u32 l = live_out_offsets[b]; l < live_out_offsets[b + 1]; ++l) {
+            sparse_set_insert(&live, live_out[l]);
+        }
+
+        for (int i = block->end; i-- > block->start;) {
+            Instruction* ins = bytecode->instructions + i;
+            u32* uses[2];
+            u32* defined;
+            int use_count = get_operands(ins, uses, &defined);
+
+            if (defined && indices[*defined] != UINT32_MAX) {
+                u32 index = indices[*defined];
+                u32 source = ins->op == OP_COPY ? indices[ins->a2] : UINT32_MAX;
+
+                for (u32 l = 0; l < live.count; ++l) {
+                    u32 other = live.dense[l];
+                    if (other == index || other == source) {
+                        continue;
+                    }
+
+                    if (interference_count == interference_capacity) {
+                        u32 capacity = interference_capacity * 2;
+                        interferences = arena_grow_array(scratch.arena, interferences, interference_count, capacity);
+                        interference_capacity = capacity;
+                    }
+                    interferences[interference_count++] = (Interference){ .a = index, .b = other };
+                }
+
+                sparse_set_remove(&live, index);
+            }
+
+            for (int u = 0; u < use_count; ++u) {
+                u32 index = indices[*uses[u]];
+                if (index != UINT32_MAX) {
+                    sparse_set_insert(&live, index);
+                }
+            }
+        }
+    }
+
+    u32* neighbor_offsets = arena_push_array(scratch.arena, u32, related_count + 1);
+    u32* neighbors = arena_push_array(scratch.arena, u32, (u64)interference_count * 2);
+
+    for (u32 e = 0; e < interference_count; ++e) {
+        ++neighbor_offsets[interferences[e].a + 1];
+        ++neighbor_offsets[interferences[e].b + 1];
+    }
+
+    u32* cursors = arena_push_array(scratch.arena, u32, related_count);
+    for (u32 r = 0; r < related_count; ++r) {
+        neighbor_offsets[r + 1] += neighbor_offsets[r];
+        cursors[r] = neighbor_offsets[r];
+    }
+
+    for (u32 e = 0; e < interference_count; ++e) {
+        neighbors[cursors[interferences[e].a]++] = interferences[e].b;
+        neighbors[cursors[interferences[e].b]++] = interferences[e].a;
+    }
+
+    u32* parents = arena_push_array(scratch.arena, u32, related_count);
+    u32* next_members = arena_push_array(scratch.arena, u32, related_count);
+    u32* sizes = arena_push_array(scratch.arena, u32, related_count);
+    for (u32 r = 0; r < related_count; ++r) {
+        parents[r] = r;
+        next_members[r] = r;
+        sizes[r] = 1;
+    }
+
+    for (u32 b = 0; b < block_count; ++b) {
+        u32 predecessor_count = cfg->predecessor_offsets[b + 1] - cfg->predecessor_offsets[b];
+
+        for (u32 p = ssa->phi_offsets[b]; p < ssa->phi_offsets[b + 1]; ++p) {
+            Phi* phi = ssa->phis + p;
+            u32 phi_index = indices[phi_registers[p]];
+
+            for (u32 r = 0; r < 1 + predecessor_count; ++r) {
+                u32 reg = r == 0 ? phi->result : phi->arguments[r - 1];
+
+                u32 a = find_class(parents, phi_index);
+                u32 c = find_class(parents, indices[reg]);
+                if (a == c) {
+                    continue;
+                }
+
+                if (sizes[a] > sizes[c]) {
+                    u32 swap = a;
+                    a = c;
+                    c = swap;
+                }
+
+                if (classes_interfere(parents, next_members, neighbor_offsets, neighbors, a, c)) {
+                    continue;
+                }
+
+                parents[a] = c;
+                sizes[c] += sizes[a];
+                u32 next = next_members[a];
+                next_members[a] = next_members[c];
+                next_members[c] = next;
+            }
+        }
+    }
+
+    for (int i = 0; i < bytecode->length; ++i) {
+        Instruction* ins = bytecode->instructions + i;
+        u32* uses[2];
+        u32* defined;
+        int use_count = get_operands(ins, uses, &defined);
+
+        for (int u = 0; u < use_count; ++u) {
+            if (indices[*uses[u]] != UINT32_MAX) {
+                *uses[u] = related[find_class(parents, indices[*uses[u]])];
+            }
+        }
+
+        if (defined && indices[*defined] != UINT32_MAX) {
+            *defined = related[find_class(parents, indices[*defined])];
+        }
+
+        if (ins->op == OP_COPY && ins->a1 == ins->a2) {
+            ins->op = OP_NOOP;
+        }
+    }
+
+    release_scratch(&scratch);
+}
+
+// Passes on SSA form leave what they remove as OP_NOOPs, since the phis are tied to the
+// blocks, and so does coalescing.
+internal void drop_noops(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode) {
+    for (int i = 0; i < bytecode->length; ++i) {
+        if (bytecode->instructions[i].op == OP_NOOP) {
+            remove_noops(arena, cfg, bytecode);
+            return;
+        }
+    }
+}
+
+// Each phi gets a register of its own. Every predecessor copies its argument into it just
+// before leaving, and the block copies it into the result on entry. No edge has to be
+// split: a predecessor with two successors also makes its copies on the way to the other
+// one, where nothing reads the phi's register. Going through these registers also keeps
+// phis of one block that read each other's results from clobbering one another.
+void destruct_ssa(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, SSAForm* ssa) {
+    Scratch scratch = get_scratch(arena);
+    u32 block_count = cfg->block_count;
+    int length = bytecode->length;
+
+    u32 phi_count = ssa->phi_offsets[block_count];
+    if (!phi_count) {
+        release_scratch(&scratch);
+        drop_noops(arena, cfg, bytecode);
+        return;
+    }
+
+    u32* phi_registers = arena_push_array(scratch.arena, u32, phi_count);
+    for (u32 p = 0; p < phi_count; ++p) {
+        phi_registers[p] = (u32)bytecode->register_count++;
+    }
+
+    // Copies are grouped by the instruction they go before, those ahead of its label first.
+    // Into a block go before anything leaving it, for blocks that are a single jump.
+    u32* copy_offsets = arena_push_array(scratch.arena, u32, length + 2);
+    u32* before_label_counts = arena_push_array(scratch.arena, u32, length + 1);
+
+    for (u32 b = 0; b < block_count; ++b) {
+        u32 entering = ssa->phi_offsets[b + 1] - ssa->phi_offsets[b];
+        copy_offsets[cfg->blocks[b].start + 1] += entering;
+
+        u32 leaving = 0;
+        for (u32 e = cfg->successor_offsets[b]; e < cfg->successor_offsets[b + 1]; ++e) {
+            u32 successor = cfg->successors[e];
+            leaving += ssa->phi_offsets[successor + 1] - ssa->phi_offsets[successor];
+        }
+
+        if (leaving) {
+            bool after_label;
+            int location = find_exit_location(cfg, bytecode, b, &after_label);
+            copy_offsets[location + 1] += leaving;
+            if (!after_label) {
+                before_label_counts[location] += leaving;
+            }
+        }
+    }
+
+    u32* cursors = arena_push_array(scratch.arena, u32, length + 1);
+    for (int i = 0; i <= length; ++i) {
+        copy_offsets[i + 1] += copy_offsets[i];
+        cursors[i] = copy_offsets[i];
+    }
+
+    u32 copy_count = copy_offsets[length + 1];
+    Instruction* copies = arena_push_array(scratch.arena, Instruction, copy_count);
+
+    for (int kind = 0; kind < 3; ++kind) {
+        for (u32 b = 0; b < block_count; ++b) {
+            if (kind == 1) {
+                for (u32 p = ssa->phi_offsets[b]; p < ssa->phi_offsets[b + 1]; ++p) {
+                    Phi* phi = ssa->phis + p;
+                    copies[cursors[cfg->blocks[b].start]++] = (Instruction){ .op = OP_COPY, .type = phi->type, .a1 = phi->result, .a2 = phi_registers[p] };
+                }
+                continue;
+            }
+
+            bool after_label;
+            int location = find_exit_location(cfg, bytecode, b, &after_label);
+            if (after_label != (kind == 2)) {
+                continue;
+            }
+
+            for (u32 e = cfg->successor_offsets[b]; e < cfg->successor_offsets[b + 1]; ++e) {
+                u32 successor = cfg->successors[e];
+
+                u32 edge = cfg->predecessor_offsets[successor];
+                while (cfg->predecessors[edge] != b) {
+                    ++edge;
+                }
+                edge -= cfg->predecessor_offsets[successor];
+
+                for (u32 p = ssa->phi_offsets[successor]; p < ssa->phi_offsets[successor + 1]; ++p) {
+                    Phi* phi = ssa->phis + p;
+                    copies[cursors[location]++] = (Instruction){ .op = OP_COPY, .type = phi->type, .a1 = phi_registers[p], .a2 = phi->arguments[edge] };
+                }
+            }
+        }
+    }
+
+    Instruction* instructions = arena_push_array(scratch.arena, Instruction, length);
+    int* labels = arena_push_array(scratch.arena, int, length);
+    int* lines = arena_push_array(scratch.arena, int, length);
+    memcpy(instructions, bytecode->instructions, sizeof(Instruction) * length);
+    memcpy(labels, bytecode->labels, sizeof(int) * length);
+    memcpy(lines, bytecode->lines, sizeof(int) * length);
+
+    reserve_instructions(arena, bytecode, length + (int)copy_count);
+
+    // Where the label of each instruction ends up, after the copies ahead of it.
+    int* locations = arena_push_array(scratch.arena, int, length + 1);
+    int out = 0;
+
+    for (int i = 0; i <= length; ++i) {
+        u32 copy = copy_offsets[i];
+        u32 label_copy = copy + before_label_counts[i];
+        int line = i < length ? lines[i] : INT32_MAX;
+
+        for (; copy < label_copy; ++copy) {
+            bytecode->instructions[out] = copies[copy];
+            bytecode->labels[out] = -1;
+            bytecode->lines[out] = line;
+            ++out;
+        }
+
+        locations[i] = out;
+        if (i == length) {
+            break;
+        }
+
+        int label = labels[i];
+        for (; copy < copy_offsets[i + 1]; ++copy) {
+            bytecode->instructions[out] = copies[copy];
+            bytecode->labels[out] = label;
+            bytecode->lines[out] = line;
+            label = -1;
+            ++out;
+        }
+
+        bytecode->instructions[out] = instructions[i];
+        bytecode->labels[out] = label;
+        bytecode->lines[out] = line;
+        ++out;
+    }
+
+    bytecode->length = out;
+
+    for (int i = 0; i < bytecode->label_count; ++i) {
+        bytecode->label_locations[i] = locations[bytecode->label_locations[i]];
+    }
+
+    // Copies ahead of a label belong to the block before it, which is only empty for the
+    // entry.
+    for (u32 b = 0; b < block_count; ++b) {
+        BasicBlock* block = cfg->blocks + b;
+        int start = block->start;
+        block->start = block->end > start ? locations[start] : locations[start] - (int)before_label_counts[start];
+        block->end = locations[block->end];
+    }
+
+    coalesce_phi_copies(arena, cfg, bytecode, ssa, phi_registers);
+
+    release_scratch(&scratch);
+
+    drop_noops(arena, cfg, bytecode);
+}
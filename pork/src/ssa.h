@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.h"
+
+// Blocks are numbered as in the control flow graph, where every dominator of a block has a
+// smaller number than the block. Children and dominance frontiers are stored in
+// compressed rows like the edges.
+typedef struct {
+    u32* immediate_dominators; // The entry is its own.
+
+    u32* child_offsets;
+    u32* children;
+
+    u32* frontier_offsets;
+    u32* frontiers;
+
+    // Numbers in a preorder walk of the tree. Block a dominates block b exactly when
+    // preorder[a] <= preorder[b] < subtree_ends[a].
+    u32* preorder;
+    u32* subtree_ends;
+} DominatorTree;
+
+DominatorTree* analyze_dominators(Arena* arena, ControlFlowGraph* cfg);
+bool dominates(DominatorTree* tree, u32 a, u32 b);
+
+// Phis are kept beside the instructions, at the start of their block. Argument i is the
+// value coming in over the i-th predecessor edge of the block.
+typedef struct {
+    u32 result;
+    u32 original; // The register merged, before renaming.
+    u8 type;
+    u32* arguments;
+} Phi;
+
+// The phis of block b are phis[phi_offsets[b]] up to phis[phi_offsets[b + 1]].
+typedef struct {
+    DominatorTree* dominators;
+
+    u32* phi_offsets;
+    Phi* phis;
+} SSAForm;
+
+// Places phis where liveness says a merged value is still needed, then renames every
+// register defined more than once or merged by a phi so each has a single definition.
+// Registers only get new names, the liveness passed in no longer matches afterwards.
+SSAForm* construct_ssa(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, Liveness* liveness);
+
+// Lowers the phis to copies, merging the registers around each phi where they don't
+// interfere and leaving the rest for the register allocator to coalesce. OP_NOOPs are
+// dropped and the graph rebuilt, so liveness has to be analyzed again.
+void destruct_ssa(Arena* arena, ControlFlowGraph* cfg, Bytecode* bytecode, SSAForm* ssa);
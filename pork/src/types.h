@@ -1,12 +1,13 @@
 #pragma once
 
 #include "base.h"
-#include "set.h"
+#include "bitset.h"
 
+// Single character tokens use their ASCII value, so every kind fits in a byte.
 enum {
     TOKEN_EOF = 0,
 
-    TOKEN_INT_LITERAL = 256,
+    TOKEN_INT_LITERAL = 128,
     TOKEN_IDENTIFIER,
 
     TOKEN_LESS_EQUAL,
@@ -28,15 +29,38 @@ enum {
     TOKEN_I32,
     TOKEN_I16,
     TOKEN_I8,
+
+    TOKEN_UNKNOWN,
 };
 
+static_assert(TOKEN_UNKNOWN <= UINT8_MAX, "token kinds must fit in a byte");
+
+typedef struct {
+    char* memory;
+    u64 length;
+} Source;
+
 typedef struct {
     int kind;
     char* memory;
     int length;
     int line;
+    u32 symbol;
 } Token;
 
+// The whole source is lexed up front into parallel arrays. Token lines live in a
+// side table: line_starts[i] is the index of the first token on or after line i+1.
+typedef struct {
+    u32 count;
+    u8* kinds;
+    u32* offsets;
+    u32* lengths;
+    u32* symbols;
+
+    u32 line_count;
+    u32* line_starts;
+} TokenBuffer;
+
 typedef enum {
     AST_UNINITIALIZED,
 
@@ -88,19 +112,34 @@ struct Type {
     u64 size;
 };
 
+// Identifiers are interned while lexing. Symbol ids are dense and start at 1;
+// 0 marks tokens that aren't identifiers.
+typedef struct {
+    u32 count;
+    u32 capacity;
+    char** names;
+    u32* lengths;
+    u32* hashes;
+
+    u32 slot_count;
+    u32* slots;
+} SymbolTable;
+
 typedef struct Variable Variable;
 struct Variable {
     Variable* next;
-    Token name;
+    Variable* shadowed;
+    u32 symbol;
     i64 reg;
     Type* type;
 };
 
-#define MAX_TYPE_COUNT 1024
-
+// Types are allocated one at a time so pointers to them stay valid as more are added.
 typedef struct {
+    Arena* arena;
+    SymbolTable symbols;
+
     u32 type_count;
-    Type types[MAX_TYPE_COUNT];
 
     Type* type_void;
     Type* type_integer_literal;
@@ -122,39 +161,45 @@ typedef struct {
     };
 } Program;
 
-typedef struct ASTNode ASTNode;
-struct ASTNode {
-    ASTKind kind;
-    ASTNode* next;
-    Token token;
-    Type* type;
+// Nodes live in parallel pools addressed by u32 index; index 0 is the null node.
+// The meaning of the three operand slots depends on the kind:
+//
+//   AST_INT_LITERAL    a1 = index into literals
+//   AST_VARIABLE       a1 = index into variables (after semantic analysis)
+//   AST_CAST           a1 = expression
+//   binary operators   a1 = left, a2 = right
+//   AST_ASSIGN         a1 = left, a2 = right
+//   AST_BLOCK          a1 = first statement
+//   AST_RETURN         a1 = expression
+//   AST_VARIABLE_DECL  a1 = index into variables, the name is the token after the type
+//   AST_IF, AST_WHILE  a1 = condition, a2 = then block, a3 = else block
+typedef struct {
+    u32 count;
+    u32 capacity;
 
-    union {
-        u64 int_literal;
-        struct {
-            ASTNode* left;           
-            ASTNode* right;
-        };
-        ASTNode* first;
-        ASTNode* expression;
-        Token name;
-        Variable* variable;
-        struct {
-            ASTNode* condition;
-            ASTNode* block_then;
-            ASTNode* block_else;
-        } conditional;
-    };
-};
+    u8* kinds;
+    u32* tokens;
+    Type** types;
+    u32* nexts;
+    u32* a1;
+    u32* a2;
+    u32* a3;
+
+    u32 literal_count;
+    u32 literal_capacity;
+    u64* literals;
+
+    u32 variable_count;
+    Variable* variables;
+} AST;
 
 typedef struct {
     Type* return_type;
-    ASTNode* body;
+    TokenBuffer* tokens;
+    AST ast;
+    u32 body;
 } ASTFunction;
 
-#define MAX_INSTRUCTION_COUNT (1 << 13)
-#define MAX_LABEL_COUNT (1 << 10)
-
 typedef enum {
     OP_INVALID,
     OP_NOOP,
@@ -163,6 +208,9 @@ typedef enum {
     OP_COPY,
     OP_CAST,
 
+    OP_SPILL,
+    OP_RELOAD,
+
     OP_ADD,
     OP_SUB,
     OP_MUL,
@@ -180,47 +228,74 @@ typedef enum {
     NUM_OPS
 } Op;
 
+// Operands are registers, except for the constant index of OP_IMM, label indices of
+// jumps, the source OpType of OP_CAST and the stack slot of OP_SPILL (a1) and
+// OP_RELOAD (a2).
 typedef struct {
-    Op op;
-    OpType type;
-    i64 a1;
-    i64 a2;
-    i64 a3;
-    int label;
-    int line;
+    u8 op;
+    u8 type;
+    u32 a1;
+    u32 a2;
+    u32 a3;
 } Instruction;
 
+static_assert(NUM_OPS <= UINT8_MAX && NUM_OP_TYPES <= UINT8_MAX, "ops and op types must fit in a byte");
+static_assert(sizeof(Instruction) == 16, "instructions should stay compact");
+
+// Only the instructions, constants and label locations are needed to execute. The
+// label and line tables, indexed by instruction, are for the compiler and diagnostics.
+// All arrays live in the arena the bytecode was generated in and grow with it.
 typedef struct {
     int length;
-    Instruction instructions[MAX_INSTRUCTION_COUNT];
+    int capacity;
+    Instruction* instructions;
+    int* labels;
+    int* lines;
+
+    u32 constant_count;
+    u32 constant_capacity;
+    i64* constants;
 
     int label_count;
-    int label_locations[MAX_LABEL_COUNT];
+    int* label_locations;
 
     i64 register_count;
+    i64 slot_count; // Stack slots for registers the allocator spilled.
 } Bytecode;
 
-typedef struct BasicBlock BasicBlock;
-struct BasicBlock {
-    int index;
-    BasicBlock* next;
+typedef struct {
+    int start;
+    int end;
+} BasicBlock;
 
-    bool has_user_code;
-    bool reachable;
-    int first_line;
+// Only reachable blocks are kept, numbered in reverse postorder so the entry is block 0.
+// Edges are stored in compressed rows: the successors of block b are
+// successors[successor_offsets[b]] up to successors[successor_offsets[b + 1]], and the
+// predecessors likewise.
+typedef struct {
+    u32 block_count;
+    BasicBlock* blocks;
 
-    Set ue_var;
-    Set var_kill;
-    Set live_out;
+    u32* successor_offsets;
+    u32* successors;
 
-    int start;
-    int end;
+    u32* predecessor_offsets;
+    u32* predecessors;
+} ControlFlowGraph;
+
+// Only registers used in some block before being defined there can be live across a
+// block boundary. Those get dense global names so the per-block bitsets stay small;
+// temporaries that live inside one block are left out.
+typedef struct {
+    u32 global_count;
+    u32* global_registers;
 
-    int successor_count;
-    BasicBlock* successors[2];
+    // Indexed by block, over global names.
+    Bitset* live_in;
+    Bitset* live_out;
 
-    int predecessor_count;
-    BasicBlock** predecessors;
-};
+    u32 visit_count; // Blocks the solver visited before reaching the fixpoint.
+} Liveness;
 
-ASTNode* new_ast_node(Arena* arena, ASTKind kind, Token token);
+u32 new_ast_node(Arena* arena, AST* ast, ASTKind kind, u32 token);
+u32 new_ast_literal(Arena* arena, AST* ast, u32 token, u64 value);
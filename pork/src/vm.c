@@ -1,16 +1,86 @@
 #include "vm.h"
 #include <stdio.h>
 
-#define VM_REGISTER_COUNT 8
+i64 wrap_to_type(OpType type, i64 value) {
+    switch (type) {
+        default:
+            return value;
+        case OP_U32:
+            return (u32)value;
+        case OP_U16:
+            return (u16)value;
+        case OP_U8:
+            return (u8)value;
+        case OP_I32:
+            return (i32)value;
+        case OP_I16:
+            return (i16)value;
+        case OP_I8:
+            return (i8)value;
+    }
+}
+
+i64 evaluate_binary(Op op, OpType type, i64 left, i64 right) {
+    bool is_unsigned = type >= OP_U64 && type <= OP_U8;
+
+    // Wrapping arithmetic is done on unsigned values to stay clear of signed overflow.
+    u64 l = (u64)left;
+    u64 r = (u64)right;
+    i64 result = 0;
+
+    switch (op) {
+        default:
+            assert(false);
+            break;
+
+        case OP_ADD:
+            result = (i64)(l + r);
+            break;
+        case OP_SUB:
+            result = (i64)(l - r);
+            break;
+        case OP_MUL:
+            result = (i64)(l * r);
+            break;
+        case OP_DIV:
+            if (is_unsigned) {
+                result = (i64)(l / r);
+            }
+            else if (right == -1) {
+                result = (i64)(0 - l);
+            }
+            else {
+                result = left / right;
+            }
+            break;
+
+        case OP_LESS:
+            result = is_unsigned ? l < r : left < right;
+            break;
+        case OP_LEQUAL:
+            result = is_unsigned ? l <= r : left <= right;
+            break;
+        case OP_EQUAL:
+            result = left == right;
+            break;
+        case OP_NEQUAL:
+            result = left != right;
+            break;
+    }
+
+    return wrap_to_type(type, result);
+}
 
 i64 vm_execute(Bytecode* bytecode) {
-    i64 regs[VM_REGISTER_COUNT] = {0};
+    Scratch scratch = get_scratch(0);
+    i64* regs = arena_push_array(scratch.arena, i64, bytecode->register_count);
+    i64* slots = arena_push_array(scratch.arena, i64, bytecode->slot_count);
 
     for (int i = 0; i < bytecode->length;)
     {
         Instruction* ins = bytecode->instructions + i;
 
-        static_assert(NUM_OPS == 16, "not all ops handled");
+        static_assert(NUM_OPS == 18, "not all ops handled");
         switch (ins->op) {
             default:
                 assert(false);
@@ -20,42 +90,38 @@ i64 vm_execute(Bytecode* bytecode) {
                 break;
 
             case OP_IMM:
-                regs[ins->a1] = ins->a2;
+                regs[ins->a1] = bytecode->constants[ins->a2];
                 break;
             case OP_COPY:
                 regs[ins->a1] = regs[ins->a2];
                 break;
             case OP_CAST:
-                regs[ins->a1] = regs[ins->a2];
+                regs[ins->a1] = wrap_to_type(ins->type, regs[ins->a2]);
                 break;
 
-            case OP_ADD:
-                regs[ins->a1] = regs[ins->a2] + regs[ins->a3];
+            case OP_SPILL:
+                slots[ins->a1] = regs[ins->a2];
                 break;
-            case OP_SUB:
-                regs[ins->a1] = regs[ins->a2] - regs[ins->a3];
+            case OP_RELOAD:
+                regs[ins->a1] = slots[ins->a2];
                 break;
+
+            case OP_ADD:
+            case OP_SUB:
             case OP_MUL:
-                regs[ins->a1] = regs[ins->a2] * regs[ins->a3];
-                break;
             case OP_DIV:
-                regs[ins->a1] = regs[ins->a2] / regs[ins->a3];
-                break;
             case OP_LESS:
-                regs[ins->a1] = regs[ins->a2] < regs[ins->a3];
-                break;
             case OP_LEQUAL:
-                regs[ins->a1] = regs[ins->a2] <= regs[ins->a3];
-                break;
             case OP_EQUAL:
-                regs[ins->a1] = regs[ins->a2] == regs[ins->a3];
-                break;
             case OP_NEQUAL:
-                regs[ins->a1] = regs[ins->a2] != regs[ins->a3];
+                regs[ins->a1] = evaluate_binary(ins->op, ins->type, regs[ins->a2], regs[ins->a3]);
                 break;
 
-            case OP_RET:
-                return regs[ins->a1];
+            case OP_RET: {
+                i64 result = regs[ins->a1];
+                release_scratch(&scratch);
+                return result;
+            }
 
             case OP_JMP: {
                 i64 label = ins->a1;
@@ -74,5 +140,6 @@ i64 vm_execute(Bytecode* bytecode) {
     }
 
     printf("No return.\n");
+    release_scratch(&scratch);
     return 0;
 }
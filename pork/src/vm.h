@@ -3,3 +3,8 @@
 #include "types.h"
 
 i64 vm_execute(Bytecode* bytecode);
+
+// Arithmetic follows the op type: results wrap to its width, and unsigned types
+// compare and divide as unsigned. Constant folding evaluates through these too.
+i64 wrap_to_type(OpType type, i64 value);
+i64 evaluate_binary(Op op, OpType type, i64 left, i64 right);